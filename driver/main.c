@@ -19,6 +19,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef ALNSB_USE_MPI
+# include <mpi.h>
+#endif
 
 #include <utilities/environment.h>
 #include <driver/pipeline.h>
@@ -28,12 +31,34 @@ extern int alnsb_getopts (int argc, char** argv, s_alnsb_environment_t* env);
 
 int main (int argc, char** argv)
 {
+#ifdef ALNSB_USE_MPI
+  // All the ranks run the pipeline, the segmentation is distributed
+  // over them. Only the first rank prints and saves its results.
+  int rank;
+  MPI_Init (&argc, &argv);
+  MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+  if (rank)
+    freopen ("/dev/null", "w", stdout);
+#endif
   s_alnsb_environment_t* env = alnsb_environment_malloc ();
   alnsb_getopts (argc, argv, env);
+#ifdef ALNSB_USE_MPI
+  if (rank)
+    {
+      int i;
+      env->dump_images = 0;
+      for (i = 0; i < ALNSB_MAX_NUMBER_OF_PHASES; ++i)
+	env->pass_options[i].display_pass_result = 0;
+    }
+#endif
   
   alnsb_pipeline (env);
 
   alnsb_environment_free (env);
 
+#ifdef ALNSB_USE_MPI
+  MPI_Finalize ();
+#endif
+
   return 0;
 }
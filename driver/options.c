@@ -150,8 +150,19 @@ int alnsb_getopts (int argc, char** argv, s_alnsb_environment_t* env)
     { "--thresold_lowerBand", NULL, 1, &(env->thresold_lowerBand), LSCAD_OPT_INT,
       "[thresolding] Minimal pixel value" },
 
+    { "--crop-body", NULL, 0, &(env->crop_body), LSCAD_OPT_NONE,
+      "[crop] Run the passes after levelscale on the body bounding box only (changes the segmentation slightly, see README)" },
+    { "--crop_threshold", NULL, 1, &(env->crop_threshold), LSCAD_OPT_REAL,
+      "[crop] Minimal levelscale value of a body voxel" },
+    { "--crop_margin", NULL, 1, &(env->crop_margin), LSCAD_OPT_INT,
+      "[crop] Number of voxels kept around the bounding box (>= 28 for the closing of segmentationMask)" },
+
     { "--thresolding_skip4", NULL, 0, &(env->segmentationMask_skip_4_slices), LSCAD_OPT_NONE,
       "[thresolding] Skip first/last 4 slices" },
+    { "--segmentationMask-imfill-3d", NULL, 0, &(env->segmentationMask_imfill_3d), LSCAD_OPT_NONE,
+      "[segmentationMask] Fill the holes of the volume in 3D instead of slice by slice (air open through the slices, such as the lungs through the trachea, is not filled)" },
+    { "--segmentationMask-imfill-border", NULL, 0, &(env->segmentationMask_imfill_border), LSCAD_OPT_NONE,
+      "[segmentationMask] Reach the outside from the whole border when filling the holes, instead of from the two top corners of each slice" },
 
     { "--segmentation_lp", NULL, 1, &(env->segmentation_lp), LSCAD_OPT_REAL,
       "[segmentation] lp parameter value" },
@@ -178,6 +189,56 @@ int alnsb_getopts (int argc, char** argv, s_alnsb_environment_t* env)
       "[segmentation] max_err parameter value" },
     { "--segmentation_max_steps", NULL, 1, &(env->segmentation_max_steps), LSCAD_OPT_INT,
       "[segmentation] max_steps parameter value" },
+    { "--segmentation-engine", NULL, 1, &(env->segmentation_engine), LSCAD_OPT_STR,
+      "[segmentation] Solver engine (fused, wavefront, narrowband, slice2d, redblack, reference)" },
+    { "--segmentation_time_tile", NULL, 1, &(env->segmentation_time_tile), LSCAD_OPT_INT,
+      "[segmentation] Inner steps per sweep of the wavefront engine" },
+    { "--segmentation-lean", NULL, 0, &(env->segmentation_lean), LSCAD_OPT_NONE,
+      "[segmentation] Do not store divp, recompute it (fused and wavefront engines)" },
+    { "--segmentation_levels", NULL, 1, &(env->segmentation_levels), LSCAD_OPT_INT,
+      "[segmentation] Number of resolution levels (1: full resolution only); can be slower and changes the mask, see README" },
+    { "--segmentation-checkpoint", NULL, 1, &(env->segmentation_checkpoint), LSCAD_OPT_STR,
+      "[segmentation] Solver state file, resumed from if present and saved after each outer iteration" },
+    { "--segmentation_nb_band", NULL, 1, &(env->segmentation_nb_band), LSCAD_OPT_REAL,
+      "[segmentation] Narrow band engine: voxels with |u - 0.5| below this value are active" },
+    { "--segmentation_nb_tol", NULL, 1, &(env->segmentation_nb_tol), LSCAD_OPT_REAL,
+      "[segmentation] Narrow band engine: voxels whose u moved by more than this value in their last update are active" },
+    { "--segmentation_nb_revalidate", NULL, 1, &(env->segmentation_nb_revalidate), LSCAD_OPT_INT,
+      "[segmentation] Narrow band engine: inner steps between full-volume steps" },
+    { "--segmentation_workers", NULL, 1, &(env->segmentation_workers), LSCAD_OPT_INT,
+      "[segmentation] Number of worker processes, each solving a slab of slices (1: single process)" },
+    { "--segmentation-isa", NULL, 1, &(env->segmentation_isa), LSCAD_OPT_STR,
+      "[segmentation] Instruction set of the row kernels (auto, avx512, avx2, sse4.2, scalar); avx512 needs GCC >= 5 or clang" },
+    { "--segmentation-storage", NULL, 1, &(env->segmentation_storage), LSCAD_OPT_STR,
+      "[segmentation] Storage of the flows in the fused engine (fp32, fp16, bf16)" },
+    { "--segmentation-storage-sources", NULL, 0, &(env->segmentation_storage_sources), LSCAD_OPT_NONE,
+      "[segmentation] Also store ps and pt in the reduced precision format" },
+    { "--segmentation-storage-check", NULL, 0, &(env->segmentation_storage_check), LSCAD_OPT_NONE,
+      "[segmentation] Solve again with fp32 storage and report the differences of the masks" },
+    { "--segmentation-solver", NULL, 1, &(env->segmentation_solver), LSCAD_OPT_STR,
+      "[segmentation] Inner solver (cmf: continuous max-flow, run by the engine; pdhg: primal-dual)" },
+    { "--segmentation_pd_tau", NULL, 1, &(env->segmentation_pd_tau), LSCAD_OPT_REAL,
+      "[segmentation] PDHG solver: primal step size" },
+    { "--segmentation_pd_sigma", NULL, 1, &(env->segmentation_pd_sigma), LSCAD_OPT_REAL,
+      "[segmentation] PDHG solver: dual step size (tau * sigma must not exceed 1/12)" },
+    { "--segmentation-solver-check", NULL, 0, &(env->segmentation_solver_check), LSCAD_OPT_NONE,
+      "[segmentation] Solve again with the cmf solver and report its cost and the differences of the masks" },
+    { "--segmentation-auto-ulab", NULL, 0, &(env->segmentation_auto_ulab), LSCAD_OPT_NONE,
+      "[segmentation] Initialize ulab[0] and ulab[1] with the class means of the Otsu threshold of the input histogram" },
+    { "--segmentation-auto-ulab-check", NULL, 0, &(env->segmentation_auto_ulab_check), LSCAD_OPT_NONE,
+      "[segmentation] Solve again from the ulab[0] and ulab[1] parameter values and report the outer iterations saved" },
+    { "--segmentation-trace", NULL, 1, &(env->segmentation_trace), LSCAD_OPT_STR,
+      "[segmentation] CSV file receiving one row per outer iteration: inner steps, residuals, ulab and timings" },
+    { "--segmentation_deadline", NULL, 1, &(env->segmentation_deadline), LSCAD_OPT_REAL,
+      "[segmentation] Time budget in seconds: past it, stop after the current inner step and threshold u (0: none)" },
+    { "--segmentation-fast", NULL, 0, &(env->segmentation_fast), LSCAD_OPT_NONE,
+      "[segmentation] Fast lung extraction: threshold the input between ulab[0] and ulab[1] instead of solving, fall back to the solver if the lungs fail the sanity check" },
+    { "--segmentation_fast_lungs_min", NULL, 1, &(env->segmentation_fast_lungs[0]), LSCAD_OPT_REAL,
+      "[segmentation] Fast lung extraction: minimal fraction of the volume in the two lungs" },
+    { "--segmentation_fast_lungs_max", NULL, 1, &(env->segmentation_fast_lungs[1]), LSCAD_OPT_REAL,
+      "[segmentation] Fast lung extraction: maximal fraction of the volume in the two lungs" },
+    { "--segmentation_fast_balance", NULL, 1, &(env->segmentation_fast_balance), LSCAD_OPT_REAL,
+      "[segmentation] Fast lung extraction: minimal size ratio of the smaller lung to the larger" },
 
     { "--preselection_diameterMin", NULL, 1, &(env->preselection_diameterMin), LSCAD_OPT_REAL,
       "[preselection] Minimal nodule diameter" },
@@ -26,6 +26,7 @@
 #include <utilities/step.h>
 #include <utilities/file_io.h>
 #include <utilities/timer.h>
+#include <toolbox/crop.h>
 
 #include <stages/rotation/rotation_step.h>
 #include <stages/levelscale/levelscale_step.h>
@@ -125,6 +126,26 @@ image3D* load_image (s_alnsb_environment_t* env, char* stepname, int type,
 }
 
 
+// Load the result of a pass producing a volume of the same size as
+// its input. Results are saved in full-volume coordinates, so they
+// are cropped again for the passes working on the body bounding box.
+static
+image3D* load_volume (s_alnsb_environment_t* env, char* stepname, int type,
+		      image3D* input)
+{
+  if (! env->crop_full[0])
+    return load_image (env, stepname, type,
+		       input->slices, input->rows, input->cols);
+
+  image3D* full = load_image (env, stepname, type, env->crop_full[0],
+			      env->crop_full[1], env->crop_full[2]);
+  image3D* ret = alnsb_crop_img (full, env->crop_lo, env->crop_hi);
+  image3D_free (full);
+
+  return ret;
+}
+
+
 static
 void dump_image (s_alnsb_environment_t* env, char* stepname, image3D* img)
 {
@@ -159,9 +180,18 @@ void pass_ends (s_alnsb_environment_t* env, int pass_id, image3D* img)
       alnsb_timer_print (stdout, pass_name);
     }
 
-  dump_image (env, pass_name, img);
+  // Passes working on the cropped volume are saved and displayed in
+  // full-volume coordinates.
+  image3D* full = img;
+  if (env->crop_full[0] &&
+      pass_id >= SEGMENTATION_PASS && pass_id <= PRESELECTION_PASS)
+    full = alnsb_uncrop_img (img, env->crop_lo, env->crop_full);
+
+  dump_image (env, pass_name, full);
   if (env->pass_options[pass_id].display_pass_result)
-    display_image (env, pass_name, img);
+    display_image (env, pass_name, full);
+  if (full != img)
+    image3D_free (full);
 
   if (env->verbose_level)
     fprintf (stdout, "[INFO] Done with %s pass\n", pass_name);
@@ -216,8 +246,8 @@ void rotation_wrapper (s_alnsb_environment_t* env,
   if (! load_output)
     rotation_cpu (env, input, &output);
   else
-    output = (image3DReal*) load_image (env, pass_name, ALNSB_IMAGE_REAL,
-					input->slices, input->rows, input->cols);
+    output = (image3DReal*) load_volume (env, pass_name, ALNSB_IMAGE_REAL,
+					 input->image3D);
 
   pass_ends (env, pass_id, output->image3D);
 
@@ -246,8 +276,8 @@ void levelscale_wrapper (s_alnsb_environment_t* env,
   if (! load_output)
     levelscale_cpu (env, input, &output);
   else
-    output = (image3DReal*) load_image (env, pass_name, ALNSB_IMAGE_REAL,
-					input->slices, input->rows, input->cols);
+    output = (image3DReal*) load_volume (env, pass_name, ALNSB_IMAGE_REAL,
+					 input->image3D);
 
   pass_ends (env, pass_id, output->image3D);
 
@@ -256,10 +286,62 @@ void levelscale_wrapper (s_alnsb_environment_t* env,
 }
 
 
-// input 0: result of emtv.
-// output 0: result of segmentation.
+// input 0: result of levelscale.
+// output 0: levelscale image cropped to the body bounding box. The
+// bounding box is stored in env. The segmentation of the crop is not
+// that of the full volume: its class means and residual are taken
+// over the crop only.
+void crop_wrapper (s_alnsb_environment_t* env,
+		   s_alnsb_step_t* step_data)
+{
+  // Get the input image(s) from the step I/O description.
+  image3DReal* input = (image3DReal*)step_data->read[0];
+  size_t lo[3], hi[3];
+
+  if (! alnsb_bounding_box_real_img (input, env->crop_threshold,
+				     env->crop_margin, lo, hi))
+    fprintf (stderr, "[WARNING] No voxel above crop threshold, not cropping\n");
+
+  int d;
+  for (d = 0; d < 3; ++d)
+    {
+      env->crop_lo[d] = lo[d];
+      env->crop_hi[d] = hi[d];
+    }
+  env->crop_full[0] = input->slices;
+  env->crop_full[1] = input->rows;
+  env->crop_full[2] = input->cols;
+  image3D* output = alnsb_crop_img (input->image3D, lo, hi);
+
+  if (env->verbose_level)
+    printf ("[INFO] Cropping to [%zu,%zu) x [%zu,%zu) x [%zu,%zu): %.1f%% of the voxels\n",
+	    lo[0], hi[0], lo[1], hi[1], lo[2], hi[2],
+	    100.0 * output->num_pixels / input->num_pixels);
+
+  // Register the output in the step I/O description.
+  alnsb_step_push_output (&step_data, output);
+}
+
+
+// input 0: result of preselection, on the body bounding box.
+// output 0: result of preselection, in the full volume.
+void uncrop_wrapper (s_alnsb_environment_t* env,
+		     s_alnsb_step_t* step_data)
+{
+  image3D* output = alnsb_uncrop_img (step_data->read[0], env->crop_lo,
+				      env->crop_full);
+
+  // Register the output in the step I/O description.
+  alnsb_step_push_output (&step_data, output);
+}
+
+
+// input 0: result of levelscale.
+// output 0: result of segmentation, by the fast lung extraction if
+// fast is set.
 void segmentation_wrapper (s_alnsb_environment_t* env,
-			   s_alnsb_step_t* step_data)
+			   s_alnsb_step_t* step_data,
+			   int fast)
 {
   // Get the input image(s) from the step I/O description.
   image3DReal* input = (image3DReal*)step_data->read[0];
@@ -274,10 +356,10 @@ void segmentation_wrapper (s_alnsb_environment_t* env,
   // Step is in charge of allocating output data structure, and works
   // on concrete image types (e.g., image3DReal).
   if (! load_output)
-    segmentation_cpu (env, input, &output);
+    segmentation_mode_cpu (env, input, &output, fast);
   else
-    output = (image3DReal*) load_image (env, pass_name, ALNSB_IMAGE_REAL,
-					input->slices, input->rows, input->cols);
+    output = (image3DReal*) load_volume (env, pass_name, ALNSB_IMAGE_REAL,
+					 input->image3D);
 
   pass_ends (env, pass_id, output->image3D);
 
@@ -288,12 +370,15 @@ void segmentation_wrapper (s_alnsb_environment_t* env,
 
 // input 0: result of segmentation.
 // output 0: result of segmentation mask.
-void segmentationMask_wrapper (s_alnsb_environment_t* env,
-			       s_alnsb_step_t* step_data)
+// Returns 0 if the lungs fail the sanity check of the fast lung
+// extraction.
+int segmentationMask_wrapper (s_alnsb_environment_t* env,
+			      s_alnsb_step_t* step_data)
 {
   // Get the input image(s) from the step I/O description.
   image3DReal* input = (image3DReal*)step_data->read[0];
   image3DBin* output = NULL;
+  int lungs_ok = 1;
 
   int pass_id = SEGMENTATIONMASK_PASS;
   char* pass_name = env->pass_options[pass_id].pass_name;
@@ -304,15 +389,25 @@ void segmentationMask_wrapper (s_alnsb_environment_t* env,
   // Step is in charge of allocating output data structure, and works
   // on concrete image types (e.g., image3DReal).
   if (! load_output)
-    segmentationMask_cpu (env, input, &output);
+    {
+      s_segmentationMask_lungs_t lungs;
+      segmentationMask_lungs_cpu (env, input, &output, &lungs);
+      lungs_ok = segmentationMask_lungs_check (env, &lungs);
+      if (env->verbose_level)
+	fprintf (stdout, "[INFO] Lungs: %zu and %zu voxels, %.1f%% of the volume\n",
+		 lungs.size[0], lungs.size[1],
+		 100.0 * (lungs.size[0] + lungs.size[1]) / lungs.voxels);
+    }
   else
-    output = (image3DBin*) load_image (env, pass_name, ALNSB_IMAGE_BINARY,
-				       input->slices, input->rows, input->cols);
+    output = (image3DBin*) load_volume (env, pass_name, ALNSB_IMAGE_BINARY,
+					 input->image3D);
 
   pass_ends (env, pass_id, output->image3D);
 
   // Register the output in the step I/O description.
   alnsb_step_push_output (&step_data, output->image3D);
+
+  return lungs_ok;
 }
 
 
@@ -337,8 +432,8 @@ void preselection_wrapper (s_alnsb_environment_t* env,
   if (! load_output)
     preselection_cpu (env, input, &output);
   else
-    output = (image3DBin*) load_image (env, pass_name, ALNSB_IMAGE_BINARY,
-				       input->slices, input->rows, input->cols);
+    output = (image3DBin*) load_volume (env, pass_name, ALNSB_IMAGE_BINARY,
+					 input->image3D);
 
   pass_ends (env, pass_id, output->image3D);
 
@@ -421,9 +516,11 @@ void alnsb_pipeline (s_alnsb_environment_t* env)
   s_alnsb_step_t* emtv_io = NULL;
   s_alnsb_step_t* rot_io = NULL;
   s_alnsb_step_t* prep_io = NULL;
+  s_alnsb_step_t* crop_io = NULL;
   s_alnsb_step_t* seg_io = NULL;
   s_alnsb_step_t* segmask_io = NULL;
   s_alnsb_step_t* presel_io = NULL;
+  s_alnsb_step_t* uncrop_io = NULL;
   s_alnsb_step_t* featExt_io = NULL;
   s_alnsb_step_t* class_io = NULL;
   size_t i;
@@ -445,27 +542,62 @@ void alnsb_pipeline (s_alnsb_environment_t* env)
 
   // [rot_io] -> (levelscale) -> [prep_io]
   levelscale_wrapper (env, prep_io);
-  alnsb_step_push_input (&seg_io, prep_io->write[0]);
   alnsb_step_push_input (&featExt_io, prep_io->write[0]);
   alnsb_step_push_input (&class_io, prep_io->write[0]);
 
+  // Optional: segmentation, segmentationMask and preselection work on
+  // the body bounding box only.
+  // [prep_io] -> (crop) -> [crop_io]
+  if (env->crop_body)
+    {
+      alnsb_step_push_input (&crop_io, prep_io->write[0]);
+      crop_wrapper (env, crop_io);
+      alnsb_step_push_input (&seg_io, crop_io->write[0]);
+    }
+  else
+    alnsb_step_push_input (&seg_io, prep_io->write[0]);
+
   // Stage 1: segmentation.
   // [prep_io] -> (segmentation) -> [segmask_io];
-  segmentation_wrapper (env, seg_io);
+  segmentation_wrapper (env, seg_io, env->segmentation_fast);
   alnsb_step_push_input (&segmask_io, seg_io->write[0]);
 
 
   // Stage 2: build segmentation mask.
   // [segmask_io] -> (segmentationMask) -> [segmasked_io];
-  segmentationMask_wrapper (env, segmask_io);
+  int lungs_ok = segmentationMask_wrapper (env, segmask_io);
+
+  // Fast lung extraction with implausible lungs: run both stages again
+  // with the solver.
+  if (env->segmentation_fast && ! lungs_ok)
+    {
+      fprintf (stdout, "[INFO] Fast lung extraction failed the lung check, running the segmentation solver\n");
+      alnsb_step_reset (segmask_io,
+			ALNSB_STEP_ADD_INPUT_IMG | ALNSB_STEP_ADD_OUTPUT_IMG);
+      alnsb_step_reset (seg_io, ALNSB_STEP_ADD_OUTPUT_IMG);
+      segmentation_wrapper (env, seg_io, 0);
+      alnsb_step_push_input (&segmask_io, seg_io->write[0]);
+      segmentationMask_wrapper (env, segmask_io);
+    }
   alnsb_step_push_input (&presel_io, segmask_io->write[0]);
 
 
   // Stage 3: preselection.
   // [segmasked_io] -> (preselection) -> [presel_io];
   preselection_wrapper (env, presel_io);
-  alnsb_step_push_input (&class_io, presel_io->write[0]);
-  alnsb_step_push_input (&featExt_io, presel_io->write[0]);
+  image3D* presel = presel_io->write[0];
+
+  // Map the candidates back to the full volume: feature extraction
+  // normalizes intensities over the whole volume.
+  // [presel_io] -> (uncrop) -> [uncrop_io]
+  if (env->crop_body)
+    {
+      alnsb_step_push_input (&uncrop_io, presel);
+      uncrop_wrapper (env, uncrop_io);
+      presel = uncrop_io->write[0];
+    }
+  alnsb_step_push_input (&class_io, presel);
+  alnsb_step_push_input (&featExt_io, presel);
 
 
   // Stage 4: feature extraction.
@@ -490,9 +622,11 @@ void alnsb_pipeline (s_alnsb_environment_t* env)
   alnsb_step_free (emtv_io);
   alnsb_step_free (rot_io);
   alnsb_step_free (prep_io);
+  alnsb_step_free (crop_io);
   alnsb_step_free (seg_io);
   alnsb_step_free (segmask_io);
   alnsb_step_free (presel_io);
+  alnsb_step_free (uncrop_io);
   alnsb_step_free (featExt_io);
   alnsb_step_free (class_io);
 }
@@ -0,0 +1,275 @@
+/**
+ * segmentation_checkpoint.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef ALNSB_USE_MPI
+# include <mpi.h>
+#endif
+
+#include <stages/segmentation/segmentation_solver.h>
+#include <utilities/memfuncs.h>
+
+#define ALNSB_MAXFLOW_CHECKPOINT_MAGIC "ALNSBMF2"
+
+
+/**
+ * Checkpoint file layout: this header, then the raw u, ps, pt, pp1,
+ * pp2 and pp3 volumes, in fp32 whatever their storage in the solver.
+ * params holds the solver parameters of the run which wrote the
+ * file, to tell a resume from a warm start. input_sum is a checksum
+ * of the input image: a state computed for another input of the same
+ * size is neither resumed nor used as a warm start.
+ *
+ */
+struct checkpoint_header
+{
+  char			magic[8];
+  int			slices;
+  int			rows;
+  int			cols;
+  uint64_t		input_sum;
+  double		params[11];
+  int			max_steps;
+  float			ulab[2];
+  s_alnsb_maxflow_progress_t progress;
+};
+
+
+static
+void checkpoint_params (s_alnsb_environment_t* env, double params[11])
+{
+  params[0] = env->segmentation_lp;
+  params[1] = env->segmentation_errb[0];
+  params[2] = env->segmentation_errb[1];
+  params[3] = env->segmentation_ulab[0];
+  params[4] = env->segmentation_ulab[1];
+  params[5] = env->segmentation_cc;
+  params[6] = env->segmentation_c_convergence;
+  params[7] = env->segmentation_steps;
+  params[8] = env->segmentation_beta;
+  params[9] = env->segmentation_err_c;
+  params[10] = env->segmentation_max_err;
+}
+
+
+/**
+ * FNV-1a hash of the input image, over the bit patterns of its
+ * voxels.
+ *
+ */
+static
+uint64_t checkpoint_input_sum (image3DReal* ur)
+{
+  uint64_t h = 14695981039346656037ULL;
+  uint32_t w;
+  size_t x;
+
+  for (x = 0; x < ur->num_pixels; ++x)
+    {
+      memcpy (&w, ur->data + x, sizeof(w));
+      h = (h ^ w) * 1099511628211ULL;
+    }
+
+  return h;
+}
+
+
+/**
+ * Write (or read) the volumes of the solver state, one plane at a
+ * time. The volumes the solver does not have (ps and pt of the PDHG
+ * solver) are written as 0, and skipped when read. Returns 0 on a
+ * short write (or read).
+ *
+ */
+static
+int checkpoint_volumes (s_alnsb_maxflow_t* mf, FILE* f, int write)
+{
+  ALNSB_IMAGE_TYPE_REAL* buf =
+    alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL),
+		  alnsb_maxflow_plane_size (mf, ALNSB_MAXFLOW_VOL_PP1) +
+		  alnsb_maxflow_plane_size (mf, ALNSB_MAXFLOW_VOL_PP2));
+  int ok = 1;
+  int vol, z;
+
+  for (vol = 0; vol < ALNSB_MAXFLOW_NUM_VOLS && ok; ++vol)
+    {
+      size_t plane = alnsb_maxflow_plane_size (mf, vol);
+      int planes = mf->slices + (vol == ALNSB_MAXFLOW_VOL_PP3);
+      if (! *alnsb_maxflow_volume (mf, vol) && ! mf->packed[vol])
+	{
+	  memset (buf, 0, plane * sizeof(ALNSB_IMAGE_TYPE_REAL));
+	  for (z = 0; z < planes && ok; ++z)
+	    if (write)
+	      ok = fwrite (buf, sizeof(ALNSB_IMAGE_TYPE_REAL), plane, f) == plane;
+	    else
+	      ok = fread (buf, sizeof(ALNSB_IMAGE_TYPE_REAL), plane, f) == plane;
+	  continue;
+	}
+      for (z = 0; z < planes && ok; ++z)
+	{
+	  ALNSB_IMAGE_TYPE_REAL* p = alnsb_maxflow_plane_load (mf, vol, z, buf);
+	  if (write)
+	    ok = fwrite (p, sizeof(ALNSB_IMAGE_TYPE_REAL), plane, f) == plane;
+	  else
+	    {
+	      ok = fread (p, sizeof(ALNSB_IMAGE_TYPE_REAL), plane, f) == plane;
+	      alnsb_maxflow_plane_store (mf, vol, z, p);
+	    }
+	}
+    }
+  free (buf);
+
+  return ok;
+}
+
+
+/**
+ * Save the solver state and the outer loop progress to filename. The
+ * file is written under a temporary name then renamed, so that an
+ * interrupted save leaves the previous checkpoint intact.
+ *
+ */
+void alnsb_maxflow_checkpoint_save (s_alnsb_environment_t* env,
+				    s_alnsb_maxflow_t* mf,
+				    s_alnsb_maxflow_progress_t* progress,
+				    char* filename)
+{
+  struct checkpoint_header h;
+  char tmpname[1024];
+
+#ifdef ALNSB_USE_MPI
+  // All the ranks hold the same state: the first one saves it.
+  int rank;
+  MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+  if (rank)
+    return;
+#endif
+
+  memset (&h, 0, sizeof(h));
+  memcpy (h.magic, ALNSB_MAXFLOW_CHECKPOINT_MAGIC, sizeof(h.magic));
+  h.slices = mf->slices;
+  h.rows = mf->rows;
+  h.cols = mf->cols;
+  h.input_sum = checkpoint_input_sum (mf->ur);
+  checkpoint_params (env, h.params);
+  h.max_steps = env->segmentation_max_steps;
+  h.ulab[0] = mf->ulab[0];
+  h.ulab[1] = mf->ulab[1];
+  h.progress = *progress;
+
+  snprintf (tmpname, sizeof(tmpname), "%s.tmp", filename);
+  FILE* f = fopen (tmpname, "w");
+  if (f == NULL)
+    {
+      fprintf (stderr, "[WARNING][segmentation] Cannot write checkpoint %s\n",
+	       tmpname);
+      return;
+    }
+  int ok = fwrite (&h, sizeof(h), 1, f) == 1;
+  ok = ok && checkpoint_volumes (mf, f, 1);
+  ok = (fclose (f) == 0) && ok;
+  if (! ok || rename (tmpname, filename))
+    {
+      fprintf (stderr, "[WARNING][segmentation] Cannot write checkpoint %s\n",
+	       filename);
+      remove (tmpname);
+    }
+}
+
+
+/**
+ * Load the solver state from filename, if it exists and matches the
+ * problem size and the input. mf must have been initialized by alnsb_maxflow_init,
+ * it is left in this state if nothing is loaded. Returns:
+ *
+ * - ALNSB_MAXFLOW_CHECKPOINT_RESUME if the file was written with the
+ *   same parameters: progress is restored and the run continues
+ *   where it stopped.
+ *
+ * - ALNSB_MAXFLOW_CHECKPOINT_WARM if the parameters differ: u, the
+ *   flows and the class means are reused, progress is left as is
+ *   (the outer loop starts over).
+ *
+ * - ALNSB_MAXFLOW_CHECKPOINT_NONE if nothing was loaded.
+ *
+ */
+int alnsb_maxflow_checkpoint_load (s_alnsb_environment_t* env,
+				   s_alnsb_maxflow_t* mf,
+				   s_alnsb_maxflow_progress_t* progress,
+				   char* filename)
+{
+  struct checkpoint_header h;
+  double params[11];
+
+  FILE* f = fopen (filename, "r");
+  if (f == NULL)
+    return ALNSB_MAXFLOW_CHECKPOINT_NONE;
+  if (fread (&h, sizeof(h), 1, f) != 1 ||
+      memcmp (h.magic, ALNSB_MAXFLOW_CHECKPOINT_MAGIC, sizeof(h.magic)))
+    {
+      fprintf (stderr, "[WARNING][segmentation] Ignoring checkpoint %s: not a solver checkpoint\n",
+	       filename);
+      fclose (f);
+      return ALNSB_MAXFLOW_CHECKPOINT_NONE;
+    }
+  if (h.slices != mf->slices || h.rows != mf->rows || h.cols != mf->cols)
+    {
+      fprintf (stderr, "[WARNING][segmentation] Ignoring checkpoint %s: size %d x %d x %d, expected %d x %d x %d\n",
+	       filename, h.slices, h.rows, h.cols,
+	       mf->slices, mf->rows, mf->cols);
+      fclose (f);
+      return ALNSB_MAXFLOW_CHECKPOINT_NONE;
+    }
+  if (h.input_sum != checkpoint_input_sum (mf->ur))
+    {
+      fprintf (stderr, "[WARNING][segmentation] Ignoring checkpoint %s: written for another input\n",
+	       filename);
+      fclose (f);
+      return ALNSB_MAXFLOW_CHECKPOINT_NONE;
+    }
+  int ok = checkpoint_volumes (mf, f, 0);
+  fclose (f);
+  if (! ok)
+    {
+      // The volumes may have been partially overwritten.
+      fprintf (stderr, "[WARNING][segmentation] Ignoring truncated checkpoint %s\n",
+	       filename);
+      alnsb_maxflow_volume_clear (mf, ALNSB_MAXFLOW_VOL_PP1);
+      alnsb_maxflow_volume_clear (mf, ALNSB_MAXFLOW_VOL_PP2);
+      alnsb_maxflow_volume_clear (mf, ALNSB_MAXFLOW_VOL_PP3);
+      alnsb_maxflow_init (mf);
+      return ALNSB_MAXFLOW_CHECKPOINT_NONE;
+    }
+
+  mf->ulab[0] = h.ulab[0];
+  mf->ulab[1] = h.ulab[1];
+  alnsb_maxflow_divergence (mf);
+  if (mf->ubar)
+    memcpy (mf->ubar->data, mf->u->data,
+	    mf->u->num_pixels * sizeof(ALNSB_IMAGE_TYPE_REAL));
+
+  checkpoint_params (env, params);
+  if (memcmp (params, h.params, sizeof(params)) ||
+      h.max_steps != env->segmentation_max_steps)
+    return ALNSB_MAXFLOW_CHECKPOINT_WARM;
+  *progress = h.progress;
+
+  return ALNSB_MAXFLOW_CHECKPOINT_RESUME;
+}
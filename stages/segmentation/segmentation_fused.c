@@ -0,0 +1,899 @@
+/**
+ * segmentation_fused.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Fused engine for the continuous max-flow solver.
+ *
+ * The reference engine performs each inner step as a sequence of
+ * full-volume sweeps (pts, pp1, pp2, pp3, gk, three rescalings, the
+ * update, the error reduction). Here, the volume is split in slabs
+ * of slices, one per thread, and each thread computes a complete
+ * inner step on its slab in a single sweep over the slices. The
+ * different sub-steps are pipelined with a lag of one slice each:
+ *
+ *   slice z   : pts(z), flow update of pp1/pp2/pp3 at z
+ *   slice z-1 : gk(z-1), rescaling of pp1/pp2/pp3 at z-1
+ *   slice z-2 : divp, ps, pt, u update at z-2, error accumulation
+ *
+ * so only a few slices of pts and gk are live at any time; they are
+ * kept in per-thread plane buffers instead of full volumes.
+ *
+ * A step at slice z reads the state of slices z-2..z+2. Before each
+ * step, every thread takes a snapshot of the two slices above and
+ * below its slab (pts, and the flows that the pipeline updates
+ * there), then recomputes the halo part of the pipeline privately.
+ * Results are identical to the reference engine, up to the order of
+ * the error reduction.
+ *
+ * With a packed storage of the state, the planes of the slab are
+ * decoded into a ring of per-thread buffers when they enter the
+ * pipeline, and encoded back when they leave it: all the sub-steps
+ * are done in fp32, and the state is rounded once per inner step.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+#include <stages/segmentation/segmentation_solver.h>
+#include <utilities/memfuncs.h>
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+#define alnsb_power2(a) ((a)*(a))
+
+// Padding between per-thread partial sums, to avoid false sharing.
+#define FUSED_PARTIAL_STRIDE 8
+
+// Planes of a slice are live in the pipeline from the step at slice
+// z-1 to the step at slice z+2.
+#define FUSED_RING_SIZE 4
+
+
+/**
+ * Per-thread plane buffers.
+ *
+ */
+struct fused_buffers
+{
+  // Ring of the last two pts/gk planes computed in the slab.
+  ALNSB_IMAGE_TYPE_REAL* pts[2];
+  ALNSB_IMAGE_TYPE_REAL* gk[2];
+  // Snapshot of pts for slices s0-2, s0-1 and s1, s1+1.
+  ALNSB_IMAGE_TYPE_REAL* lo_pts[2];
+  ALNSB_IMAGE_TYPE_REAL* hi_pts[2];
+  // Snapshot of the flows at slice s0-1 and s1 (and pp3 at s1+1).
+  ALNSB_IMAGE_TYPE_REAL* lo_pp1;
+  ALNSB_IMAGE_TYPE_REAL* lo_pp2;
+  ALNSB_IMAGE_TYPE_REAL* lo_pp3;
+  ALNSB_IMAGE_TYPE_REAL* hi_pp1;
+  ALNSB_IMAGE_TYPE_REAL* hi_pp2;
+  ALNSB_IMAGE_TYPE_REAL* hi_pp3;
+  ALNSB_IMAGE_TYPE_REAL* hi_pp3b;
+  // Decoded planes of the packed volumes (indexed by
+  // ALNSB_MAXFLOW_VOL_*) for the owned slices, slice z in slot
+  // z % FUSED_RING_SIZE.
+  ALNSB_IMAGE_TYPE_REAL* ring[ALNSB_MAXFLOW_NUM_VOLS][FUSED_RING_SIZE];
+  // Slab of slices owned by the thread: [s0, s1).
+  int s0;
+  int s1;
+};
+typedef struct fused_buffers s_fused_buffers_t;
+
+
+static
+void fused_buffers_alloc (s_alnsb_maxflow_t* mf, s_fused_buffers_t* b)
+{
+  int rows = mf->rows;
+  int cols = mf->cols;
+  size_t plane = rows * cols;
+  size_t plane1 = rows * (cols + 1);
+  size_t plane2 = (rows + 1) * cols;
+  int i, vol;
+  for (i = 0; i < 2; ++i)
+    {
+      b->pts[i] = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane);
+      b->gk[i] = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane);
+      b->lo_pts[i] = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane);
+      b->hi_pts[i] = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane);
+    }
+  b->lo_pp1 = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane1);
+  b->lo_pp2 = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane2);
+  b->lo_pp3 = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane);
+  b->hi_pp1 = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane1);
+  b->hi_pp2 = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane2);
+  b->hi_pp3 = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane);
+  b->hi_pp3b = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), plane);
+  for (vol = 0; vol < ALNSB_MAXFLOW_NUM_VOLS; ++vol)
+    for (i = 0; i < FUSED_RING_SIZE; ++i)
+      b->ring[vol][i] = mf->packed[vol] ?
+	alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL),
+		      alnsb_maxflow_plane_size (mf, vol)) : NULL;
+}
+
+
+static
+void fused_buffers_free (s_fused_buffers_t* b)
+{
+  int i, vol;
+  for (i = 0; i < 2; ++i)
+    {
+      free (b->pts[i]);
+      free (b->gk[i]);
+      free (b->lo_pts[i]);
+      free (b->hi_pts[i]);
+    }
+  free (b->lo_pp1);
+  free (b->lo_pp2);
+  free (b->lo_pp3);
+  free (b->hi_pp1);
+  free (b->hi_pp2);
+  free (b->hi_pp3);
+  free (b->hi_pp3b);
+  for (vol = 0; vol < ALNSB_MAXFLOW_NUM_VOLS; ++vol)
+    for (i = 0; i < FUSED_RING_SIZE; ++i)
+      free (b->ring[vol][i]);
+}
+
+
+/**
+ * pts = divp - (ps - pt + u/cc), on rows [j0, j1) of one plane.
+ *
+ */
+static
+void fused_pts_plane (int cols, int j0, int j1, float cc,
+		      ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR divp,
+		      ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR ps,
+		      ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pt,
+		      ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR u,
+		      ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pts)
+{
+  int x;
+  for (x = j0 * cols; x < j1 * cols; ++x)
+    pts[x] = divp[x] - (ps[x] - pt[x] + (u[x] / cc));
+}
+
+
+/**
+ * Same as fused_pts_plane, for the lean mode where divp is not
+ * stored: it is recomputed from the flows, which have not changed
+ * since the last update. pp3n (pp3 on the next plane) is NULL on the
+ * last slice, where divp is 0.
+ *
+ */
+static
+void fused_pts_plane_lean (int rows, int cols, int j0, int j1, float cc,
+			   ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp1_in,
+			   ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp2_in,
+			   ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp3_in,
+			   ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp3n_in,
+			   ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR ps_in,
+			   ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pt_in,
+			   ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR u_in,
+			   ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pts_in)
+{
+  ALNSB_IMAGE_TYPE_REAL (*pp1)[cols+1] = (ALNSB_IMAGE_TYPE_REAL (*)[cols+1])pp1_in;
+  ALNSB_IMAGE_TYPE_REAL (*pp2)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])pp2_in;
+  ALNSB_IMAGE_TYPE_REAL (*pp3)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])pp3_in;
+  ALNSB_IMAGE_TYPE_REAL (*pp3n)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])pp3n_in;
+  ALNSB_IMAGE_TYPE_REAL (*ps)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])ps_in;
+  ALNSB_IMAGE_TYPE_REAL (*pt)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])pt_in;
+  ALNSB_IMAGE_TYPE_REAL (*u)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])u_in;
+  ALNSB_IMAGE_TYPE_REAL (*pts)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])pts_in;
+  int j, k;
+
+  for (j = j0; j < j1; j++)
+    for (k = 0; k < cols; k++)
+      {
+	ALNSB_IMAGE_TYPE_REAL divp = 0;
+	if (pp3n_in && j < rows-1 && k < cols-1)
+	  divp = pp2[j+1][k] - pp2[j][k] + pp1[j][k+1] - pp1[j][k] + pp3n[j][k] - pp3[j][k];
+	pts[j][k] = divp - (ps[j][k] - pt[j][k] + (u[j][k] / cc));
+      }
+}
+
+
+/**
+ * Gradient step on the flows of rows [j0, j1) of one plane. pp1/pp2
+ * are skipped if NULL; pp3 is skipped if pts_prev (the plane below)
+ * is NULL.
+ *
+ */
+static
+void fused_flow_plane (int cols, int j0, int j1, float steps,
+		       ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pts_in,
+		       ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pts_prev,
+		       ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp1_in,
+		       ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp2_in,
+		       ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp3)
+{
+  ALNSB_IMAGE_TYPE_REAL (*pts)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])pts_in;
+  ALNSB_IMAGE_TYPE_REAL (*pp1)[cols+1] = (ALNSB_IMAGE_TYPE_REAL (*)[cols+1])pp1_in;
+  ALNSB_IMAGE_TYPE_REAL (*pp2)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])pp2_in;
+  int j, k, x;
+
+  if (pp1_in)
+    for (j = j0; j < j1; j++)
+      for (k = 1; k < cols; k++)
+	pp1[j][k] = pp1[j][k] + (steps * (pts[j][k] - pts[j][k-1]));
+  if (pp2_in)
+    for (j = max(j0, 1); j < j1; j++)
+      for (k = 0; k < cols; k++)
+	pp2[j][k] = pp2[j][k] + (steps * (pts[j][k] - pts[j-1][k]));
+  if (pts_prev)
+    for (x = j0 * cols; x < j1 * cols; ++x)
+      pp3[x] = pp3[x] + (steps * (pts_in[x] - pts_prev[x]));
+}
+
+
+/**
+ * gk on rows [j0, j1) of one plane, from the flows on this plane and
+ * pp3 on the next one. gk is 0 on the last row and column, as in the
+ * reference.
+ *
+ */
+static
+void fused_gk_plane (const s_alnsb_maxflow_kernels_t* kernels,
+		     int rows, int cols, int j0, int j1, float alpha,
+		     ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp1,
+		     ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp2,
+		     ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp3,
+		     ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp3n,
+		     ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR gk)
+{
+  int j;
+
+  for (j = j0; j < min(j1, rows-1); j++)
+    {
+      kernels->gk_row (cols-1, alpha, pp1 + j * (cols+1), pp2 + j * cols,
+		       pp2 + (j+1) * cols, pp3 + j * cols, pp3n + j * cols,
+		       gk + j * cols);
+      gk[j * cols + cols-1] = 0;
+    }
+  if (j1 == rows)
+    memset (gk + (rows-1) * cols, 0, cols * sizeof(ALNSB_IMAGE_TYPE_REAL));
+}
+
+
+/**
+ * Rescale the flows of rows [j0, j1) of one plane by gk. pp1/pp2 are
+ * skipped if NULL, pp3 is skipped if gk_prev (the plane below) is
+ * NULL.
+ *
+ */
+static
+void fused_rescale_plane (int cols, int j0, int j1,
+			  ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR gk_in,
+			  ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR gk_prev,
+			  ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp1_in,
+			  ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp2_in,
+			  ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp3)
+{
+  ALNSB_IMAGE_TYPE_REAL (*gk)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])gk_in;
+  ALNSB_IMAGE_TYPE_REAL (*pp1)[cols+1] = (ALNSB_IMAGE_TYPE_REAL (*)[cols+1])pp1_in;
+  ALNSB_IMAGE_TYPE_REAL (*pp2)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])pp2_in;
+  int j, k, x;
+
+  if (pp1_in)
+    for (j = j0; j < j1; j++)
+      for (k = 1; k < cols; k++)
+	pp1[j][k] = (0.5 * (gk[j][k] + gk[j][k-1])) * pp1[j][k];
+  if (pp2_in)
+    for (j = max(j0, 1); j < j1; j++)
+      for (k = 0; k < cols; k++)
+	pp2[j][k] = (0.5 * (gk[j][k] + gk[j-1][k])) * pp2[j][k];
+  if (gk_prev)
+    for (x = j0 * cols; x < j1 * cols; ++x)
+      pp3[x] = (0.5 * (gk_in[x] + gk_prev[x])) * pp3[x];
+}
+
+
+/**
+ * Divergence, source/sink flows and u update on rows [j0, j1) of
+ * slice d, given its flow and ps/pt planes (and pp3 on slice d+1).
+ * divp is not stored in lean mode. Returns the sum of |erru| over
+ * these rows.
+ *
+ */
+static
+double fused_update (s_alnsb_maxflow_t* mf, int kind, int d, int j0, int j1,
+		     ALNSB_IMAGE_TYPE_REAL* pp1, ALNSB_IMAGE_TYPE_REAL* pp2,
+		     ALNSB_IMAGE_TYPE_REAL* pp3, ALNSB_IMAGE_TYPE_REAL* pp3n,
+		     ALNSB_IMAGE_TYPE_REAL* ps, ALNSB_IMAGE_TYPE_REAL* pt)
+{
+  int R = mf->rows;
+  int C = mf->cols;
+  size_t P = R * C;
+  ALNSB_IMAGE_TYPE_REAL* ur = mf->ur->data + d * P;
+  ALNSB_IMAGE_TYPE_REAL* Cs = mf->Cs ? mf->Cs->data + d * P : NULL;
+  ALNSB_IMAGE_TYPE_REAL* Ct = mf->Ct ? mf->Ct->data + d * P : NULL;
+  ALNSB_IMAGE_TYPE_REAL* divp = mf->divp ? mf->divp->data + d * P : NULL;
+  ALNSB_IMAGE_TYPE_REAL* u = mf->u->data + d * P;
+  double err = 0;
+  int j;
+
+  for (j = j0; j < min(j1, R-1); j++)
+    {
+      size_t x = j * C;
+      err += mf->kernels->update_row (kind, C-1, mf->cc, mf->beta,
+				      mf->ulab[0], mf->ulab[1], ur + x,
+				      Cs ? Cs + x : NULL, Ct ? Ct + x : NULL,
+				      pp1 + j * (C+1), pp2 + x, pp2 + x + C,
+				      pp3 + x, pp3n + x, divp ? divp + x : NULL,
+				      ps + x, pt + x, u + x);
+    }
+
+  return err;
+}
+
+
+/**
+ * pts on rows [j0, j1) of slice z, given its ps/pt planes, from divp
+ * if it is stored, else from the flow planes of slice z (and pp3 of
+ * slice z+1).
+ *
+ */
+static
+void fused_pts (s_alnsb_maxflow_t* mf, int z, int j0, int j1,
+		ALNSB_IMAGE_TYPE_REAL* pp1, ALNSB_IMAGE_TYPE_REAL* pp2,
+		ALNSB_IMAGE_TYPE_REAL* pp3, ALNSB_IMAGE_TYPE_REAL* pp3n,
+		ALNSB_IMAGE_TYPE_REAL* ps, ALNSB_IMAGE_TYPE_REAL* pt,
+		ALNSB_IMAGE_TYPE_REAL* pts)
+{
+  int R = mf->rows;
+  int C = mf->cols;
+  size_t P = R * C;
+
+  if (mf->divp)
+    fused_pts_plane (C, j0, j1, mf->cc, mf->divp->data + z * P, ps, pt,
+		     mf->u->data + z * P, pts);
+  else
+    fused_pts_plane_lean (R, C, j0, j1, mf->cc, pp1, pp2, pp3,
+			  z < mf->slices - 1 ? pp3n : NULL, ps, pt,
+			  mf->u->data + z * P, pts);
+}
+
+
+/**
+ * Save the halo of the slab [s0, s1) before the step starts, since
+ * the neighbor slabs update it in place.
+ *
+ */
+static
+void fused_snapshot_copy (s_alnsb_maxflow_t* mf, int vol, int z,
+			  ALNSB_IMAGE_TYPE_REAL* dst)
+{
+  ALNSB_IMAGE_TYPE_REAL* p = alnsb_maxflow_plane_load (mf, vol, z, dst);
+  if (p != dst)
+    memcpy (dst, p, alnsb_maxflow_plane_size (mf, vol) *
+	    sizeof(ALNSB_IMAGE_TYPE_REAL));
+}
+
+
+/**
+ * pts of the halo slice z, into pts. The ring buffers, free between
+ * two steps, hold the decoded planes of packed volumes.
+ *
+ */
+static
+void fused_snapshot_pts (s_alnsb_maxflow_t* mf, s_fused_buffers_t* b, int z,
+			 ALNSB_IMAGE_TYPE_REAL* pts)
+{
+  fused_pts (mf, z, 0, mf->rows,
+	     alnsb_maxflow_plane_load (mf, ALNSB_MAXFLOW_VOL_PP1, z,
+				       b->ring[ALNSB_MAXFLOW_VOL_PP1][0]),
+	     alnsb_maxflow_plane_load (mf, ALNSB_MAXFLOW_VOL_PP2, z,
+				       b->ring[ALNSB_MAXFLOW_VOL_PP2][0]),
+	     alnsb_maxflow_plane_load (mf, ALNSB_MAXFLOW_VOL_PP3, z,
+				       b->ring[ALNSB_MAXFLOW_VOL_PP3][0]),
+	     alnsb_maxflow_plane_load (mf, ALNSB_MAXFLOW_VOL_PP3, z + 1,
+				       b->ring[ALNSB_MAXFLOW_VOL_PP3][1]),
+	     alnsb_maxflow_plane_load (mf, ALNSB_MAXFLOW_VOL_PS, z,
+				       b->ring[ALNSB_MAXFLOW_VOL_PS][0]),
+	     alnsb_maxflow_plane_load (mf, ALNSB_MAXFLOW_VOL_PT, z,
+				       b->ring[ALNSB_MAXFLOW_VOL_PT][0]),
+	     pts);
+}
+
+
+static
+void fused_snapshot_halo (s_alnsb_maxflow_t* mf, s_fused_buffers_t* b)
+{
+  int S = mf->slices;
+  int s0 = b->s0;
+  int s1 = b->s1;
+  int z;
+
+  for (z = s0 - 2; z < s0; ++z)
+    if (z >= 0)
+      fused_snapshot_pts (mf, b, z, b->lo_pts[z - (s0 - 2)]);
+  for (z = s1; z < s1 + 2; ++z)
+    if (z < S)
+      fused_snapshot_pts (mf, b, z, b->hi_pts[z - s1]);
+  if (s0 >= 1)
+    {
+      fused_snapshot_copy (mf, ALNSB_MAXFLOW_VOL_PP1, s0 - 1, b->lo_pp1);
+      fused_snapshot_copy (mf, ALNSB_MAXFLOW_VOL_PP2, s0 - 1, b->lo_pp2);
+      fused_snapshot_copy (mf, ALNSB_MAXFLOW_VOL_PP3, s0 - 1, b->lo_pp3);
+    }
+  if (s1 < S)
+    {
+      fused_snapshot_copy (mf, ALNSB_MAXFLOW_VOL_PP1, s1, b->hi_pp1);
+      fused_snapshot_copy (mf, ALNSB_MAXFLOW_VOL_PP2, s1, b->hi_pp2);
+      fused_snapshot_copy (mf, ALNSB_MAXFLOW_VOL_PP3, s1, b->hi_pp3);
+    }
+  if (s1 + 1 < S)
+    fused_snapshot_copy (mf, ALNSB_MAXFLOW_VOL_PP3, s1 + 1, b->hi_pp3b);
+}
+
+
+/**
+ * Plane of an owned slice: shared data, or its ring buffer if the
+ * volume is packed.
+ *
+ */
+static
+ALNSB_IMAGE_TYPE_REAL* fused_owned_plane (s_alnsb_maxflow_t* mf,
+					  s_fused_buffers_t* b, int vol, int z)
+{
+  if (mf->packed[vol])
+    return b->ring[vol][z % FUSED_RING_SIZE];
+  return (*alnsb_maxflow_volume (mf, vol))->data +
+    z * alnsb_maxflow_plane_size (mf, vol);
+}
+
+
+/**
+ * Flow planes as seen from the slab: owned planes for owned slices,
+ * snapshot buffers for the halo.
+ *
+ */
+static
+ALNSB_IMAGE_TYPE_REAL* fused_pp1_plane (s_alnsb_maxflow_t* mf,
+					s_fused_buffers_t* b, int z)
+{
+  if (z == b->s0 - 1)
+    return b->lo_pp1;
+  if (z == b->s1)
+    return b->hi_pp1;
+  return fused_owned_plane (mf, b, ALNSB_MAXFLOW_VOL_PP1, z);
+}
+
+static
+ALNSB_IMAGE_TYPE_REAL* fused_pp2_plane (s_alnsb_maxflow_t* mf,
+					s_fused_buffers_t* b, int z)
+{
+  if (z == b->s0 - 1)
+    return b->lo_pp2;
+  if (z == b->s1)
+    return b->hi_pp2;
+  return fused_owned_plane (mf, b, ALNSB_MAXFLOW_VOL_PP2, z);
+}
+
+static
+ALNSB_IMAGE_TYPE_REAL* fused_pp3_plane (s_alnsb_maxflow_t* mf,
+					s_fused_buffers_t* b, int z)
+{
+  if (z == b->s0 - 1)
+    return b->lo_pp3;
+  if (z == b->s1)
+    return b->hi_pp3;
+  if (z == b->s1 + 1)
+    return b->hi_pp3b;
+  return fused_owned_plane (mf, b, ALNSB_MAXFLOW_VOL_PP3, z);
+}
+
+
+/**
+ * Decode (or encode back) the packed planes of the owned slice z.
+ *
+ */
+static
+void fused_ring_load (s_alnsb_maxflow_t* mf, s_fused_buffers_t* b, int z)
+{
+  int vol;
+  for (vol = 0; vol < ALNSB_MAXFLOW_NUM_VOLS; ++vol)
+    if (mf->packed[vol])
+      alnsb_maxflow_plane_load (mf, vol, z, b->ring[vol][z % FUSED_RING_SIZE]);
+}
+
+static
+void fused_ring_store (s_alnsb_maxflow_t* mf, s_fused_buffers_t* b, int z)
+{
+  int vol;
+  for (vol = 0; vol < ALNSB_MAXFLOW_NUM_VOLS; ++vol)
+    if (mf->packed[vol])
+      alnsb_maxflow_plane_store (mf, vol, z, b->ring[vol][z % FUSED_RING_SIZE]);
+}
+
+
+/**
+ * One inner step on the slab [s0, s1). Returns the sum of |erru|
+ * over the slab.
+ *
+ */
+static
+double fused_slab_step (s_alnsb_maxflow_t* mf, s_fused_buffers_t* b,
+			int kind)
+{
+  int S = mf->slices;
+  int R = mf->rows;
+  int C = mf->cols;
+  size_t P = R * C;
+  int s0 = b->s0;
+  int s1 = b->s1;
+  ALNSB_IMAGE_TYPE_REAL* pts_prev = NULL;
+  ALNSB_IMAGE_TYPE_REAL* pts_cur;
+  double err = 0;
+  // Next owned slices to decode and to encode back, if packed.
+  int ring_in = s0;
+  int ring_out = s0;
+  int z;
+
+  for (z = max(s0 - 2, 0); z <= min(s1 + 1, S); ++z)
+    {
+      if (mf->storage != ALNSB_MAXFLOW_STORAGE_FP32)
+	for (; ring_in < s1 && ring_in <= z + 1; ++ring_in)
+	  fused_ring_load (mf, b, ring_in);
+
+      // Stage 1: pts and flow update on slice z.
+      if (z < S)
+	{
+	  if (z < s0)
+	    pts_cur = b->lo_pts[z - (s0 - 2)];
+	  else if (z >= s1)
+	    pts_cur = b->hi_pts[z - s1];
+	  else
+	    {
+	      pts_cur = b->pts[z & 1];
+	      fused_pts (mf, z, 0, R, fused_pp1_plane (mf, b, z),
+			 fused_pp2_plane (mf, b, z), fused_pp3_plane (mf, b, z),
+			 fused_pp3_plane (mf, b, z + 1),
+			 fused_owned_plane (mf, b, ALNSB_MAXFLOW_VOL_PS, z),
+			 fused_owned_plane (mf, b, ALNSB_MAXFLOW_VOL_PT, z),
+			 pts_cur);
+	    }
+	  if (z >= s0 - 1)
+	    fused_flow_plane (C, 0, R, mf->steps, pts_cur,
+			      z >= 1 ? pts_prev : NULL,
+			      z <= s1 ? fused_pp1_plane (mf, b, z) : NULL,
+			      z <= s1 ? fused_pp2_plane (mf, b, z) : NULL,
+			      fused_pp3_plane (mf, b, z));
+	  pts_prev = pts_cur;
+	}
+
+      // Stage 2: gk and rescaling on slice g = z-1.
+      int g = z - 1;
+      if (g < max(s0 - 1, 0) || g > min(s1, S - 1))
+	continue;
+      ALNSB_IMAGE_TYPE_REAL* gk = b->gk[g & 1];
+      ALNSB_IMAGE_TYPE_REAL* gk_prev = b->gk[(g + 1) & 1];
+      if (g < S - 1)
+	fused_gk_plane (mf->kernels, R, C, 0, R, mf->alpha, fused_pp1_plane (mf, b, g),
+			fused_pp2_plane (mf, b, g), fused_pp3_plane (mf, b, g),
+			fused_pp3_plane (mf, b, g + 1), gk);
+      else
+	memset (gk, 0, P * sizeof(ALNSB_IMAGE_TYPE_REAL));
+      if (g >= s0)
+	fused_rescale_plane (C, 0, R, gk, g >= 1 ? gk_prev : NULL,
+			     g < s1 ? fused_pp1_plane (mf, b, g) : NULL,
+			     g < s1 ? fused_pp2_plane (mf, b, g) : NULL,
+			     fused_pp3_plane (mf, b, g));
+
+      // Stage 3: update of slice d = z-2.
+      int d = g - 1;
+      if (d >= s0 && d < s1 && d < S - 1)
+	err += fused_update (mf, kind, d, 0, R, fused_pp1_plane (mf, b, d),
+			     fused_pp2_plane (mf, b, d),
+			     fused_pp3_plane (mf, b, d),
+			     fused_pp3_plane (mf, b, d + 1),
+			     fused_owned_plane (mf, b, ALNSB_MAXFLOW_VOL_PS, d),
+			     fused_owned_plane (mf, b, ALNSB_MAXFLOW_VOL_PT, d));
+
+      if (mf->storage != ALNSB_MAXFLOW_STORAGE_FP32)
+	for (; ring_out < ring_in && ring_out <= z - 2; ++ring_out)
+	  fused_ring_store (mf, b, ring_out);
+    }
+  if (mf->storage != ALNSB_MAXFLOW_STORAGE_FP32)
+    for (; ring_out < ring_in; ++ring_out)
+      fused_ring_store (mf, b, ring_out);
+
+  return err;
+}
+
+
+/**
+ * Fused engine: same contract as alnsb_maxflow_reference_solve.
+ *
+ */
+int alnsb_maxflow_fused_solve (s_alnsb_maxflow_t* mf, float errb,
+			       int max_steps)
+{
+  return alnsb_maxflow_fused_run (mf, alnsb_maxflow_data_term (mf), errb,
+				  max_steps);
+}
+
+
+/**
+ * Inner steps of the fused engine, with the data term already
+ * prepared for the current class means (kind is the value returned
+ * by alnsb_maxflow_data_term). Also used by the narrow band engine
+ * for its full-volume steps.
+ *
+ */
+int alnsb_maxflow_fused_run (s_alnsb_maxflow_t* mf, int kind, float errb,
+			     int max_steps)
+{
+  int slices = mf->slices;
+  double num_pixels = (double) slices * mf->rows * mf->cols;
+  int num_threads = 1;
+  int nsteps = max_steps;
+#ifdef _OPENMP
+  num_threads = omp_get_max_threads ();
+#endif
+  double* partial_err =
+    alnsb_calloc (sizeof(double), num_threads * FUSED_PARTIAL_STRIDE);
+  size_t plane = mf->rows * mf->cols;
+  size_t ring = 0;
+  int vol;
+  for (vol = 0; vol < ALNSB_MAXFLOW_NUM_VOLS; ++vol)
+    if (mf->packed[vol])
+      ring += FUSED_RING_SIZE * alnsb_maxflow_plane_size (mf, vol);
+  size_t bytes = num_threads * sizeof(ALNSB_IMAGE_TYPE_REAL) *
+    (15 * plane + 2 * mf->rows + 2 * mf->cols + ring);
+  mf->buffer_bytes = max(mf->buffer_bytes, bytes);
+  int expired = 0;
+
+#pragma omp parallel
+  {
+    int tid = 0;
+    int nth = 1;
+#ifdef _OPENMP
+    tid = omp_get_thread_num ();
+    nth = omp_get_num_threads ();
+#endif
+    s_fused_buffers_t b;
+    int t, i;
+    fused_buffers_alloc (mf, &b);
+    b.s0 = (tid * slices) / nth;
+    b.s1 = ((tid + 1) * slices) / nth;
+
+    for (t = 0; t < max_steps; t++)
+      {
+	if (b.s0 < b.s1)
+	  fused_snapshot_halo (mf, &b);
+#pragma omp barrier
+	partial_err[tid * FUSED_PARTIAL_STRIDE] =
+	  b.s0 < b.s1 ? fused_slab_step (mf, &b, kind) : 0;
+	// The first thread reads the clock for all.
+	if (tid == 0)
+	  expired = alnsb_budget_expired (&mf->budget);
+#pragma omp barrier
+	// All threads reduce in the same order, so they all take the
+	// same decision.
+	double max_err = 0;
+	for (i = 0; i < nth; ++i)
+	  max_err += partial_err[i * FUSED_PARTIAL_STRIDE];
+	if (tid == 0)
+	  mf->max_err = max_err / num_pixels;
+	if ((max_err / num_pixels) < errb || expired)
+	  break;
+      }
+#pragma omp single
+    nsteps = t < max_steps ? t + 1 : max_steps;
+
+    fused_buffers_free (&b);
+  }
+  free (partial_err);
+
+  return nsteps;
+}
+
+
+/**
+ * Wavefront (time-tiled) engine.
+ *
+ * Each sweep over the slices advances a batch of up to time_tile
+ * inner steps. Step t+1 trails step t by two slices: when step t
+ * has completed its update of slice z-2, step t+1 can compute pts
+ * and the flows there, and step t does not read slices below z-1
+ * anymore. The live window is then 2*time_tile+3 slices, so every
+ * slice is brought from memory once per batch instead of once per
+ * step. Planes are shared by all threads, which split their rows
+ * between them; a barrier separates the sub-steps.
+ *
+ * Convergence is only checked at the end of a batch, on the error
+ * of its last step. Batches grow as 1, 2, 4, ... up to time_tile
+ * steps, so that solves which converge quickly do not execute many
+ * more steps than with the other engines.
+ *
+ */
+struct wavefront_pipe
+{
+  ALNSB_IMAGE_TYPE_REAL* pts[2];
+  ALNSB_IMAGE_TYPE_REAL* gk[2];
+};
+typedef struct wavefront_pipe s_wavefront_pipe_t;
+
+
+/**
+ * Process rows [j0, j1) of the head of one step at slice z. Must be
+ * called by all threads of the team, with the same z.
+ *
+ */
+static
+double wavefront_head (s_alnsb_maxflow_t* mf, s_wavefront_pipe_t* p,
+		       int kind, int z, int j0, int j1)
+{
+  int S = mf->slices;
+  int R = mf->rows;
+  int C = mf->cols;
+  size_t P = R * C;
+  size_t P1 = R * (C + 1);
+  size_t P2 = (R + 1) * C;
+  ALNSB_IMAGE_TYPE_REAL* pp1 = mf->pp1->data;
+  ALNSB_IMAGE_TYPE_REAL* pp2 = mf->pp2->data;
+  ALNSB_IMAGE_TYPE_REAL* pp3 = mf->pp3->data;
+  double err = 0;
+
+  // Stage 1: pts and flow update on slice z.
+  if (z < S)
+    {
+      ALNSB_IMAGE_TYPE_REAL* pts_cur = p->pts[z & 1];
+      fused_pts (mf, z, j0, j1, pp1 + z * P1, pp2 + z * P2, pp3 + z * P,
+		 pp3 + (z + 1) * P, mf->ps->data + z * P, mf->pt->data + z * P,
+		 pts_cur);
+#pragma omp barrier
+      fused_flow_plane (C, j0, j1, mf->steps, pts_cur,
+			z >= 1 ? p->pts[(z + 1) & 1] : NULL,
+			pp1 + z * P1, pp2 + z * P2, pp3 + z * P);
+#pragma omp barrier
+    }
+
+  // Stage 2: gk and rescaling on slice g = z-1.
+  int g = z - 1;
+  if (g < 0)
+    return 0;
+  ALNSB_IMAGE_TYPE_REAL* gk = p->gk[g & 1];
+  if (g < S - 1)
+    fused_gk_plane (mf->kernels, R, C, j0, j1, mf->alpha, pp1 + g * P1, pp2 + g * P2,
+		    pp3 + g * P, pp3 + (g + 1) * P, gk);
+  else
+    memset (gk + j0 * C, 0, (j1 - j0) * C * sizeof(ALNSB_IMAGE_TYPE_REAL));
+#pragma omp barrier
+  fused_rescale_plane (C, j0, j1, gk, g >= 1 ? p->gk[(g + 1) & 1] : NULL,
+		       pp1 + g * P1, pp2 + g * P2, pp3 + g * P);
+#pragma omp barrier
+
+  // Stage 3: update of slice d = z-2.
+  int d = g - 1;
+  if (d >= 0 && d < S - 1)
+    {
+      err = fused_update (mf, kind, d, j0, j1, pp1 + d * P1, pp2 + d * P2,
+			  pp3 + d * P, pp3 + (d + 1) * P, mf->ps->data + d * P,
+			  mf->pt->data + d * P);
+#pragma omp barrier
+    }
+
+  return err;
+}
+
+
+/**
+ * Wavefront engine: same contract as alnsb_maxflow_reference_solve,
+ * except that convergence is tested every time_tile steps.
+ *
+ */
+int alnsb_maxflow_wavefront_solve (s_alnsb_maxflow_t* mf, float errb,
+				   int max_steps, int time_tile)
+{
+  int S = mf->slices;
+  int R = mf->rows;
+  size_t P = R * mf->cols;
+  double num_pixels = (double) S * R * mf->cols;
+  int num_threads = 1;
+  int nsteps = 0;
+  int kind = alnsb_maxflow_data_term (mf);
+  int i;
+#ifdef _OPENMP
+  num_threads = omp_get_max_threads ();
+#endif
+  if (time_tile < 1)
+    time_tile = 1;
+  size_t bytes = 4 * time_tile * P * sizeof(ALNSB_IMAGE_TYPE_REAL);
+  mf->buffer_bytes = max(mf->buffer_bytes, bytes);
+  double* partial_err =
+    alnsb_calloc (sizeof(double), num_threads * FUSED_PARTIAL_STRIDE);
+  s_wavefront_pipe_t* pipes =
+    alnsb_calloc (sizeof(s_wavefront_pipe_t), time_tile);
+  int expired = 0;
+  for (i = 0; i < time_tile; ++i)
+    {
+      pipes[i].pts[0] = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+      pipes[i].pts[1] = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+      pipes[i].gk[0] = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+      pipes[i].gk[1] = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+    }
+
+#pragma omp parallel private(i)
+  {
+    int tid = 0;
+    int nth = 1;
+#ifdef _OPENMP
+    tid = omp_get_thread_num ();
+    nth = omp_get_num_threads ();
+#endif
+    int j0 = (tid * R) / nth;
+    int j1 = ((tid + 1) * R) / nth;
+    int t = 0;
+    int width = 1;
+
+    while (t < max_steps)
+      {
+	int batch = min(width, max_steps - t);
+	width = min(2 * width, time_tile);
+	double err = 0;
+	int zz, s;
+	for (zz = 0; zz <= S + 2 * (batch - 1); ++zz)
+	  for (s = 0; s < batch; ++s)
+	    {
+	      int z = zz - 2 * s;
+	      if (z < 0 || z > S)
+		continue;
+	      double e = wavefront_head (mf, &pipes[s], kind, z, j0,
+					 j1);
+	      if (s == batch - 1)
+		err += e;
+	    }
+	t += batch;
+	partial_err[tid * FUSED_PARTIAL_STRIDE] = err;
+	// The first thread reads the clock for all.
+	if (tid == 0)
+	  expired = alnsb_budget_expired (&mf->budget);
+#pragma omp barrier
+	double max_err = 0;
+	for (i = 0; i < nth; ++i)
+	  max_err += partial_err[i * FUSED_PARTIAL_STRIDE];
+	// Do not overwrite partial_err before all threads summed it.
+#pragma omp barrier
+	if (tid == 0)
+	  mf->max_err = max_err / num_pixels;
+	if ((max_err / num_pixels) < errb || expired)
+	  break;
+      }
+#pragma omp single
+    nsteps = t;
+  }
+
+  for (i = 0; i < time_tile; ++i)
+    {
+      free (pipes[i].pts[0]);
+      free (pipes[i].pts[1]);
+      free (pipes[i].gk[0]);
+      free (pipes[i].gk[1]);
+    }
+  free (pipes);
+  free (partial_err);
+
+  return nsteps;
+}
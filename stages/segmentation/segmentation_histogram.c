@@ -0,0 +1,152 @@
+/**
+ * segmentation_histogram.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Automatic initialization of the class means ulab.
+ *
+ * The outer loop of the segmentation is a fixed point iteration on
+ * ulab: each full inner solve is followed by the update of ulab to
+ * the mean intensities of the two classes of the mask. A start far
+ * from the fixed point costs outer iterations, and the right values
+ * depend on the data set (the run targets of the Makefile pass
+ * different values for the LIDC and NLST data).
+ *
+ * Here the input intensities are split in two classes by the Otsu
+ * threshold of their histogram, which maximizes the variance between
+ * the classes, and ulab is set to the class means of that split,
+ * computed as alnsb_maxflow_update_labels does (mean over the slices
+ * of the mean of each class in the slice). The histogram is built in
+ * parallel, one per thread, then merged.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+#include <stages/segmentation/segmentation_solver.h>
+#include <utilities/memfuncs.h>
+
+#define ALNSB_SEGMENTATION_HISTOGRAM_BINS	256
+
+
+/**
+ * Set ulab to the class means of the Otsu split of the input, and
+ * *threshold to the threshold. Returns 0, leaving ulab unchanged, if
+ * the input is constant.
+ *
+ */
+int alnsb_maxflow_auto_ulab (image3DReal* input, float ulab[2],
+			     float* threshold)
+{
+  int slices = input->slices;
+  int rows = input->rows;
+  int cols = input->cols;
+  size_t N = input->num_pixels;
+  ALNSB_IMAGE_TYPE_REAL* data = input->data;
+  double hist[ALNSB_SEGMENTATION_HISTOGRAM_BINS];
+  float lo = FLT_MAX, hi = -FLT_MAX;
+  size_t x;
+  int b, i;
+
+  // Range of the intensities.
+#pragma omp parallel for reduction(min:lo) reduction(max:hi)
+  for (x = 0; x < N; ++x)
+    {
+      if (data[x] < lo)
+	lo = data[x];
+      if (data[x] > hi)
+	hi = data[x];
+    }
+  if (! (hi > lo))
+    return 0;
+
+  // Histogram: one per thread, merged.
+  float scale = ALNSB_SEGMENTATION_HISTOGRAM_BINS / (hi - lo);
+  memset (hist, 0, sizeof(hist));
+#pragma omp parallel
+  {
+    double local[ALNSB_SEGMENTATION_HISTOGRAM_BINS];
+    memset (local, 0, sizeof(local));
+#pragma omp for nowait
+    for (x = 0; x < N; ++x)
+      {
+	int bin = (data[x] - lo) * scale;
+	local[bin < ALNSB_SEGMENTATION_HISTOGRAM_BINS ?
+	      bin : ALNSB_SEGMENTATION_HISTOGRAM_BINS - 1] += 1;
+      }
+#pragma omp critical
+    for (b = 0; b < ALNSB_SEGMENTATION_HISTOGRAM_BINS; ++b)
+      hist[b] += local[b];
+  }
+
+  // Otsu: the split maximizing w0 w1 (m0 - m1)^2, the bins being
+  // represented by their centers.
+  double sum = 0;
+  for (b = 0; b < ALNSB_SEGMENTATION_HISTOGRAM_BINS; ++b)
+    sum += hist[b] * (b + 0.5);
+  double w0 = 0, s0 = 0, best = -1;
+  int split = 0;
+  for (b = 0; b < ALNSB_SEGMENTATION_HISTOGRAM_BINS - 1; ++b)
+    {
+      w0 += hist[b];
+      s0 += hist[b] * (b + 0.5);
+      double w1 = N - w0;
+      if (w0 == 0 || w1 == 0)
+	continue;
+      double d = s0 / w0 - (sum - s0) / w1;
+      if (w0 * w1 * d * d > best)
+	{
+	  best = w0 * w1 * d * d;
+	  split = b;
+	}
+    }
+  float t = lo + (split + 1) / scale;
+
+  // Class means of the split, as in alnsb_maxflow_update_labels.
+  double m0 = 0, m1 = 0;
+#pragma omp parallel for reduction(+:m0,m1)
+  for (i = 0; i < slices; ++i)
+    {
+      ALNSB_IMAGE_TYPE_REAL* ur = data + (size_t) i * rows * cols;
+      double f = 0, g = 0, m = 0, n = 0;
+      size_t y;
+      for (y = 0; y < (size_t) rows * cols; ++y)
+	{
+	  if (ur[y] > t)
+	    {
+	      m += ur[y];
+	      n += 1;
+	    }
+	  else
+	    {
+	      f += ur[y];
+	      g += 1;
+	    }
+	}
+      if (g > 0)
+	m0 += f / g;
+      if (n > 0)
+	m1 += m / n;
+    }
+  ulab[0] = m0 / slices;
+  ulab[1] = m1 / slices;
+  *threshold = t;
+
+  return 1;
+}
@@ -0,0 +1,465 @@
+/**
+ * segmentation_narrowband.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Narrow band engine for the continuous max-flow solver.
+ *
+ * After a few outer iterations, u is saturated at 0 or 1 on most of
+ * the volume and only changes near the boundary between the two
+ * classes. This engine performs the inner steps on the active row
+ * segments of the volume only: each (slice, row) line is cut in
+ * segments of ALNSB_NARROWBAND_SEGMENT voxels, and a segment is
+ * active if one of its voxels has u within nb_band of 0.5, or moved
+ * by more than nb_tol in its last update. The active segments are
+ * dilated by ALNSB_NARROWBAND_HALO rows and slices, and by one
+ * segment along the row when an active voxel is near its end, so
+ * that the band can follow the boundary; the other voxels keep their
+ * state. A band step is pipelined over the slices as in the fused
+ * engine, and calls its row kernels on the runs of consecutive
+ * segments to update.
+ *
+ * The first step of a solve, every nb_revalidate-th step and any step
+ * which would end the solve are fused steps on the full volume,
+ * after which the activity of all the segments is recomputed: the
+ * solve only stops on a full step whose error is below errb.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <stages/segmentation/segmentation_solver.h>
+#include <utilities/memfuncs.h>
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+// Number of voxels of a row segment.
+#define ALNSB_NARROWBAND_SEGMENT 16
+
+// Number of rows and slices added around the active segments, and
+// distance (in voxels) to the end of a segment below which an active
+// voxel also activates the next segment on the row.
+#define ALNSB_NARROWBAND_HALO 1
+
+// Activity flags of a segment.
+#define NARROWBAND_ACTIVE	1
+#define NARROWBAND_LEFT		2
+#define NARROWBAND_RIGHT	4
+
+
+/**
+ * Segments updated by a band step: the active ones dilated by the
+ * halo (upd), and those one row or slice below (ext), on which pts
+ * and gk are also needed. Both are lists of runs of consecutive
+ * segments on a row, given by the index (i * rows + j) * nseg + q of
+ * their first segment and their number of segments, sorted by slice:
+ * the runs of slice i are upd[upd_first[i]] to
+ * upd[upd_first[i+1]-1], and likewise for ext.
+ *
+ */
+struct narrowband_segments
+{
+  int			nseg;
+  int			num_segs;
+  int*			upd;
+  int*			upd_len;
+  int*			upd_first;
+  int*			ext;
+  int*			ext_len;
+  int*			ext_first;
+  // Scratch bitmaps, one byte per segment.
+  unsigned char*	mark;
+  unsigned char*	ext_mark;
+  // Ring of the last two pts/gk planes of a band step. They are only
+  // read on the segments of ext, where the step computes them.
+  ALNSB_IMAGE_TYPE_REAL* pts[2];
+  ALNSB_IMAGE_TYPE_REAL* gk[2];
+};
+typedef struct narrowband_segments s_narrowband_segments_t;
+
+
+/**
+ * Build the lists of segments of a band step from the active ones.
+ * Returns the number of voxels updated by the step.
+ *
+ */
+static
+size_t narrowband_select (s_alnsb_maxflow_t* mf, s_narrowband_segments_t* nb,
+			  unsigned char* active)
+{
+  int slices = mf->slices;
+  int rows = mf->rows;
+  int cols = mf->cols;
+  int nseg = nb->nseg;
+  int h = ALNSB_NARROWBAND_HALO;
+  int num_upd = 0;
+  int num_ext = 0;
+  size_t voxels = 0;
+  int s, i, j, q, a, b, c;
+
+  memset (nb->mark, 0, nb->num_segs);
+  for (s = 0; s < nb->num_segs; s++)
+    if (active[s] & NARROWBAND_ACTIVE)
+      {
+	i = s / (rows * nseg);
+	j = (s / nseg) % rows;
+	q = s % nseg;
+	for (a = max(0, i - h); a <= min(slices - 1, i + h); a++)
+	  for (b = max(0, j - h); b <= min(rows - 1, j + h); b++)
+	    for (c = q - ((active[s] & NARROWBAND_LEFT) && q > 0);
+		 c <= q + ((active[s] & NARROWBAND_RIGHT) && q < nseg - 1); c++)
+	      nb->mark[(a * rows + b) * nseg + c] = 1;
+      }
+
+  for (s = 0; s < nb->num_segs; s++)
+    {
+      i = s / (rows * nseg);
+      j = (s / nseg) % rows;
+      if (s % (rows * nseg) == 0)
+	{
+	  nb->upd_first[i] = num_upd;
+	  nb->ext_first[i] = num_ext;
+	}
+      nb->ext_mark[s] = nb->mark[s]
+	|| (j < rows - 1 && nb->mark[s + nseg])
+	|| (i < slices - 1 && nb->mark[s + rows * nseg]);
+      q = s % nseg;
+      if (nb->mark[s])
+	{
+	  if (q > 0 && nb->mark[s - 1])
+	    nb->upd_len[num_upd - 1]++;
+	  else
+	    {
+	      nb->upd[num_upd] = s;
+	      nb->upd_len[num_upd++] = 1;
+	    }
+	  voxels += min(cols, (q + 1) * ALNSB_NARROWBAND_SEGMENT)
+	    - q * ALNSB_NARROWBAND_SEGMENT;
+	}
+      if (nb->ext_mark[s])
+	{
+	  if (q > 0 && nb->ext_mark[s - 1])
+	    nb->ext_len[num_ext - 1]++;
+	  else
+	    {
+	      nb->ext[num_ext] = s;
+	      nb->ext_len[num_ext++] = 1;
+	    }
+	}
+    }
+  nb->upd_first[slices] = num_upd;
+  nb->ext_first[slices] = num_ext;
+
+  return voxels;
+}
+
+
+/**
+ * Activity flags of the segment [k0, k1) of row j of slice i, from
+ * the state after its last update: |u' - u| is recomputed as
+ * cc * |divp + pt - ps|.
+ *
+ */
+static
+unsigned char narrowband_activity (s_alnsb_maxflow_t* mf, int i, int j,
+				   int k0, int k1)
+{
+  int rows = mf->rows;
+  int cols = mf->cols;
+  size_t x = ((size_t) i * rows + j) * cols;
+  ALNSB_IMAGE_TYPE_REAL* u = mf->u->data + x;
+  ALNSB_IMAGE_TYPE_REAL* divp = mf->divp->data + x;
+  ALNSB_IMAGE_TYPE_REAL* ps = mf->ps->data + x;
+  ALNSB_IMAGE_TYPE_REAL* pt = mf->pt->data + x;
+  float cc = mf->cc;
+  float band = mf->nb_band;
+  float tol = mf->nb_tol;
+  unsigned char act = 0;
+  int k;
+
+  if (i >= mf->slices - 1 || j >= rows - 1)
+    return 0;
+  for (k = k0; k < min(k1, cols - 1); k++)
+    if (fabs (cc * (divp[k] + pt[k] - ps[k])) > tol
+	|| fabs (u[k] - 0.5) < band)
+      {
+	act |= NARROWBAND_ACTIVE;
+	if (k - k0 < ALNSB_NARROWBAND_HALO)
+	  act |= NARROWBAND_LEFT;
+	if (k1 - 1 - k < ALNSB_NARROWBAND_HALO)
+	  act |= NARROWBAND_RIGHT;
+      }
+
+  return act;
+}
+
+
+/**
+ * One inner step on the segments of nb. As in the fused engine, the
+ * sub-steps are pipelined over the slices with a lag of one slice
+ * each, and use its row kernels; the threads share the runs of
+ * each slice. Updates the activity of the segments in nb->upd.
+ * Returns the sum of |erru| over the updated voxels.
+ *
+ */
+static
+double narrowband_step (s_alnsb_maxflow_t* mf, s_narrowband_segments_t* nb,
+			unsigned char* active, int kind)
+{
+  const s_alnsb_maxflow_kernels_t* kernels = mf->kernels;
+  int slices = mf->slices;
+  int rows = mf->rows;
+  int cols = mf->cols;
+  int nseg = nb->nseg;
+  float alpha = mf->alpha;
+  float cc = mf->cc;
+  float steps = mf->steps;
+  double err = 0;
+
+  ALNSB_IMRealTo3D(mf->ur, ur);
+  ALNSB_IMRealTo3D(mf->pp1, pp1);
+  ALNSB_IMRealTo3D(mf->pp2, pp2);
+  ALNSB_IMRealTo3D(mf->pp3, pp3);
+  ALNSB_IMRealTo3D(mf->u, u);
+  ALNSB_IMRealTo3D(mf->divp, divp);
+  ALNSB_IMRealTo3D(mf->ps, ps);
+  ALNSB_IMRealTo3D(mf->pt, pt);
+  // Cs/Ct only hold a cache for the cached kind of data term.
+  ALNSB_IMAGE_TYPE_REAL* Cs = mf->Cs ? mf->Cs->data : NULL;
+  ALNSB_IMAGE_TYPE_REAL* Ct = mf->Ct ? mf->Ct->data : NULL;
+
+#pragma omp parallel
+  {
+    int z, l, k;
+
+    for (z = 0; z <= slices + 1; z++)
+      {
+	// Stage 1: pts and flow update on slice z. pts, and gk below,
+	// are also computed on the column before each run of ext.
+	if (z < slices)
+	  {
+	    ALNSB_IMAGE_TYPE_REAL (*pts)[cols] =
+	      (ALNSB_IMAGE_TYPE_REAL (*)[cols])nb->pts[z & 1];
+	    ALNSB_IMAGE_TYPE_REAL (*pts_prev)[cols] =
+	      (ALNSB_IMAGE_TYPE_REAL (*)[cols])nb->pts[(z + 1) & 1];
+#pragma omp for schedule(static)
+	    for (l = nb->ext_first[z]; l < nb->ext_first[z+1]; l++)
+	      {
+		int s = nb->ext[l];
+		int j = (s / nseg) % rows;
+		int k0 = (s % nseg) * ALNSB_NARROWBAND_SEGMENT;
+		int k1 = min(cols, k0 + nb->ext_len[l] * ALNSB_NARROWBAND_SEGMENT);
+		k0 = max(k0 - 1, 0);
+		for (k = k0; k < k1; k++)
+		  pts[j][k] = divp[z][j][k] - (ps[z][j][k] - pt[z][j][k] + (u[z][j][k] / cc));
+	      }
+#pragma omp for schedule(static)
+	    for (l = nb->upd_first[z]; l < nb->upd_first[z+1]; l++)
+	      {
+		int s = nb->upd[l];
+		int j = (s / nseg) % rows;
+		int k0 = (s % nseg) * ALNSB_NARROWBAND_SEGMENT;
+		int k1 = min(cols, k0 + nb->upd_len[l] * ALNSB_NARROWBAND_SEGMENT);
+		for (k = max(k0, 1); k < k1; k++)
+		  pp1[z][j][k] = pp1[z][j][k] + (steps * (pts[j][k] - pts[j][k-1]));
+		if (j >= 1)
+		  for (k = k0; k < k1; k++)
+		    pp2[z][j][k] = pp2[z][j][k] + (steps * (pts[j][k] - pts[j-1][k]));
+		if (z >= 1)
+		  for (k = k0; k < k1; k++)
+		    pp3[z][j][k] = pp3[z][j][k] + (steps * (pts[j][k] - pts_prev[j][k]));
+	      }
+	  }
+
+	// Stage 2: gk and rescaling on slice g = z-1. gk is 0 on the
+	// last slice, row and column, as in the reference.
+	int g = z - 1;
+	if (g >= 0 && g < slices)
+	  {
+	    ALNSB_IMAGE_TYPE_REAL (*gk)[cols] =
+	      (ALNSB_IMAGE_TYPE_REAL (*)[cols])nb->gk[g & 1];
+	    ALNSB_IMAGE_TYPE_REAL (*gk_prev)[cols] =
+	      (ALNSB_IMAGE_TYPE_REAL (*)[cols])nb->gk[(g + 1) & 1];
+	    if (g == slices - 1)
+	      {
+#pragma omp single
+		memset (nb->gk[g & 1], 0,
+			rows * cols * sizeof(ALNSB_IMAGE_TYPE_REAL));
+	      }
+	    else
+	      {
+#pragma omp for schedule(static)
+		for (l = nb->ext_first[g]; l < nb->ext_first[g+1]; l++)
+		  {
+		    int s = nb->ext[l];
+		    int j = (s / nseg) % rows;
+		    int k0 = (s % nseg) * ALNSB_NARROWBAND_SEGMENT;
+		    int k1 = min(cols - 1,
+				 k0 + nb->ext_len[l] * ALNSB_NARROWBAND_SEGMENT);
+		    k0 = max(k0 - 1, 0);
+		    if (j < rows - 1 && k0 < k1)
+		      kernels->gk_row (k1 - k0, alpha, &pp1[g][j][k0],
+				       &pp2[g][j][k0], &pp2[g][j+1][k0],
+				       &pp3[g][j][k0], &pp3[g+1][j][k0],
+				       &gk[j][k0]);
+		  }
+	      }
+#pragma omp for schedule(static)
+	    for (l = nb->upd_first[g]; l < nb->upd_first[g+1]; l++)
+	      {
+		int s = nb->upd[l];
+		int j = (s / nseg) % rows;
+		int k0 = (s % nseg) * ALNSB_NARROWBAND_SEGMENT;
+		int k1 = min(cols, k0 + nb->upd_len[l] * ALNSB_NARROWBAND_SEGMENT);
+		for (k = max(k0, 1); k < k1; k++)
+		  pp1[g][j][k] = (0.5 * (gk[j][k] + gk[j][k-1])) * pp1[g][j][k];
+		if (j >= 1)
+		  for (k = k0; k < k1; k++)
+		    pp2[g][j][k] = (0.5 * (gk[j][k] + gk[j-1][k])) * pp2[g][j][k];
+		if (g >= 1)
+		  for (k = k0; k < k1; k++)
+		    pp3[g][j][k] = (0.5 * (gk[j][k] + gk_prev[j][k])) * pp3[g][j][k];
+	      }
+	  }
+
+	// Stage 3: update of slice d = z-2, and activity of its
+	// segments.
+	int d = g - 1;
+	if (d >= 0 && d < slices - 1)
+	  {
+#pragma omp for schedule(static) reduction(+:err)
+	    for (l = nb->upd_first[d]; l < nb->upd_first[d+1]; l++)
+	      {
+		int s = nb->upd[l];
+		int j = (s / nseg) % rows;
+		int k0 = (s % nseg) * ALNSB_NARROWBAND_SEGMENT;
+		int k1 = min(cols, k0 + nb->upd_len[l] * ALNSB_NARROWBAND_SEGMENT);
+		size_t x = ((size_t) d * rows + j) * cols + k0;
+		if (j < rows - 1 && k0 < cols - 1)
+		  err += kernels->update_row (kind, min(k1, cols - 1) - k0, cc,
+					      mf->beta, mf->ulab[0], mf->ulab[1],
+					      &ur[d][j][k0], Cs ? Cs + x : NULL,
+					      Ct ? Ct + x : NULL, &pp1[d][j][k0],
+					      &pp2[d][j][k0], &pp2[d][j+1][k0],
+					      &pp3[d][j][k0], &pp3[d+1][j][k0],
+					      &divp[d][j][k0], &ps[d][j][k0],
+					      &pt[d][j][k0], &u[d][j][k0]);
+		int c;
+		for (c = 0; c < nb->upd_len[l]; c++)
+		  active[s + c] =
+		    narrowband_activity (mf, d, j,
+					 k0 + c * ALNSB_NARROWBAND_SEGMENT,
+					 min(k1, k0 + (c + 1) * ALNSB_NARROWBAND_SEGMENT));
+	      }
+	  }
+      }
+  }
+
+  return err;
+}
+
+
+/**
+ * Narrow band engine: same contract as alnsb_maxflow_reference_solve.
+ *
+ */
+int alnsb_maxflow_narrowband_solve (s_alnsb_maxflow_t* mf, float errb,
+				    int max_steps)
+{
+  int rows = mf->rows;
+  int cols = mf->cols;
+  double num_pixels = (double) mf->slices * rows * cols;
+  int kind = alnsb_maxflow_data_term (mf);
+  int revalidate = max(1, mf->nb_revalidate);
+  s_narrowband_segments_t nb;
+  int t, s;
+
+  nb.nseg = (cols + ALNSB_NARROWBAND_SEGMENT - 1) / ALNSB_NARROWBAND_SEGMENT;
+  nb.num_segs = mf->slices * rows * nb.nseg;
+  unsigned char* active = alnsb_calloc (1, nb.num_segs);
+  nb.upd = alnsb_calloc (sizeof(int), nb.num_segs);
+  nb.upd_len = alnsb_calloc (sizeof(int), nb.num_segs);
+  nb.upd_first = alnsb_calloc (sizeof(int), mf->slices + 1);
+  nb.ext = alnsb_calloc (sizeof(int), nb.num_segs);
+  nb.ext_len = alnsb_calloc (sizeof(int), nb.num_segs);
+  nb.ext_first = alnsb_calloc (sizeof(int), mf->slices + 1);
+  nb.mark = alnsb_calloc (1, nb.num_segs);
+  nb.ext_mark = alnsb_calloc (1, nb.num_segs);
+  for (s = 0; s < 2; s++)
+    {
+      nb.pts[s] = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), rows * cols);
+      nb.gk[s] = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), rows * cols);
+    }
+  mf->buffer_bytes = max(mf->buffer_bytes,
+			 nb.num_segs * (4 * sizeof(int) + 3) +
+			 4 * rows * cols * sizeof(ALNSB_IMAGE_TYPE_REAL));
+
+  // The class means changed since the last solve: start with a full
+  // step.
+  int full = 1;
+  for (t = 0; t < max_steps; t++)
+    {
+      double err;
+      if (full)
+	{
+	  alnsb_maxflow_fused_run (mf, kind, 0, 1);
+	  err = mf->max_err * num_pixels;
+#pragma omp parallel for schedule(static)
+	  for (s = 0; s < nb.num_segs; s++)
+	    {
+	      int k0 = (s % nb.nseg) * ALNSB_NARROWBAND_SEGMENT;
+	      active[s] = narrowband_activity (mf, s / (rows * nb.nseg),
+					       (s / nb.nseg) % rows, k0,
+					       min(cols, k0 + ALNSB_NARROWBAND_SEGMENT));
+	    }
+	  mf->nb_updated += 1;
+	}
+      else
+	{
+	  size_t voxels = narrowband_select (mf, &nb, active);
+	  err = narrowband_step (mf, &nb, active, kind);
+	  mf->nb_updated += voxels / num_pixels;
+	}
+      mf->nb_steps++;
+
+      mf->max_err = err / num_pixels;
+      int converged = (err / num_pixels) < errb;
+      if ((converged && full) || alnsb_budget_expired (&mf->budget))
+	break;
+      full = converged || (t + 1) % revalidate == 0;
+    }
+
+  free (active);
+  free (nb.upd);
+  free (nb.upd_len);
+  free (nb.upd_first);
+  free (nb.ext);
+  free (nb.ext_len);
+  free (nb.ext_first);
+  free (nb.mark);
+  free (nb.ext_mark);
+  for (s = 0; s < 2; s++)
+    {
+      free (nb.pts[s]);
+      free (nb.gk[s]);
+    }
+
+  return t < max_steps ? t + 1 : max_steps;
+}
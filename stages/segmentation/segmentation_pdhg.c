@@ -0,0 +1,233 @@
+/**
+ * segmentation_pdhg.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Primal-dual (Chambolle-Pock) solver of the inner problem.
+ *
+ * The continuous max-flow problem is the dual of
+ *
+ *   min_{0 <= u <= 1}  sum (1 - u) Cs + u Ct + alpha TV(u)
+ *
+ * whose saddle point form, with the flows p as the dual variable of
+ * the total variation, is min_u max_{|p| <= alpha} of
+ * sum (1 - u) Cs + u Ct + u div(p). Each step is
+ *
+ *   p    = P_alpha (p - sigma grad(ubar))
+ *   u'   = clamp (u - tau (Ct - Cs + div(p)), 0, 1)
+ *   ubar = 2 u' - u
+ *
+ * where P_alpha is the scaling by gk of the CMF engines, so that both
+ * solvers discretize the total variation the same way, and update the
+ * same voxels. The source and sink flows are not needed. Convergence
+ * requires tau sigma |grad|^2 <= 1, that is tau sigma <= 1/12 in 3D;
+ * a large tau over sigma ratio moves u faster, which suits the
+ * outer loop, where u starts from the thresholded data term.
+ *
+ * A step is three sweeps over the slices, in parallel: the dual
+ * ascent and gk, then the scaling of pp3 (which needs gk on the two
+ * sides of the face), then the scaling of pp1/pp2 and the primal
+ * update. The steps stop when the mean |u' - u| is below errb.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <stages/segmentation/segmentation_solver.h>
+#include <utilities/memfuncs.h>
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/**
+ * Dual ascent on the flows of slice z, then gk on the slice. pp3 of
+ * the next slice is owned by another thread: its updated rows are
+ * recomputed in p3n.
+ *
+ */
+static
+void pdhg_flows (s_alnsb_maxflow_t* mf, int z, ALNSB_IMAGE_TYPE_REAL* p3n)
+{
+  int R = mf->rows;
+  int C = mf->cols;
+  size_t P = R * C;
+  float sigma = mf->sigma;
+  ALNSB_IMAGE_TYPE_REAL (*ub)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->ubar->data + z * P);
+  ALNSB_IMAGE_TYPE_REAL (*ubn)[C] = ub + R;
+  ALNSB_IMAGE_TYPE_REAL (*ubp)[C] = ub - R;
+  ALNSB_IMAGE_TYPE_REAL (*pp1)[C+1] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C+1])(mf->pp1->data + z * R * (C+1));
+  ALNSB_IMAGE_TYPE_REAL (*pp2)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->pp2->data + z * (R+1) * C);
+  ALNSB_IMAGE_TYPE_REAL (*pp3)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->pp3->data + z * P);
+  ALNSB_IMAGE_TYPE_REAL (*pp3n)[C] = pp3 + R;
+  ALNSB_IMAGE_TYPE_REAL (*gk)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->gk->data + z * P);
+  int j, k;
+
+  for (j = 0; j < R; j++)
+    for (k = 1; k < C; k++)
+      pp1[j][k] = pp1[j][k] - sigma * (ub[j][k] - ub[j][k-1]);
+  for (j = 1; j < R; j++)
+    for (k = 0; k < C; k++)
+      pp2[j][k] = pp2[j][k] - sigma * (ub[j][k] - ub[j-1][k]);
+  if (z >= 1)
+    for (j = 0; j < R; j++)
+      for (k = 0; k < C; k++)
+	pp3[j][k] = pp3[j][k] - sigma * (ub[j][k] - ubp[j][k]);
+
+  // gk is 0 on the last slice, row and col, as in the CMF engines.
+  if (z == mf->slices - 1)
+    return;
+  for (j = 0; j < R-1; j++)
+    {
+      for (k = 0; k < C-1; k++)
+	p3n[k] = pp3n[j][k] - sigma * (ubn[j][k] - ub[j][k]);
+      mf->kernels->gk_row (C-1, mf->alpha, pp1[j], pp2[j], pp2[j+1], pp3[j],
+			   p3n, gk[j]);
+    }
+}
+
+
+/**
+ * Scaling of the pp3 flows of slice z by gk.
+ *
+ */
+static
+void pdhg_scale_pp3 (s_alnsb_maxflow_t* mf, int z)
+{
+  size_t P = mf->rows * mf->cols;
+  ALNSB_IMAGE_TYPE_REAL* pp3 = mf->pp3->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL* gk = mf->gk->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL* gkp = gk - P;
+  size_t x;
+
+  for (x = 0; x < P; ++x)
+    pp3[x] = (0.5 * (gk[x] + gkp[x])) * pp3[x];
+}
+
+
+/**
+ * Scaling of the pp1/pp2 flows of slice z by gk, then primal update
+ * of u on the slice. Returns the sum of |u' - u|.
+ *
+ */
+static
+double pdhg_primal (s_alnsb_maxflow_t* mf, int kind, int z)
+{
+  int R = mf->rows;
+  int C = mf->cols;
+  size_t P = R * C;
+  float tau = mf->tau;
+  float beta = mf->beta;
+  float ulab0 = mf->ulab[0];
+  float ulab1 = mf->ulab[1];
+  ALNSB_IMAGE_TYPE_REAL (*ur)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->ur->data + z * P);
+  ALNSB_IMAGE_TYPE_REAL (*Cs)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->Cs ? mf->Cs->data + z * P : NULL);
+  ALNSB_IMAGE_TYPE_REAL (*Ct)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->Ct ? mf->Ct->data + z * P : NULL);
+  ALNSB_IMAGE_TYPE_REAL (*u)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->u->data + z * P);
+  ALNSB_IMAGE_TYPE_REAL (*ub)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->ubar->data + z * P);
+  ALNSB_IMAGE_TYPE_REAL (*pp1)[C+1] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C+1])(mf->pp1->data + z * R * (C+1));
+  ALNSB_IMAGE_TYPE_REAL (*pp2)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->pp2->data + z * (R+1) * C);
+  ALNSB_IMAGE_TYPE_REAL (*pp3)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->pp3->data + z * P);
+  ALNSB_IMAGE_TYPE_REAL (*pp3n)[C] = pp3 + R;
+  ALNSB_IMAGE_TYPE_REAL (*gk)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->gk->data + z * P);
+  double err = 0;
+  int j, k;
+
+  for (j = 0; j < R; j++)
+    for (k = 1; k < C; k++)
+      pp1[j][k] = (0.5 * (gk[j][k] + gk[j][k-1])) * pp1[j][k];
+  for (j = 1; j < R; j++)
+    for (k = 0; k < C; k++)
+      pp2[j][k] = (0.5 * (gk[j][k] + gk[j-1][k])) * pp2[j][k];
+
+  if (z == mf->slices - 1)
+    return 0;
+  for (j = 0; j < R-1; j++)
+    for (k = 0; k < C-1; k++)
+      {
+	float divp = pp2[j+1][k] - pp2[j][k] + pp1[j][k+1] - pp1[j][k] +
+	  pp3n[j][k] - pp3[j][k];
+	float ds = ALNSB_MAXFLOW_DATA_TERM(kind, ur[j][k] - ulab0, beta,
+					   Cs[j][k]);
+	float dt = ALNSB_MAXFLOW_DATA_TERM(kind, ur[j][k] - ulab1, beta,
+					   Ct[j][k]);
+	float un = u[j][k] - tau * (dt - ds + divp);
+	un = min (max (un, 0), 1);
+	err += fabs (un - u[j][k]);
+	ub[j][k] = 2 * un - u[j][k];
+	u[j][k] = un;
+      }
+
+  return err;
+}
+
+
+/**
+ * PDHG solver: same contract as alnsb_maxflow_reference_solve, errb
+ * bounding the mean update of u.
+ *
+ */
+int alnsb_maxflow_pdhg_solve (s_alnsb_maxflow_t* mf, float errb,
+			      int max_steps)
+{
+  int S = mf->slices;
+  int C = mf->cols;
+  size_t N = mf->u->num_pixels;
+  int kind = alnsb_maxflow_data_term (mf);
+  int t, z;
+
+  for (t = 0; t < max_steps; t++)
+    {
+      double err = 0;
+#pragma omp parallel
+      {
+	ALNSB_IMAGE_TYPE_REAL* p3n =
+	  alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), C);
+#pragma omp for
+	for (z = 0; z < S; z++)
+	  pdhg_flows (mf, z, p3n);
+#pragma omp for
+	for (z = 1; z < S; z++)
+	  pdhg_scale_pp3 (mf, z);
+#pragma omp for reduction(+:err)
+	for (z = 0; z < S; z++)
+	  err += pdhg_primal (mf, kind, z);
+	free (p3n);
+      }
+      mf->max_err = err / N;
+      if (err / N < errb || alnsb_budget_expired (&mf->budget))
+	break;
+    }
+
+  return t < max_steps ? t + 1 : max_steps;
+}
@@ -0,0 +1,362 @@
+/**
+ * segmentation_redblack.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Red-black (Gauss-Seidel) engine for the continuous max-flow solver.
+ *
+ * The other engines are Jacobi-style: each inner step computes all
+ * the flows from the state of the previous step. This engine updates
+ * the state in place, slice by slice, in two half-steps: first the
+ * even slices, then the odd ones, which see the state just computed
+ * for their even neighbors. Slice z owns its pp1 and pp2 flows and
+ * the pp3 flows of its lower face (between slices z-1 and z), and
+ * updates them, then ps, pt, u and divp of the slice. The slices of
+ * a color share no flow, and are updated in parallel.
+ *
+ * For locality, the two half-steps are interleaved: each thread takes
+ * a range of slice pairs (2p, 2p+1), and updates the odd slice 2p-1
+ * right after the even slice 2p, both of its even neighbors being
+ * done. The last odd slice of a range needs the first even slice of
+ * the next range, and is updated after a barrier. This gives the same
+ * results as two separate half-steps, whatever the number of
+ * threads.
+ *
+ * The pp3 flows of the lower face change the divergence of slice
+ * z-1 as well, which is corrected in place: divp always matches the
+ * flows, and no full-volume temporary is needed, only two planes
+ * (pts and gk) and a few rows per thread. The gk of slice z-1, used
+ * to scale the lower face, is recomputed from its current flows.
+ *
+ * As in any Gauss-Seidel ordering, the iterates differ from the ones
+ * of the Jacobi engines, and so do the masks, slightly.
+ *
+ * The in-place update of a slice also allows several solvers to
+ * advance in the same sweeps (alnsb_maxflow_redblack_batch_step):
+ * the even slices of all the volumes, then their odd slices, are
+ * updated in one parallel loop each, which keeps all the threads busy
+ * when the volumes have few slices.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+#include <stages/segmentation/segmentation_solver.h>
+#include <utilities/memfuncs.h>
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/**
+ * Per-thread buffers: pts and gk of the slice, and rows of pts, gk
+ * and the pp3 flows before the step for the lower face.
+ *
+ */
+struct redblack_buffers
+{
+  ALNSB_IMAGE_TYPE_REAL* pts;
+  ALNSB_IMAGE_TYPE_REAL* gk;
+  ALNSB_IMAGE_TYPE_REAL* ptsp;
+  ALNSB_IMAGE_TYPE_REAL* gkp;
+  ALNSB_IMAGE_TYPE_REAL* old;
+};
+typedef struct redblack_buffers s_redblack_buffers_t;
+
+
+/**
+ * Update slice z in place. Returns the sum of |erru| over the slice.
+ *
+ */
+static
+double redblack_slice (s_alnsb_maxflow_t* mf, s_redblack_buffers_t* b,
+		       int kind, int z)
+{
+  int R = mf->rows;
+  int C = mf->cols;
+  size_t P = R * C;
+  float cc = mf->cc;
+  float steps = mf->steps;
+  ALNSB_IMAGE_TYPE_REAL* ur = mf->ur->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL* Cs = mf->Cs ? mf->Cs->data + z * P : NULL;
+  ALNSB_IMAGE_TYPE_REAL* Ct = mf->Ct ? mf->Ct->data + z * P : NULL;
+  ALNSB_IMAGE_TYPE_REAL* ps = mf->ps->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL* pt = mf->pt->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL* u = mf->u->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL* divp = mf->divp->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL (*pp1)[C+1] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C+1])(mf->pp1->data + z * R * (C+1));
+  ALNSB_IMAGE_TYPE_REAL (*pp2)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->pp2->data + z * (R+1) * C);
+  ALNSB_IMAGE_TYPE_REAL (*pp3)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->pp3->data + z * P);
+  ALNSB_IMAGE_TYPE_REAL (*pp3n)[C] = pp3 + R;
+  ALNSB_IMAGE_TYPE_REAL (*pts)[C] = (ALNSB_IMAGE_TYPE_REAL (*)[C])b->pts;
+  ALNSB_IMAGE_TYPE_REAL (*gk)[C] = (ALNSB_IMAGE_TYPE_REAL (*)[C])b->gk;
+  int last = z == mf->slices - 1;
+  double err = 0;
+  size_t x;
+  int j, k;
+
+  for (x = 0; x < P; ++x)
+    b->pts[x] = divp[x] - (ps[x] - pt[x] + (u[x] / cc));
+
+  for (j = 0; j < R; j++)
+    for (k = 1; k < C; k++)
+      pp1[j][k] = pp1[j][k] + (steps * (pts[j][k] - pts[j][k-1]));
+  for (j = 1; j < R; j++)
+    for (k = 0; k < C; k++)
+      pp2[j][k] = pp2[j][k] + (steps * (pts[j][k] - pts[j-1][k]));
+
+  // Lower face, row by row: the pp3 flows, gk of the slice, gk of
+  // slice z-1, and the scaling of the face.
+  ALNSB_IMAGE_TYPE_REAL* psp = ps - P;
+  ALNSB_IMAGE_TYPE_REAL* ptp = pt - P;
+  ALNSB_IMAGE_TYPE_REAL* up = u - P;
+  ALNSB_IMAGE_TYPE_REAL* divpp = divp - P;
+  ALNSB_IMAGE_TYPE_REAL (*pp1p)[C+1] = pp1 - R;
+  ALNSB_IMAGE_TYPE_REAL (*pp2p)[C] = pp2 - (R+1);
+  ALNSB_IMAGE_TYPE_REAL (*pp3p)[C] = pp3 - R;
+  ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR ptsp = b->ptsp;
+  ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR gkp = b->gkp;
+  ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR old = b->old;
+  if (last)
+    memset (b->gk, 0, P * sizeof(ALNSB_IMAGE_TYPE_REAL));
+  for (j = 0; j < R; j++)
+    {
+      x = j * C;
+      if (z >= 1)
+	{
+	  for (k = 0; k < C; k++)
+	    ptsp[k] = divpp[x+k] - (psp[x+k] - ptp[x+k] + (up[x+k] / cc));
+	  for (k = 0; k < C; k++)
+	    {
+	      old[k] = pp3[j][k];
+	      pp3[j][k] = pp3[j][k] + (steps * (pts[j][k] - ptsp[k]));
+	    }
+	}
+      if (j == R-1)
+	{
+	  memset (gk[j], 0, C * sizeof(ALNSB_IMAGE_TYPE_REAL));
+	  memset (gkp, 0, C * sizeof(ALNSB_IMAGE_TYPE_REAL));
+	}
+      else
+	{
+	  if (! last)
+	    mf->kernels->gk_row (C-1, mf->alpha, pp1[j], pp2[j], pp2[j+1],
+				 pp3[j], pp3n[j], gk[j]);
+	  if (z >= 1)
+	    mf->kernels->gk_row (C-1, mf->alpha, pp1p[j], pp2p[j], pp2p[j+1],
+				 pp3p[j], pp3[j], gkp);
+	  // gk is 0 on the last column. The buffers may have held the
+	  // wider slices of another solver of a batch.
+	  gk[j][C-1] = 0;
+	  gkp[C-1] = 0;
+	}
+      if (z >= 1)
+	{
+	  for (k = 0; k < C; k++)
+	    pp3[j][k] = (0.5 * (gk[j][k] + gkp[k])) * pp3[j][k];
+	  if (j < R-1)
+	    for (k = 0; k < C-1; k++)
+	      divpp[x+k] += pp3[j][k] - old[k];
+	}
+    }
+
+  for (j = 0; j < R; j++)
+    for (k = 1; k < C; k++)
+      pp1[j][k] = (0.5 * (gk[j][k] + gk[j][k-1])) * pp1[j][k];
+  for (j = 1; j < R; j++)
+    for (k = 0; k < C; k++)
+      pp2[j][k] = (0.5 * (gk[j][k] + gk[j-1][k])) * pp2[j][k];
+
+  if (last)
+    return 0;
+  for (j = 0; j < R-1; j++)
+    {
+      x = j * C;
+      err += mf->kernels->update_row (kind, C-1, cc, mf->beta, mf->ulab[0],
+				      mf->ulab[1], ur + x,
+				      Cs ? Cs + x : NULL, Ct ? Ct + x : NULL,
+				      pp1[j], pp2[j], pp2[j+1], pp3[j],
+				      pp3n[j], divp + x, ps + x, pt + x,
+				      u + x);
+    }
+
+  return err;
+}
+
+
+/**
+ * Red-black engine: same contract as alnsb_maxflow_reference_solve.
+ *
+ */
+int alnsb_maxflow_redblack_solve (s_alnsb_maxflow_t* mf, float errb,
+				  int max_steps)
+{
+  int S = mf->slices;
+  int R = mf->rows;
+  int C = mf->cols;
+  size_t P = R * C;
+  size_t N = mf->u->num_pixels;
+  int kind = alnsb_maxflow_data_term (mf);
+  int num_threads = 1;
+  int t;
+#ifdef _OPENMP
+  num_threads = omp_get_max_threads ();
+#endif
+
+  mf->buffer_bytes = max(mf->buffer_bytes, num_threads *
+			 (2 * P + 3 * C) * sizeof(ALNSB_IMAGE_TYPE_REAL));
+
+  for (t = 0; t < max_steps; t++)
+    {
+      double err = 0;
+#pragma omp parallel reduction(+:err)
+      {
+	s_redblack_buffers_t b;
+	int pairs = (S + 1) / 2;
+	int tid = 0, nth = 1;
+	int p;
+#ifdef _OPENMP
+	tid = omp_get_thread_num ();
+	nth = omp_get_num_threads ();
+#endif
+	int lo = (long) pairs * tid / nth;
+	int hi = (long) pairs * (tid + 1) / nth;
+	b.pts = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+	b.gk = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+	b.ptsp = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), 3 * C);
+	b.gkp = b.ptsp + C;
+	b.old = b.gkp + C;
+
+	for (p = lo; p < hi; ++p)
+	  {
+	    err += redblack_slice (mf, &b, kind, 2 * p);
+	    if (p > lo)
+	      err += redblack_slice (mf, &b, kind, 2 * p - 1);
+	  }
+#pragma omp barrier
+	if (lo < hi && 2 * hi - 1 < S)
+	  err += redblack_slice (mf, &b, kind, 2 * hi - 1);
+
+	free (b.pts);
+	free (b.gk);
+	free (b.ptsp);
+      }
+      mf->max_err = err / N;
+      if (err / N < errb || alnsb_budget_expired (&mf->budget))
+	break;
+    }
+
+  return t < max_steps ? t + 1 : max_steps;
+}
+
+
+/**
+ * One inner step of each of the n solvers of mfs, in the same two
+ * parallel sweeps. err[i] is set to the mean |erru| of solver i. The
+ * solvers may have different sizes.
+ *
+ */
+void alnsb_maxflow_redblack_batch_step (s_alnsb_maxflow_t** mfs, int n,
+					double* err)
+{
+  size_t P = 0;
+  int C = 0;
+  int num_slices = 0;
+  int num_threads = 1;
+  int i, z, q;
+#ifdef _OPENMP
+  num_threads = omp_get_max_threads ();
+#endif
+
+  for (i = 0; i < n; ++i)
+    {
+      P = max(P, (size_t) mfs[i]->rows * mfs[i]->cols);
+      C = max(C, mfs[i]->cols);
+      num_slices += mfs[i]->slices;
+    }
+  for (i = 0; i < n; ++i)
+    mfs[i]->buffer_bytes = max(mfs[i]->buffer_bytes, num_threads *
+			       (2 * P + 3 * C) * sizeof(ALNSB_IMAGE_TYPE_REAL));
+
+  // All the (solver, slice) pairs, the even slices first, and the
+  // error of each slice.
+  int* vol = alnsb_calloc (sizeof(int), 2 * num_slices);
+  int* slice = vol + num_slices;
+  int* kind = alnsb_calloc (sizeof(int), n);
+  double* slice_err = alnsb_calloc (sizeof(double), num_slices);
+  int num_even;
+  q = 0;
+  for (i = 0; i < n; ++i)
+    {
+      kind[i] = alnsb_maxflow_data_term (mfs[i]);
+      for (z = 0; z < mfs[i]->slices; z += 2, ++q)
+	{
+	  vol[q] = i;
+	  slice[q] = z;
+	}
+    }
+  num_even = q;
+  for (i = 0; i < n; ++i)
+    for (z = 1; z < mfs[i]->slices; z += 2, ++q)
+      {
+	vol[q] = i;
+	slice[q] = z;
+      }
+
+#pragma omp parallel
+  {
+    s_redblack_buffers_t b;
+    b.pts = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+    b.gk = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+    b.ptsp = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), 3 * C);
+    b.gkp = b.ptsp + C;
+    b.old = b.gkp + C;
+
+#pragma omp for schedule(dynamic)
+    for (q = 0; q < num_even; ++q)
+      slice_err[q] = redblack_slice (mfs[vol[q]], &b, kind[vol[q]], slice[q]);
+#pragma omp for schedule(dynamic)
+    for (q = num_even; q < num_slices; ++q)
+      slice_err[q] = redblack_slice (mfs[vol[q]], &b, kind[vol[q]], slice[q]);
+
+    free (b.pts);
+    free (b.gk);
+    free (b.ptsp);
+  }
+
+  for (i = 0; i < n; ++i)
+    err[i] = 0;
+  for (q = 0; q < num_slices; ++q)
+    err[vol[q]] += slice_err[q];
+  for (i = 0; i < n; ++i)
+    {
+      err[i] /= mfs[i]->u->num_pixels;
+      mfs[i]->max_err = err[i];
+    }
+
+  free (vol);
+  free (kind);
+  free (slice_err);
+}
@@ -0,0 +1,401 @@
+/**
+ * segmentation_simd.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Row kernels of the fused and wavefront engines: gk, and the update
+ * of divp, ps, pt and u. The scalar kernels are the reference; the
+ * SSE4.2, AVX2 and AVX-512 kernels are selected at run time from the
+ * instruction sets supported by the processor, or forced with
+ * --segmentation-isa.
+ *
+ * All kernels give bitwise identical flows and u, except that the
+ * vector kernels compute sqrt (s * 0.5) in single precision where
+ * the scalar ones use double: the results only differ when s * 0.5 is
+ * subnormal, in which case g is below alpha and gk is 1 for any
+ * alpha above 1.1e-19. The error sum returned by the update kernels
+ * is accumulated in a different order.
+ *
+ * The generic (pow) data term has no vector version.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <stages/segmentation/segmentation_solver.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define ALNSB_SIMD_X86
+# include <immintrin.h>
+// GCC accepts the "avx512f" target and cpu feature since version 5.
+# if __GNUC__ >= 5 || defined(__clang__)
+#  define ALNSB_SIMD_AVX512
+# endif
+#endif
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+#define alnsb_power2(a) ((a)*(a))
+
+
+static
+void scalar_gk_row (int n, float alpha,
+		    const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp1,
+		    const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp2,
+		    const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp2n,
+		    const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp3,
+		    const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp3n,
+		    ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR gk)
+{
+  int k;
+
+  for (k = 0; k < n; k++)
+    {
+      ALNSB_IMAGE_TYPE_REAL g;
+      g = sqrt ((alnsb_power2(pp1[k]) + alnsb_power2(pp1[k+1]) + alnsb_power2(pp2[k]) + alnsb_power2(pp2n[k]) + alnsb_power2(pp3[k]) + alnsb_power2(pp3n[k])) * 0.5);
+      g = (g <= alpha) + (g > alpha) * (g / alpha);
+      gk[k] = 1 / g;
+    }
+}
+
+
+/**
+ * Instantiated once per kind of data term by scalar_update_row, so
+ * that the test on kind is resolved at compile time.
+ *
+ */
+static inline
+double scalar_update_row_kind (int kind, int n, float cc, float beta,
+			       float ulab0, float ulab1,
+			       const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR ur,
+			       const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR Cs_in,
+			       const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR Ct_in,
+			       const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp1,
+			       const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp2,
+			       const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp2n,
+			       const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp3,
+			       const ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp3n,
+			       ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR divp,
+			       ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR ps,
+			       ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pt,
+			       ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR u)
+{
+  double err = 0;
+  int k;
+
+  for (k = 0; k < n; k++)
+    {
+      ALNSB_IMAGE_TYPE_REAL dv, pts, Cs, Ct, erru;
+      dv = pp2n[k] - pp2[k] + pp1[k+1] - pp1[k] + pp3n[k] - pp3[k];
+      if (divp)
+	divp[k] = dv;
+      pts = dv - (u[k] / cc) + pt[k] + (1/cc);
+      Cs = ALNSB_MAXFLOW_DATA_TERM(kind, ur[k] - ulab0, beta, Cs_in[k]);
+      ps[k] = min (pts, Cs);
+      pts = ps[k] + (u[k] / cc) - dv;
+      Ct = ALNSB_MAXFLOW_DATA_TERM(kind, ur[k] - ulab1, beta, Ct_in[k]);
+      pt[k] = min (pts, Ct);
+      erru = cc * (dv + pt[k] - ps[k]);
+      u[k] = u[k] - erru;
+      err += fabs (erru);
+    }
+
+  return err;
+}
+
+
+static
+double scalar_update_row (int kind, int n, float cc, float beta,
+			  float ulab0, float ulab1,
+			  const ALNSB_IMAGE_TYPE_REAL* ur,
+			  const ALNSB_IMAGE_TYPE_REAL* Cs,
+			  const ALNSB_IMAGE_TYPE_REAL* Ct,
+			  const ALNSB_IMAGE_TYPE_REAL* pp1,
+			  const ALNSB_IMAGE_TYPE_REAL* pp2,
+			  const ALNSB_IMAGE_TYPE_REAL* pp2n,
+			  const ALNSB_IMAGE_TYPE_REAL* pp3,
+			  const ALNSB_IMAGE_TYPE_REAL* pp3n,
+			  ALNSB_IMAGE_TYPE_REAL* divp,
+			  ALNSB_IMAGE_TYPE_REAL* ps,
+			  ALNSB_IMAGE_TYPE_REAL* pt,
+			  ALNSB_IMAGE_TYPE_REAL* u)
+{
+  switch (kind)
+    {
+    case ALNSB_MAXFLOW_BETA_1:
+      return scalar_update_row_kind (ALNSB_MAXFLOW_BETA_1, n, cc, beta, ulab0,
+				     ulab1, ur, Cs, Ct, pp1, pp2, pp2n, pp3,
+				     pp3n, divp, ps, pt, u);
+    case ALNSB_MAXFLOW_BETA_2:
+      return scalar_update_row_kind (ALNSB_MAXFLOW_BETA_2, n, cc, beta, ulab0,
+				     ulab1, ur, Cs, Ct, pp1, pp2, pp2n, pp3,
+				     pp3n, divp, ps, pt, u);
+    case ALNSB_MAXFLOW_BETA_CACHED:
+      return scalar_update_row_kind (ALNSB_MAXFLOW_BETA_CACHED, n, cc, beta,
+				     ulab0, ulab1, ur, Cs, Ct, pp1, pp2, pp2n,
+				     pp3, pp3n, divp, ps, pt, u);
+    default:
+      return scalar_update_row_kind (ALNSB_MAXFLOW_BETA_GENERIC, n, cc, beta,
+				     ulab0, ulab1, ur, Cs, Ct, pp1, pp2, pp2n,
+				     pp3, pp3n, divp, ps, pt, u);
+    }
+}
+
+
+#ifdef ALNSB_SIMD_X86
+
+/**
+ * SSE4.2.
+ *
+ */
+static __attribute__((target("sse4.2")))
+double sse42_acc_sum (__m128d acc)
+{
+  double v[2];
+  _mm_storeu_pd (v, acc);
+  return v[0] + v[1];
+}
+
+# define SIMD_NAME(f)		sse42_##f
+# define SIMD_TARGET		__attribute__((target("sse4.2")))
+# define SIMD_WIDTH		4
+# define SIMD_VEC		__m128
+# define SIMD_ACC		__m128d
+# define SIMD_LOAD		_mm_loadu_ps
+# define SIMD_STORE		_mm_storeu_ps
+# define SIMD_SET1		_mm_set1_ps
+# define SIMD_ADD		_mm_add_ps
+# define SIMD_SUB		_mm_sub_ps
+# define SIMD_MUL		_mm_mul_ps
+# define SIMD_DIV		_mm_div_ps
+# define SIMD_SQRT		_mm_sqrt_ps
+# define SIMD_ABS(x)		_mm_andnot_ps (_mm_set1_ps (-0.0f), (x))
+# define SIMD_MIN		_mm_min_ps
+# define SIMD_SEL_LE(a,b,x,y)	_mm_blendv_ps ((y), (x), _mm_cmple_ps ((a), (b)))
+# define SIMD_ACC_ZERO		_mm_setzero_pd ()
+# define SIMD_ACC_ADD(acc,x)						\
+  acc = _mm_add_pd (_mm_add_pd (acc, _mm_cvtps_pd (x)),			\
+		    _mm_cvtps_pd (_mm_movehl_ps ((x), (x))))
+# define SIMD_ACC_SUM		sse42_acc_sum
+# include <stages/segmentation/segmentation_simd_kernels.h>
+# undef SIMD_NAME
+# undef SIMD_TARGET
+# undef SIMD_WIDTH
+# undef SIMD_VEC
+# undef SIMD_ACC
+# undef SIMD_LOAD
+# undef SIMD_STORE
+# undef SIMD_SET1
+# undef SIMD_ADD
+# undef SIMD_SUB
+# undef SIMD_MUL
+# undef SIMD_DIV
+# undef SIMD_SQRT
+# undef SIMD_ABS
+# undef SIMD_MIN
+# undef SIMD_SEL_LE
+# undef SIMD_ACC_ZERO
+# undef SIMD_ACC_ADD
+# undef SIMD_ACC_SUM
+
+
+/**
+ * AVX2. FMA is not used, as it would change the rounding.
+ *
+ */
+static __attribute__((target("avx2")))
+double avx2_acc_sum (__m256d acc)
+{
+  double v[4];
+  _mm256_storeu_pd (v, acc);
+  return (v[0] + v[1]) + (v[2] + v[3]);
+}
+
+# define SIMD_NAME(f)		avx2_##f
+# define SIMD_TARGET		__attribute__((target("avx2")))
+# define SIMD_WIDTH		8
+# define SIMD_VEC		__m256
+# define SIMD_ACC		__m256d
+# define SIMD_LOAD		_mm256_loadu_ps
+# define SIMD_STORE		_mm256_storeu_ps
+# define SIMD_SET1		_mm256_set1_ps
+# define SIMD_ADD		_mm256_add_ps
+# define SIMD_SUB		_mm256_sub_ps
+# define SIMD_MUL		_mm256_mul_ps
+# define SIMD_DIV		_mm256_div_ps
+# define SIMD_SQRT		_mm256_sqrt_ps
+# define SIMD_ABS(x)		_mm256_andnot_ps (_mm256_set1_ps (-0.0f), (x))
+# define SIMD_MIN		_mm256_min_ps
+# define SIMD_SEL_LE(a,b,x,y)						\
+  _mm256_blendv_ps ((y), (x), _mm256_cmp_ps ((a), (b), _CMP_LE_OQ))
+# define SIMD_ACC_ZERO		_mm256_setzero_pd ()
+# define SIMD_ACC_ADD(acc,x)						\
+  acc = _mm256_add_pd (_mm256_add_pd (acc, _mm256_cvtps_pd (_mm256_castps256_ps128 (x))), \
+		       _mm256_cvtps_pd (_mm256_extractf128_ps ((x), 1)))
+# define SIMD_ACC_SUM		avx2_acc_sum
+# include <stages/segmentation/segmentation_simd_kernels.h>
+# undef SIMD_NAME
+# undef SIMD_TARGET
+# undef SIMD_WIDTH
+# undef SIMD_VEC
+# undef SIMD_ACC
+# undef SIMD_LOAD
+# undef SIMD_STORE
+# undef SIMD_SET1
+# undef SIMD_ADD
+# undef SIMD_SUB
+# undef SIMD_MUL
+# undef SIMD_DIV
+# undef SIMD_SQRT
+# undef SIMD_ABS
+# undef SIMD_MIN
+# undef SIMD_SEL_LE
+# undef SIMD_ACC_ZERO
+# undef SIMD_ACC_ADD
+# undef SIMD_ACC_SUM
+
+
+#ifdef ALNSB_SIMD_AVX512
+/**
+ * AVX-512 (foundation instructions only).
+ *
+ */
+static __attribute__((target("avx512f")))
+double avx512_acc_sum (__m512d acc)
+{
+  double v[8];
+  _mm512_storeu_pd (v, acc);
+  return ((v[0] + v[1]) + (v[2] + v[3])) + ((v[4] + v[5]) + (v[6] + v[7]));
+}
+
+# define SIMD_NAME(f)		avx512_##f
+# define SIMD_TARGET		__attribute__((target("avx512f")))
+# define SIMD_WIDTH		16
+# define SIMD_VEC		__m512
+# define SIMD_ACC		__m512d
+# define SIMD_LOAD		_mm512_loadu_ps
+# define SIMD_STORE		_mm512_storeu_ps
+# define SIMD_SET1		_mm512_set1_ps
+# define SIMD_ADD		_mm512_add_ps
+# define SIMD_SUB		_mm512_sub_ps
+# define SIMD_MUL		_mm512_mul_ps
+# define SIMD_DIV		_mm512_div_ps
+# define SIMD_SQRT		_mm512_sqrt_ps
+# define SIMD_ABS(x)							\
+  _mm512_castsi512_ps (_mm512_and_epi32 (_mm512_castps_si512 (x),	\
+					 _mm512_set1_epi32 (0x7fffffff)))
+# define SIMD_MIN		_mm512_min_ps
+# define SIMD_SEL_LE(a,b,x,y)						\
+  _mm512_mask_blend_ps (_mm512_cmp_ps_mask ((a), (b), _CMP_LE_OQ), (y), (x))
+# define SIMD_ACC_ZERO		_mm512_setzero_pd ()
+# define SIMD_ACC_ADD(acc,x)						\
+  acc = _mm512_add_pd (_mm512_add_pd (acc, _mm512_cvtps_pd (_mm512_castps512_ps256 (x))), \
+		       _mm512_cvtps_pd (_mm256_castpd_ps (_mm512_extractf64x4_pd (_mm512_castps_pd (x), 1))))
+# define SIMD_ACC_SUM		avx512_acc_sum
+# include <stages/segmentation/segmentation_simd_kernels.h>
+# undef SIMD_NAME
+# undef SIMD_TARGET
+# undef SIMD_WIDTH
+# undef SIMD_VEC
+# undef SIMD_ACC
+# undef SIMD_LOAD
+# undef SIMD_STORE
+# undef SIMD_SET1
+# undef SIMD_ADD
+# undef SIMD_SUB
+# undef SIMD_MUL
+# undef SIMD_DIV
+# undef SIMD_SQRT
+# undef SIMD_ABS
+# undef SIMD_MIN
+# undef SIMD_SEL_LE
+# undef SIMD_ACC_ZERO
+# undef SIMD_ACC_ADD
+# undef SIMD_ACC_SUM
+#endif // ALNSB_SIMD_AVX512
+
+#endif // ALNSB_SIMD_X86
+
+
+/**
+ * Available kernels, from the preferred one to the scalar reference.
+ *
+ */
+static const s_alnsb_maxflow_kernels_t kernels_table[] = {
+#ifdef ALNSB_SIMD_AVX512
+  { "avx512", avx512_gk_row, avx512_update_row },
+#endif
+#ifdef ALNSB_SIMD_X86
+  { "avx2", avx2_gk_row, avx2_update_row },
+  { "sse4.2", sse42_gk_row, sse42_update_row },
+#endif
+  { "scalar", scalar_gk_row, scalar_update_row },
+};
+
+
+static
+int kernels_supported (const s_alnsb_maxflow_kernels_t* k)
+{
+#ifdef ALNSB_SIMD_X86
+  __builtin_cpu_init ();
+# ifdef ALNSB_SIMD_AVX512
+  if (k->gk_row == avx512_gk_row)
+    return __builtin_cpu_supports ("avx512f");
+# endif
+  if (k->gk_row == avx2_gk_row)
+    return __builtin_cpu_supports ("avx2");
+  if (k->gk_row == sse42_gk_row)
+    return __builtin_cpu_supports ("sse4.2");
+#endif
+  return 1;
+}
+
+
+/**
+ * Kernels for the instruction set isa ("scalar", "sse4.2", "avx2",
+ * "avx512"), or the best one supported by the processor if isa is
+ * NULL or "auto".
+ *
+ */
+const s_alnsb_maxflow_kernels_t* alnsb_maxflow_kernels (char* isa)
+{
+  int num = sizeof(kernels_table) / sizeof(kernels_table[0]);
+  int i;
+
+  for (i = 0; i < num; ++i)
+    {
+      const s_alnsb_maxflow_kernels_t* k = &kernels_table[i];
+      if (isa == NULL || ! strcmp (isa, "auto"))
+	{
+	  if (kernels_supported (k))
+	    return k;
+	}
+      else if (! strcmp (isa, k->name))
+	{
+	  if (kernels_supported (k))
+	    return k;
+	  fprintf (stderr, "[ERROR][segmentation] Instruction set '%s' is not supported by this processor\n",
+		   isa);
+	  exit (1);
+	}
+    }
+  fprintf (stderr, "[ERROR][segmentation] Unknown instruction set '%s'\n", isa);
+  exit (1);
+}
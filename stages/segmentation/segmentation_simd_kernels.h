@@ -0,0 +1,155 @@
+/**
+ * segmentation_simd_kernels.h: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Vector row kernels, included by segmentation_simd.c once per
+ * instruction set after defining:
+ *
+ * SIMD_NAME(f)		 name of the kernel f for this instruction set
+ * SIMD_TARGET		 target attribute of the kernels
+ * SIMD_WIDTH		 number of floats per vector
+ * SIMD_VEC, SIMD_ACC	 vector of floats, accumulator of doubles
+ * SIMD_LOAD/STORE	 unaligned load/store
+ * SIMD_SET1		 broadcast
+ * SIMD_ADD/SUB/MUL/DIV	 arithmetic
+ * SIMD_SQRT, SIMD_ABS	 square root, absolute value
+ * SIMD_MIN(a,b)	 a < b ? a : b, lane-wise
+ * SIMD_SEL_LE(a,b,x,y)	 a <= b ? x : y, lane-wise
+ * SIMD_ACC_ZERO	 zero accumulator
+ * SIMD_ACC_ADD(acc,x)	 add the floats of x to acc, in double
+ * SIMD_ACC_SUM(acc)	 sum of the lanes of acc
+ *
+ * Operations are done in the order of the scalar kernels, with IEEE
+ * division and square root, so the results are bitwise identical to
+ * them (see segmentation_simd.c for the one exception).
+ *
+ */
+
+
+static SIMD_TARGET
+void SIMD_NAME(gk_row) (int n, float alpha,
+			const ALNSB_IMAGE_TYPE_REAL* pp1,
+			const ALNSB_IMAGE_TYPE_REAL* pp2,
+			const ALNSB_IMAGE_TYPE_REAL* pp2n,
+			const ALNSB_IMAGE_TYPE_REAL* pp3,
+			const ALNSB_IMAGE_TYPE_REAL* pp3n,
+			ALNSB_IMAGE_TYPE_REAL* gk)
+{
+  SIMD_VEC va = SIMD_SET1 (alpha);
+  SIMD_VEC half = SIMD_SET1 (0.5f);
+  SIMD_VEC one = SIMD_SET1 (1.0f);
+  int k;
+
+  for (k = 0; k + SIMD_WIDTH <= n; k += SIMD_WIDTH)
+    {
+      SIMD_VEC a = SIMD_LOAD (pp1 + k);
+      SIMD_VEC b = SIMD_LOAD (pp1 + k + 1);
+      SIMD_VEC c = SIMD_LOAD (pp2 + k);
+      SIMD_VEC d = SIMD_LOAD (pp2n + k);
+      SIMD_VEC e = SIMD_LOAD (pp3 + k);
+      SIMD_VEC f = SIMD_LOAD (pp3n + k);
+      SIMD_VEC s = SIMD_ADD (SIMD_MUL (a, a), SIMD_MUL (b, b));
+      s = SIMD_ADD (s, SIMD_MUL (c, c));
+      s = SIMD_ADD (s, SIMD_MUL (d, d));
+      s = SIMD_ADD (s, SIMD_MUL (e, e));
+      s = SIMD_ADD (s, SIMD_MUL (f, f));
+      SIMD_VEC g = SIMD_SQRT (SIMD_MUL (s, half));
+      g = SIMD_SEL_LE (g, va, one, SIMD_DIV (g, va));
+      SIMD_STORE (gk + k, SIMD_DIV (one, g));
+    }
+  scalar_gk_row (n - k, alpha, pp1 + k, pp2 + k, pp2n + k, pp3 + k, pp3n + k,
+		 gk + k);
+}
+
+
+static SIMD_TARGET
+double SIMD_NAME(update_row) (int kind, int n, float cc, float beta,
+			      float ulab0, float ulab1,
+			      const ALNSB_IMAGE_TYPE_REAL* ur,
+			      const ALNSB_IMAGE_TYPE_REAL* Cs_in,
+			      const ALNSB_IMAGE_TYPE_REAL* Ct_in,
+			      const ALNSB_IMAGE_TYPE_REAL* pp1,
+			      const ALNSB_IMAGE_TYPE_REAL* pp2,
+			      const ALNSB_IMAGE_TYPE_REAL* pp2n,
+			      const ALNSB_IMAGE_TYPE_REAL* pp3,
+			      const ALNSB_IMAGE_TYPE_REAL* pp3n,
+			      ALNSB_IMAGE_TYPE_REAL* divp,
+			      ALNSB_IMAGE_TYPE_REAL* ps,
+			      ALNSB_IMAGE_TYPE_REAL* pt,
+			      ALNSB_IMAGE_TYPE_REAL* u)
+{
+  // pow has no vector version.
+  if (kind == ALNSB_MAXFLOW_BETA_GENERIC)
+    return scalar_update_row (kind, n, cc, beta, ulab0, ulab1, ur, Cs_in,
+			      Ct_in, pp1, pp2, pp2n, pp3, pp3n, divp, ps, pt,
+			      u);
+
+  SIMD_VEC vcc = SIMD_SET1 (cc);
+  SIMD_VEC vicc = SIMD_SET1 (1/cc);
+  SIMD_VEC vl0 = SIMD_SET1 (ulab0);
+  SIMD_VEC vl1 = SIMD_SET1 (ulab1);
+  SIMD_ACC acc = SIMD_ACC_ZERO;
+  int k;
+
+  for (k = 0; k + SIMD_WIDTH <= n; k += SIMD_WIDTH)
+    {
+      SIMD_VEC dv = SIMD_SUB (SIMD_LOAD (pp2n + k), SIMD_LOAD (pp2 + k));
+      dv = SIMD_ADD (dv, SIMD_LOAD (pp1 + k + 1));
+      dv = SIMD_SUB (dv, SIMD_LOAD (pp1 + k));
+      dv = SIMD_ADD (dv, SIMD_LOAD (pp3n + k));
+      dv = SIMD_SUB (dv, SIMD_LOAD (pp3 + k));
+      if (divp)
+	SIMD_STORE (divp + k, dv);
+      SIMD_VEC vu = SIMD_LOAD (u + k);
+      SIMD_VEC ucc = SIMD_DIV (vu, vcc);
+      SIMD_VEC Cs, Ct;
+      if (kind == ALNSB_MAXFLOW_BETA_CACHED)
+	{
+	  Cs = SIMD_LOAD (Cs_in + k);
+	  Ct = SIMD_LOAD (Ct_in + k);
+	}
+      else
+	{
+	  SIMD_VEC vur = SIMD_LOAD (ur + k);
+	  Cs = SIMD_ABS (SIMD_SUB (vur, vl0));
+	  Ct = SIMD_ABS (SIMD_SUB (vur, vl1));
+	  if (kind == ALNSB_MAXFLOW_BETA_2)
+	    {
+	      Cs = SIMD_MUL (Cs, Cs);
+	      Ct = SIMD_MUL (Ct, Ct);
+	    }
+	}
+      SIMD_VEC p = SIMD_ADD (SIMD_ADD (SIMD_SUB (dv, ucc),
+				       SIMD_LOAD (pt + k)), vicc);
+      SIMD_VEC vps = SIMD_MIN (p, Cs);
+      p = SIMD_SUB (SIMD_ADD (vps, ucc), dv);
+      SIMD_VEC vpt = SIMD_MIN (p, Ct);
+      SIMD_VEC erru = SIMD_MUL (vcc, SIMD_SUB (SIMD_ADD (dv, vpt), vps));
+      SIMD_STORE (ps + k, vps);
+      SIMD_STORE (pt + k, vpt);
+      SIMD_STORE (u + k, SIMD_SUB (vu, erru));
+      SIMD_VEC aerr = SIMD_ABS (erru);
+      SIMD_ACC_ADD (acc, aerr);
+    }
+
+  return SIMD_ACC_SUM (acc) +
+    scalar_update_row (kind, n - k, cc, beta, ulab0, ulab1, ur + k,
+		       Cs_in ? Cs_in + k : NULL, Ct_in ? Ct_in + k : NULL,
+		       pp1 + k, pp2 + k, pp2n + k, pp3 + k, pp3n + k,
+		       divp ? divp + k : NULL, ps + k, pt + k, u + k);
+}
@@ -0,0 +1,746 @@
+/**
+ * segmentation_slab.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Slab-decomposed solver: the volume is split into slabs of
+ * consecutive slices, each owned by a worker process which runs the
+ * outer loop of the solver on its slab, with the inner step of the
+ * reference engine. Each inner step exchanges one-slice halos of pts,
+ * pp3 and gk with the adjacent workers, and sums the error over all
+ * workers; each class means update sums the per-slice means.
+ *
+ * Workers are either forked processes on one machine communicating
+ * through shared memory (--segmentation_workers), or the MPI ranks
+ * when built with ALNSB_USE_MPI. Forked workers do not use OpenMP,
+ * whose runtime is not usable after a fork: use one worker per core.
+ *
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef ALNSB_USE_MPI
+# include <mpi.h>
+#endif
+
+#include <stages/segmentation/segmentation_solver.h>
+#include <utilities/memfuncs.h>
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+#define alnsb_power2(a) ((a)*(a))
+
+// A worker waiting at a barrier checks the other workers every
+// ALNSB_SLAB_CHECK_PERIOD spins, and gives up after
+// ALNSB_SLAB_BARRIER_TIMEOUT seconds.
+#define ALNSB_SLAB_CHECK_PERIOD 1024
+#define ALNSB_SLAB_BARRIER_TIMEOUT 600
+
+
+/**
+ * Shared memory transport between forked workers: a barrier, one
+ * mailbox slice per worker, one reduction buffer per worker, and a
+ * staging volume to gather the result in the first worker. abort is
+ * set by the first worker (parent) when a worker failed.
+ *
+ */
+struct slab_shm
+{
+  int			count;
+  int			sense;
+  int			abort;
+  pid_t			parent;
+  size_t		mbox_len;
+  size_t		sums_len;
+  float*		mbox;
+  double*		sums;
+  float*		stage;
+  size_t		bytes;
+};
+
+struct slab_comm
+{
+  int			rank;
+  int			size;
+  // NULL with MPI.
+  struct slab_shm*	shm;
+  int			sense;
+  // Process ids of the workers, used by the first worker only.
+  pid_t*		pids;
+};
+typedef struct slab_comm s_slab_comm_t;
+
+
+/**
+ * Slab owned by a worker: global slices [s0, s1), stored at local
+ * slices 1..n of volumes of n + 2 slices. Local slices 0 and n + 1
+ * hold the halos received from the adjacent workers. expired is set,
+ * in all workers, when the inner steps stopped at the deadline.
+ *
+ */
+struct slab
+{
+  int			expired;
+  int			s0;
+  int			s1;
+  int			n;
+  image3DReal*		ur;
+  image3DReal*		u;
+  image3DReal*		ps;
+  image3DReal*		pt;
+  image3DReal*		pp1;
+  image3DReal*		pp2;
+  image3DReal*		pp3;
+  image3DReal*		divp;
+  image3DReal*		gk;
+  image3DReal*		pts;
+};
+typedef struct slab s_slab_t;
+
+
+static
+void slab_range (int slices, int size, int rank, int* s0, int* s1)
+{
+  *s0 = (int) ((long) rank * slices / size);
+  *s1 = (int) ((long) (rank + 1) * slices / size);
+}
+
+
+#ifndef ALNSB_USE_MPI
+/**
+ * Called while waiting at a barrier since start. A worker which is
+ * still waiting after the timeout, or whose parent is gone or has
+ * aborted, exits. The parent aborts if it times out, or if a worker
+ * exited before the barrier was released, since the others would
+ * wait for it forever. Exited workers are not reaped here, so that
+ * alnsb_maxflow_slab_solve still gets their status.
+ *
+ */
+static
+void slab_check_peers (s_slab_comm_t* comm, double start)
+{
+  struct slab_shm* shm = comm->shm;
+  int timeout = alnsb_timer_wtime () - start > ALNSB_SLAB_BARRIER_TIMEOUT;
+  int r, failed = 0;
+
+  if (comm->rank)
+    {
+      if (timeout)
+	fprintf (stderr, "[ERROR][segmentation] Solver worker %d timed out at a barrier\n",
+		 comm->rank);
+      if (timeout || getppid () != shm->parent ||
+	  __atomic_load_n (&shm->abort, __ATOMIC_ACQUIRE))
+	_exit (1);
+      return;
+    }
+
+  for (r = 1; r < comm->size; ++r)
+    {
+      siginfo_t info;
+      info.si_pid = 0;
+      if (waitid (P_PID, comm->pids[r], &info,
+		  WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid)
+	failed = 1;
+    }
+  // The workers exit normally once they passed the last barrier.
+  if ((! failed && ! timeout) ||
+      __atomic_load_n (&shm->sense, __ATOMIC_ACQUIRE) == comm->sense)
+    return;
+  __atomic_store_n (&shm->abort, 1, __ATOMIC_RELEASE);
+  for (r = 1; r < comm->size; ++r)
+    {
+      kill (comm->pids[r], SIGKILL);
+      waitpid (comm->pids[r], NULL, 0);
+    }
+  fprintf (stderr, "[ERROR][segmentation] A solver worker failed%s\n",
+	   timeout ? " (timeout at a barrier)" : "");
+  exit (1);
+}
+#endif
+
+
+/**
+ * Sense-reversing spin barrier, as process-shared pthread barriers
+ * are not available everywhere. The wait is bounded, and the workers
+ * fail together if one of them dies.
+ *
+ */
+static
+void slab_barrier (s_slab_comm_t* comm)
+{
+#ifdef ALNSB_USE_MPI
+  MPI_Barrier (MPI_COMM_WORLD);
+#else
+  struct slab_shm* shm = comm->shm;
+  comm->sense = ! comm->sense;
+  if (__atomic_add_fetch (&shm->count, 1, __ATOMIC_ACQ_REL) == comm->size)
+    {
+      __atomic_store_n (&shm->count, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&shm->sense, comm->sense, __ATOMIC_RELEASE);
+    }
+  else
+    {
+      double start = alnsb_timer_wtime ();
+      long spins = 0;
+      while (__atomic_load_n (&shm->sense, __ATOMIC_ACQUIRE) != comm->sense)
+	{
+	  sched_yield ();
+	  if (++spins % ALNSB_SLAB_CHECK_PERIOD == 0)
+	    slab_check_peers (comm, start);
+	}
+    }
+#endif
+}
+
+
+/**
+ * Send n values to the next worker (up = 1) or to the previous one
+ * (up = 0), and receive n values from the other side into recv. recv
+ * is left untouched on the first (up) or last (down) worker.
+ *
+ */
+static
+void slab_shift (s_slab_comm_t* comm, int up, float* send, float* recv,
+		 size_t n)
+{
+  int to = up ? comm->rank + 1 : comm->rank - 1;
+  int from = up ? comm->rank - 1 : comm->rank + 1;
+#ifdef ALNSB_USE_MPI
+  MPI_Sendrecv (send, n, MPI_FLOAT,
+		to >= 0 && to < comm->size ? to : MPI_PROC_NULL, up,
+		recv, n, MPI_FLOAT,
+		from >= 0 && from < comm->size ? from : MPI_PROC_NULL, up,
+		MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+#else
+  struct slab_shm* shm = comm->shm;
+  if (to >= 0 && to < comm->size)
+    memcpy (shm->mbox + comm->rank * shm->mbox_len, send, n * sizeof(float));
+  slab_barrier (comm);
+  if (from >= 0 && from < comm->size)
+    memcpy (recv, shm->mbox + from * shm->mbox_len, n * sizeof(float));
+  slab_barrier (comm);
+#endif
+}
+
+
+/**
+ * Sum the n values of v over all workers, in place. The sum is done
+ * in worker order, so that all workers get the same result.
+ *
+ */
+static
+void slab_sum (s_slab_comm_t* comm, double* v, size_t n)
+{
+  size_t i;
+  int r;
+#ifdef ALNSB_USE_MPI
+  // MPI_Allreduce does not specify the order of the sum.
+  double* sums = alnsb_calloc (sizeof(double), comm->size * n);
+  MPI_Allgather (v, n, MPI_DOUBLE, sums, n, MPI_DOUBLE, MPI_COMM_WORLD);
+  for (i = 0; i < n; ++i)
+    {
+      v[i] = 0;
+      for (r = 0; r < comm->size; ++r)
+	v[i] += sums[r * n + i];
+    }
+  free (sums);
+#else
+  struct slab_shm* shm = comm->shm;
+  memcpy (shm->sums + comm->rank * shm->sums_len, v, n * sizeof(double));
+  slab_barrier (comm);
+  for (i = 0; i < n; ++i)
+    {
+      v[i] = 0;
+      for (r = 0; r < comm->size; ++r)
+	v[i] += shm->sums[r * shm->sums_len + i];
+    }
+  slab_barrier (comm);
+#endif
+}
+
+
+/**
+ * Gather the local slices 1..n of img into the volume full, of
+ * slices x plane values. full is only written in the first worker
+ * (in all of them with MPI).
+ *
+ */
+static
+void slab_gather (s_slab_comm_t* comm, s_slab_t* sl, image3DReal* img,
+		  int slices, float* full)
+{
+  size_t plane = img->rows * img->cols;
+  float* local = img->data + plane;
+#ifdef ALNSB_USE_MPI
+  int* counts = alnsb_calloc (sizeof(int), comm->size);
+  int* displs = alnsb_calloc (sizeof(int), comm->size);
+  int r;
+  for (r = 0; r < comm->size; ++r)
+    {
+      int s0, s1;
+      slab_range (slices, comm->size, r, &s0, &s1);
+      counts[r] = (s1 - s0) * plane;
+      displs[r] = s0 * plane;
+    }
+  MPI_Allgatherv (local, sl->n * plane, MPI_FLOAT, full, counts, displs,
+		  MPI_FLOAT, MPI_COMM_WORLD);
+  free (counts);
+  free (displs);
+#else
+  struct slab_shm* shm = comm->shm;
+  memcpy (shm->stage + sl->s0 * plane, local, sl->n * plane * sizeof(float));
+  slab_barrier (comm);
+  if (comm->rank == 0)
+    memcpy (full, shm->stage, slices * plane * sizeof(float));
+  slab_barrier (comm);
+#endif
+}
+
+
+static
+void slab_load_volume (image3DReal* img, image3DReal* src, int s0, int n)
+{
+  size_t plane = img->rows * img->cols;
+  memcpy (img->data + plane, src->data + s0 * plane,
+	  n * plane * sizeof(ALNSB_IMAGE_TYPE_REAL));
+}
+
+
+/**
+ * Allocate the slab of the worker and load it from mf. The divergence
+ * is recomputed from the flows.
+ *
+ */
+static
+void slab_load (s_slab_comm_t* comm, s_alnsb_maxflow_t* mf, s_slab_t* sl)
+{
+  int slices = mf->slices;
+  int rows = mf->rows;
+  int cols = mf->cols;
+  int i, j, k;
+
+  slab_range (slices, comm->size, comm->rank, &sl->s0, &sl->s1);
+  int n = sl->n = sl->s1 - sl->s0;
+  sl->expired = 0;
+  sl->ur = image3DReal_alloc (n+2, rows, cols);
+  sl->u = image3DReal_alloc (n+2, rows, cols);
+  sl->ps = image3DReal_alloc (n+2, rows, cols);
+  sl->pt = image3DReal_alloc (n+2, rows, cols);
+  sl->pp1 = image3DReal_alloc (n+2, rows, cols+1);
+  sl->pp2 = image3DReal_alloc (n+2, rows+1, cols);
+  sl->pp3 = image3DReal_alloc (n+2, rows, cols);
+  sl->divp = image3DReal_alloc (n+2, rows, cols);
+  sl->gk = image3DReal_alloc (n+2, rows, cols);
+  sl->pts = image3DReal_alloc (n+2, rows, cols);
+
+  slab_load_volume (sl->ur, mf->ur, sl->s0, n);
+  slab_load_volume (sl->u, mf->u, sl->s0, n);
+  slab_load_volume (sl->ps, mf->ps, sl->s0, n);
+  slab_load_volume (sl->pt, mf->pt, sl->s0, n);
+  slab_load_volume (sl->pp1, mf->pp1, sl->s0, n);
+  slab_load_volume (sl->pp2, mf->pp2, sl->s0, n);
+  // pp3 has one more slice: the upper halo is pp3[s1].
+  slab_load_volume (sl->pp3, mf->pp3, sl->s0, n+1);
+
+  ALNSB_IMRealTo3D(sl->pp1, pp1);
+  ALNSB_IMRealTo3D(sl->pp2, pp2);
+  ALNSB_IMRealTo3D(sl->pp3, pp3);
+  ALNSB_IMRealTo3D(sl->divp, divp);
+  for (i = 1; i <= n && sl->s0 + i - 1 < slices-1; i++)
+    for (j = 0; j < rows-1; j++)
+      for (k = 0; k < cols-1; k++)
+	divp[i][j][k] = pp2[i][j+1][k] - pp2[i][j][k] + pp1[i][j][k+1] - pp1[i][j][k] + pp3[i+1][j][k] - pp3[i][j][k];
+}
+
+
+static
+void slab_free (s_slab_t* sl)
+{
+  image3DReal* vols[] = { sl->ur, sl->u, sl->ps, sl->pt, sl->pp1, sl->pp2,
+			  sl->pp3, sl->divp, sl->gk, sl->pts };
+  size_t i;
+  for (i = 0; i < sizeof(vols) / sizeof(vols[0]); ++i)
+    image3D_free (vols[i]->image3D);
+}
+
+
+/**
+ * Inner steps of the reference engine on the slab. Same contract as
+ * alnsb_maxflow_reference_solve.
+ *
+ */
+static
+int slab_inner_solve (s_slab_comm_t* comm, s_alnsb_maxflow_t* mf,
+		      s_slab_t* sl, float errb, int max_steps)
+{
+  int slices = mf->slices;
+  int rows = mf->rows;
+  int cols = mf->cols;
+  float alpha = mf->alpha;
+  float cc = mf->cc;
+  float steps = mf->steps;
+  float beta = mf->beta;
+  float ulab0 = mf->ulab[0];
+  float ulab1 = mf->ulab[1];
+  int kind = mf->beta == 1 ? ALNSB_MAXFLOW_BETA_1 :
+    mf->beta == 2 ? ALNSB_MAXFLOW_BETA_2 : ALNSB_MAXFLOW_BETA_GENERIC;
+  double num_pixels = (double) slices * rows * cols;
+  int n = sl->n;
+  // Last local slice updated by the steps which skip the last global
+  // slice.
+  int n_int = min(n, slices - 1 - sl->s0);
+  size_t plane = rows * cols;
+  int t, i, j, k;
+
+  ALNSB_IMRealTo3D(sl->ur, ur);
+  ALNSB_IMRealTo3D(sl->pp1, pp1);
+  ALNSB_IMRealTo3D(sl->pp2, pp2);
+  ALNSB_IMRealTo3D(sl->pp3, pp3);
+  ALNSB_IMRealTo3D(sl->u, u);
+  ALNSB_IMRealTo3D(sl->divp, divp);
+  ALNSB_IMRealTo3D(sl->ps, ps);
+  ALNSB_IMRealTo3D(sl->pt, pt);
+  ALNSB_IMRealTo3D(sl->gk, gk);
+  ALNSB_IMRealTo3D(sl->pts, pts);
+
+  // pp3[i] is only updated for global slices i >= 1.
+  int i_pp3 = sl->s0 == 0 ? 2 : 1;
+
+  for (t = 0; t < max_steps; t++)
+    {
+      for (i = 1; i <= n; i++)
+	for (j = 0; j < rows; j++)
+	  for (k = 0; k < cols; k++)
+	    pts[i][j][k] = divp[i][j][k] - (ps[i][j][k] - pt[i][j][k] + (u[i][j][k] / cc));
+      slab_shift (comm, 1, pts[n][0], pts[0][0], plane);
+
+      for (i = 1; i <= n; i++)
+	{
+	  for (j = 0; j < rows; j++)
+	    for (k = 1; k < cols; k++)
+	      pp1[i][j][k] = pp1[i][j][k] + (steps * (pts[i][j][k] - pts[i][j][k-1]));
+	  for (j = 1; j < rows; j++)
+	    for (k = 0; k < cols; k++)
+	      pp2[i][j][k] = pp2[i][j][k] + (steps * (pts[i][j][k] - pts[i][j-1][k]));
+	  if (i >= i_pp3)
+	    for (j = 0; j < rows; j++)
+	      for (k = 0; k < cols; k++)
+		pp3[i][j][k] = pp3[i][j][k] + (steps * (pts[i][j][k] - pts[i-1][j][k]));
+	}
+      slab_shift (comm, 0, pp3[1][0], pp3[n+1][0], plane);
+
+      for (i = 1; i <= n_int; i++)
+	for (j = 0; j < rows-1; j++)
+	  for (k = 0; k < cols-1; k++)
+	    {
+	      ALNSB_IMAGE_TYPE_REAL g;
+	      g = sqrt ((alnsb_power2(pp1[i][j][k]) + alnsb_power2(pp1[i][j][k+1]) + alnsb_power2(pp2[i][j][k]) + alnsb_power2(pp2[i][j+1][k]) + alnsb_power2(pp3[i][j][k]) + alnsb_power2(pp3[i+1][j][k])) * 0.5);
+	      g = (g <= alpha) + (g > alpha) * (g / alpha);
+	      gk[i][j][k] = 1 / g;
+	    }
+      slab_shift (comm, 1, gk[n][0], gk[0][0], plane);
+
+      for (i = 1; i <= n; i++)
+	{
+	  for (j = 0; j < rows; j++)
+	    for (k = 1; k < cols; k++)
+	      pp1[i][j][k] = (0.5 * (gk[i][j][k] + gk[i][j][k-1])) * pp1[i][j][k];
+	  for (j = 1; j < rows; j++)
+	    for (k = 0; k < cols; k++)
+	      pp2[i][j][k] = (0.5 * (gk[i][j][k] + gk[i][j-1][k])) * pp2[i][j][k];
+	  if (i >= i_pp3)
+	    for (j = 0; j < rows; j++)
+	      for (k = 0; k < cols; k++)
+		pp3[i][j][k] = (0.5 * (gk[i][j][k] + gk[i-1][j][k])) * pp3[i][j][k];
+	}
+      slab_shift (comm, 0, pp3[1][0], pp3[n+1][0], plane);
+
+      double err = 0;
+      for (i = 1; i <= n_int; i++)
+	for (j = 0; j < rows-1; j++)
+	  for (k = 0; k < cols-1; k++)
+	    {
+	      ALNSB_IMAGE_TYPE_REAL p, Cs, Ct, erru;
+	      divp[i][j][k] = pp2[i][j+1][k] - pp2[i][j][k] + pp1[i][j][k+1] - pp1[i][j][k] + pp3[i+1][j][k] - pp3[i][j][k];
+	      p = divp[i][j][k] - (u[i][j][k] / cc) + pt[i][j][k] + (1/cc);
+	      Cs = ALNSB_MAXFLOW_DATA_TERM(kind, ur[i][j][k] - ulab0, beta, 0);
+	      ps[i][j][k] = min (p, Cs);
+	      p = ps[i][j][k] + (u[i][j][k] / cc) - divp[i][j][k];
+	      Ct = ALNSB_MAXFLOW_DATA_TERM(kind, ur[i][j][k] - ulab1, beta, 0);
+	      pt[i][j][k] = min (p, Ct);
+	      erru = cc * (divp[i][j][k] + pt[i][j][k] - ps[i][j][k]);
+	      u[i][j][k] = u[i][j][k] - erru;
+	      err += fabs (erru);
+	    }
+      // The first worker reads the clock for all.
+      double sums[2] = { err, comm->rank == 0 &&
+			 alnsb_budget_expired (&mf->budget) };
+      slab_sum (comm, sums, 2);
+      err = sums[0];
+      mf->max_err = err / num_pixels;
+      sl->expired = sums[1] > 0;
+      if ((err / num_pixels) < errb || sl->expired)
+	break;
+    }
+
+  return t < max_steps ? t + 1 : max_steps;
+}
+
+
+/**
+ * Class means update of alnsb_maxflow_update_labels: the per-slice
+ * means are summed over all workers, then accumulated in slice order
+ * as in the single process solver.
+ *
+ */
+static
+float slab_update_labels (s_slab_comm_t* comm, s_alnsb_maxflow_t* mf,
+			  s_slab_t* sl)
+{
+  int slices = mf->slices;
+  int rows = mf->rows;
+  int cols = mf->cols;
+  float* ulab = mf->ulab;
+  float ulab_p[2];
+  int i, j, k;
+
+  ALNSB_IMRealTo3D(sl->ur, ur);
+  ALNSB_IMRealTo3D(sl->u, u);
+
+  double* means = alnsb_calloc (sizeof(double), 2 * slices);
+  for (i = 1; i <= sl->n; i++)
+    {
+      float f = 0.0, g = 0.0, m = 0.0, n = 0.0;
+      for (j = 0; j < rows; j++)
+	for (k = 0; k < cols; k++)
+	  {
+	    ALNSB_IMAGE_TYPE_REAL ut = u[i][j][k] > 0.5;
+	    f += ur[i][j][k] * (1 - ut);
+	    m += ur[i][j][k] * ut;
+	    g += 1 - ut;
+	    n += ut;
+	  }
+      if (g > 0)
+	means[2 * (sl->s0 + i - 1)] = f/g;
+      if (n > 0)
+	means[2 * (sl->s0 + i - 1) + 1] = m/n;
+    }
+  slab_sum (comm, means, 2 * slices);
+
+  ulab_p[0] = ulab[0];
+  ulab_p[1] = ulab[1];
+  ulab[0] = ulab[1] = 0.0;
+  for (i = 0; i < slices; i++)
+    {
+      ulab[0] += (float) means[2 * i];
+      ulab[1] += (float) means[2 * i + 1];
+    }
+  ulab[0] = ulab[0] / slices;
+  ulab[1] = ulab[1] / slices;
+  free (means);
+
+  return fabs (ulab_p[0] - ulab[0]) + fabs (ulab_p[1] - ulab[1]);
+}
+
+
+/**
+ * Run the outer loop of the solver on the slab of the worker, then
+ * gather the solver state in mf in the first worker.
+ *
+ */
+static
+void slab_worker (s_alnsb_environment_t* env, s_slab_comm_t* comm,
+		  s_alnsb_maxflow_t* mf, s_alnsb_maxflow_progress_t* progress)
+{
+  float errb1 = env->segmentation_errb[1];
+  float c_convergence = env->segmentation_c_convergence;
+  s_slab_t sl;
+
+  slab_load (comm, mf, &sl);
+
+  while (progress->err_c > errb1 && ! sl.expired)
+    {
+      if (progress->err_c < c_convergence)
+	progress->errb = errb1;
+      progress->iter++;
+      double start = alnsb_timer_wtime ();
+      int nsteps = slab_inner_solve (comm, mf, &sl, progress->errb,
+				     env->segmentation_max_steps);
+      double seconds = alnsb_timer_wtime () - start;
+      progress->steps += nsteps;
+      progress->err_c = slab_update_labels (comm, mf, &sl);
+      if (comm->rank == 0)
+	alnsb_maxflow_trace (mf, progress, nsteps, seconds);
+    }
+
+  slab_gather (comm, &sl, sl.u, mf->slices, mf->u->data);
+  slab_gather (comm, &sl, sl.ps, mf->slices, mf->ps->data);
+  slab_gather (comm, &sl, sl.pt, mf->slices, mf->pt->data);
+  slab_gather (comm, &sl, sl.pp1, mf->slices, mf->pp1->data);
+  slab_gather (comm, &sl, sl.pp2, mf->slices, mf->pp2->data);
+  // pp3[slices] is never updated.
+  slab_gather (comm, &sl, sl.pp3, mf->slices, mf->pp3->data);
+
+  slab_free (&sl);
+}
+
+
+/**
+ * Fork size - 1 workers sharing a communication area with the
+ * calling process, which is worker 0. Returns 0 if the workers could
+ * not be created.
+ *
+ */
+static
+int slab_comm_open (s_slab_comm_t* comm, s_alnsb_maxflow_t* mf, int size,
+		    pid_t* pids)
+{
+  size_t mbox_len = (mf->rows + 1) * (mf->cols + 1);
+  size_t sums_len = 2 * mf->slices;
+  size_t stage_len = max((size_t) (mf->slices + 1) * mf->rows * mf->cols,
+			 max((size_t) mf->slices * mf->rows * (mf->cols + 1),
+			     (size_t) mf->slices * (mf->rows + 1) * mf->cols));
+  size_t bytes = sizeof(struct slab_shm) + size * sums_len * sizeof(double) +
+    (size * mbox_len + stage_len) * sizeof(float);
+  int r;
+
+  void* area = mmap (NULL, bytes, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (area == MAP_FAILED)
+    return 0;
+  struct slab_shm* shm = area;
+  memset (shm, 0, sizeof(struct slab_shm));
+  shm->bytes = bytes;
+  shm->mbox_len = mbox_len;
+  shm->sums_len = sums_len;
+  shm->parent = getpid ();
+  shm->sums = (double*) (shm + 1);
+  shm->mbox = (float*) (shm->sums + size * sums_len);
+  shm->stage = shm->mbox + size * mbox_len;
+
+  comm->shm = shm;
+  comm->size = size;
+  comm->sense = 0;
+  comm->rank = 0;
+  comm->pids = pids;
+
+  fflush (stdout);
+  fflush (stderr);
+  for (r = 1; r < size; ++r)
+    {
+      pids[r] = fork ();
+      if (pids[r] == 0)
+	{
+	  comm->rank = r;
+	  return 1;
+	}
+      if (pids[r] < 0)
+	{
+	  while (--r > 0)
+	    {
+	      kill (pids[r], SIGKILL);
+	      waitpid (pids[r], NULL, 0);
+	    }
+	  munmap (area, bytes);
+	  return 0;
+	}
+    }
+
+  return 1;
+}
+
+
+/**
+ * Slab-decomposed outer loop of the solver: same contract as the
+ * single process loop of segmentation_solve_level. Returns the number
+ * of workers used, or 0 if the volume was not distributed (single
+ * worker, fewer slices than workers, per-slice engine, whose slices
+ * are already independent, or PDHG solver, which the workers do not
+ * implement); mf is then left untouched.
+ *
+ */
+int alnsb_maxflow_slab_solve (s_alnsb_environment_t* env,
+			      s_alnsb_maxflow_t* mf, image3DReal* output,
+			      s_alnsb_maxflow_progress_t* progress)
+{
+  s_slab_comm_t comm;
+  size_t i;
+
+  if (mf->engine == ALNSB_SEGMENTATION_ENGINE_SLICE2D ||
+      mf->solver != ALNSB_MAXFLOW_SOLVER_CMF)
+    return 0;
+#ifdef ALNSB_USE_MPI
+  MPI_Comm_rank (MPI_COMM_WORLD, &comm.rank);
+  MPI_Comm_size (MPI_COMM_WORLD, &comm.size);
+  comm.shm = NULL;
+  if (comm.size <= 1 || comm.size > mf->slices)
+    return 0;
+  slab_worker (env, &comm, mf, progress);
+#else
+  int size = min(env->segmentation_workers, mf->slices);
+  if (size <= 1)
+    return 0;
+  pid_t* pids = alnsb_calloc (sizeof(pid_t), size);
+  if (! slab_comm_open (&comm, mf, size, pids))
+    {
+      fprintf (stderr, "[WARNING][segmentation] Cannot start %d workers, solving in a single process\n",
+	       size);
+      free (pids);
+      return 0;
+    }
+  slab_worker (env, &comm, mf, progress);
+  if (comm.rank)
+    _exit (0);
+
+  int r, failed = 0;
+  for (r = 1; r < size; ++r)
+    {
+      int status;
+      if (waitpid (pids[r], &status, 0) < 0 || ! WIFEXITED(status) ||
+	  WEXITSTATUS(status))
+	failed = 1;
+    }
+  munmap (comm.shm, comm.shm->bytes);
+  free (pids);
+  if (failed)
+    {
+      fprintf (stderr, "[ERROR][segmentation] A solver worker failed\n");
+      exit (1);
+    }
+#endif
+  alnsb_maxflow_divergence (mf);
+
+  ALNSB_IMRealTo1D(mf->u, u);
+  ALNSB_IMRealTo1D(output, ut);
+#pragma omp parallel for
+  for (i = 0; i < output->num_pixels; ++i)
+    ut[i] = u[i] > 0.5;
+
+  return comm.size;
+}
@@ -0,0 +1,216 @@
+/**
+ * segmentation_slice2d.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Per-slice (2.5D) engine for the continuous max-flow solver.
+ *
+ * The inner steps solve the 2D problem of each slice independently:
+ * there is no flow between slices (pp3 is ignored and stays as is),
+ * and every slice, including the last one, is updated. Slices are
+ * distributed over the threads, each thread running all the inner
+ * steps of a slice before moving to the next one, until the mean
+ * update of u on the slice is below errb. The working set of a slice
+ * (its u, ps, pt, pp1, pp2 and data term, plus pts, gk and divp plane
+ * buffers) stays in cache for all these steps.
+ *
+ * The class means remain global: they are updated on the whole volume
+ * by the outer loop. The result differs from the 3D solve, since the
+ * regularization does not see the neighbor slices; compare the masks
+ * with the compare_masks tool.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+#include <stages/segmentation/segmentation_solver.h>
+#include <utilities/memfuncs.h>
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/**
+ * Per-thread plane buffers. zero is a row of 0, passed as the pp3
+ * flows to the row kernels.
+ *
+ */
+struct slice2d_buffers
+{
+  ALNSB_IMAGE_TYPE_REAL* pts;
+  ALNSB_IMAGE_TYPE_REAL* gk;
+  ALNSB_IMAGE_TYPE_REAL* divp;
+  ALNSB_IMAGE_TYPE_REAL* zero;
+};
+typedef struct slice2d_buffers s_slice2d_buffers_t;
+
+
+/**
+ * Divergence of the flows of one slice.
+ *
+ */
+static
+void slice2d_divergence (int rows, int cols,
+			 ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp1_in,
+			 ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR pp2_in,
+			 ALNSB_IMAGE_TYPE_REAL* __ALNSB_RESTRICT_PTR divp_in)
+{
+  ALNSB_IMAGE_TYPE_REAL (*pp1)[cols+1] = (ALNSB_IMAGE_TYPE_REAL (*)[cols+1])pp1_in;
+  ALNSB_IMAGE_TYPE_REAL (*pp2)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])pp2_in;
+  ALNSB_IMAGE_TYPE_REAL (*divp)[cols] = (ALNSB_IMAGE_TYPE_REAL (*)[cols])divp_in;
+  int j, k;
+
+  memset (divp_in, 0, rows * cols * sizeof(ALNSB_IMAGE_TYPE_REAL));
+  for (j = 0; j < rows-1; j++)
+    for (k = 0; k < cols-1; k++)
+      divp[j][k] = pp2[j+1][k] - pp2[j][k] + pp1[j][k+1] - pp1[j][k];
+}
+
+
+/**
+ * One inner step on slice z. Returns the sum of |erru| over the
+ * slice.
+ *
+ */
+static
+double slice2d_step (s_alnsb_maxflow_t* mf, s_slice2d_buffers_t* b, int kind,
+		     int z)
+{
+  int R = mf->rows;
+  int C = mf->cols;
+  size_t P = R * C;
+  float cc = mf->cc;
+  float steps = mf->steps;
+  ALNSB_IMAGE_TYPE_REAL* ur = mf->ur->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL* Cs = mf->Cs ? mf->Cs->data + z * P : NULL;
+  ALNSB_IMAGE_TYPE_REAL* Ct = mf->Ct ? mf->Ct->data + z * P : NULL;
+  ALNSB_IMAGE_TYPE_REAL* ps = mf->ps->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL* pt = mf->pt->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL* u = mf->u->data + z * P;
+  ALNSB_IMAGE_TYPE_REAL (*pp1)[C+1] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C+1])(mf->pp1->data + z * R * (C+1));
+  ALNSB_IMAGE_TYPE_REAL (*pp2)[C] =
+    (ALNSB_IMAGE_TYPE_REAL (*)[C])(mf->pp2->data + z * (R+1) * C);
+  ALNSB_IMAGE_TYPE_REAL (*pts)[C] = (ALNSB_IMAGE_TYPE_REAL (*)[C])b->pts;
+  ALNSB_IMAGE_TYPE_REAL (*gk)[C] = (ALNSB_IMAGE_TYPE_REAL (*)[C])b->gk;
+  ALNSB_IMAGE_TYPE_REAL* divp = b->divp;
+  double err = 0;
+  size_t x;
+  int j, k;
+
+  for (x = 0; x < P; ++x)
+    b->pts[x] = divp[x] - (ps[x] - pt[x] + (u[x] / cc));
+
+  for (j = 0; j < R; j++)
+    for (k = 1; k < C; k++)
+      pp1[j][k] = pp1[j][k] + (steps * (pts[j][k] - pts[j][k-1]));
+  for (j = 1; j < R; j++)
+    for (k = 0; k < C; k++)
+      pp2[j][k] = pp2[j][k] + (steps * (pts[j][k] - pts[j-1][k]));
+
+  for (j = 0; j < R-1; j++)
+    {
+      mf->kernels->gk_row (C-1, mf->alpha, pp1[j], pp2[j], pp2[j+1], b->zero,
+			   b->zero, gk[j]);
+      gk[j][C-1] = 0;
+    }
+  memset (gk[R-1], 0, C * sizeof(ALNSB_IMAGE_TYPE_REAL));
+
+  for (j = 0; j < R; j++)
+    for (k = 1; k < C; k++)
+      pp1[j][k] = (0.5 * (gk[j][k] + gk[j][k-1])) * pp1[j][k];
+  for (j = 1; j < R; j++)
+    for (k = 0; k < C; k++)
+      pp2[j][k] = (0.5 * (gk[j][k] + gk[j-1][k])) * pp2[j][k];
+
+  for (j = 0; j < R-1; j++)
+    {
+      x = j * C;
+      err += mf->kernels->update_row (kind, C-1, cc, mf->beta, mf->ulab[0],
+				      mf->ulab[1], ur + x,
+				      Cs ? Cs + x : NULL, Ct ? Ct + x : NULL,
+				      pp1[j], pp2[j], pp2[j+1], b->zero,
+				      b->zero, divp + x, ps + x, pt + x,
+				      u + x);
+    }
+
+  return err;
+}
+
+
+/**
+ * Per-slice engine: same contract as alnsb_maxflow_reference_solve,
+ * with the convergence test done on each slice. Returns the largest
+ * number of steps executed on a slice; max_err is the largest mean
+ * |erru| of a slice at its last step.
+ *
+ */
+int alnsb_maxflow_slice2d_solve (s_alnsb_maxflow_t* mf, float errb,
+				 int max_steps)
+{
+  int R = mf->rows;
+  int C = mf->cols;
+  size_t P = R * C;
+  int kind = alnsb_maxflow_data_term (mf);
+  int num_threads = 1;
+  int nsteps = 0;
+  double max_err = 0;
+  int z;
+#ifdef _OPENMP
+  num_threads = omp_get_max_threads ();
+#endif
+
+  mf->buffer_bytes = max(mf->buffer_bytes, num_threads *
+			 (3 * P + C) * sizeof(ALNSB_IMAGE_TYPE_REAL));
+
+#pragma omp parallel
+  {
+    s_slice2d_buffers_t b;
+    int t;
+    b.pts = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+    b.gk = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+    b.divp = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), P);
+    b.zero = alnsb_calloc (sizeof(ALNSB_IMAGE_TYPE_REAL), C);
+
+#pragma omp for schedule(dynamic) reduction(max:nsteps,max_err)
+    for (z = 0; z < mf->slices; z++)
+      {
+	double err = 0;
+	slice2d_divergence (R, C, mf->pp1->data + z * R * (C+1),
+			    mf->pp2->data + z * (R+1) * C, b.divp);
+	for (t = 0; t < max_steps; t++)
+	  if ((err = slice2d_step (mf, &b, kind, z) / P) < errb ||
+	      alnsb_budget_expired (&mf->budget))
+	    break;
+	nsteps = max(nsteps, t < max_steps ? t + 1 : max_steps);
+	max_err = max(max_err, err);
+      }
+
+    free (b.pts);
+    free (b.gk);
+    free (b.divp);
+    free (b.zero);
+  }
+  mf->max_err = max_err;
+
+  return nsteps;
+}
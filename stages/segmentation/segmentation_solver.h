@@ -0,0 +1,424 @@
+/**
+ * segmentation_solver.h: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+#ifndef ALNSB_SEGMENTATION_SOLVER_H
+# define ALNSB_SEGMENTATION_SOLVER_H
+
+# include <stdio.h>
+# include <stdint.h>
+
+# include <utilities/types.h>
+# include <utilities/images.h>
+# include <utilities/environment.h>
+# include <utilities/timer.h>
+
+
+/**
+ * Execution engines for the continuous max-flow solver.
+ *
+ * REFERENCE is the original implementation, with one OpenMP sweep
+ * over the full volume per array update. It is kept for validation.
+ *
+ * FUSED performs a complete inner step in a single slab-pipelined
+ * sweep, with the error reduction folded into the update.
+ *
+ * WAVEFRONT pipelines several inner steps in a single sweep (time
+ * tiling), and tests convergence once per sweep.
+ *
+ * NARROWBAND only updates the row segments of the volume near the
+ * boundary between the two classes, and periodically performs a
+ * fused step on the full volume (see segmentation_narrowband.c).
+ *
+ * SLICE2D solves the 2D problem of each slice independently, without
+ * flows between slices (see segmentation_slice2d.c). It is faster
+ * but does not give the same masks as the 3D engines.
+ *
+ * REDBLACK updates the state in place, the even slices then the odd
+ * ones (Gauss-Seidel), see segmentation_redblack.c. It needs fewer
+ * inner steps and no full-volume temporary.
+ *
+ */
+#define ALNSB_SEGMENTATION_ENGINE_REFERENCE	0
+#define ALNSB_SEGMENTATION_ENGINE_FUSED		1
+#define ALNSB_SEGMENTATION_ENGINE_WAVEFRONT	2
+#define ALNSB_SEGMENTATION_ENGINE_NARROWBAND	3
+#define ALNSB_SEGMENTATION_ENGINE_SLICE2D	4
+#define ALNSB_SEGMENTATION_ENGINE_REDBLACK	5
+
+
+/**
+ * Solvers of the inner problem.
+ *
+ * CMF is the continuous max-flow augmented Lagrangian method, with a
+ * fixed projected gradient step on the flows per multiplier update.
+ * It is run by the engines above.
+ *
+ * PDHG is the Chambolle-Pock primal-dual method on the primal form of
+ * the same problem, with the same discretization of the flows (see
+ * segmentation_pdhg.c). It has no source/sink flows, and ignores the
+ * engine.
+ *
+ */
+#define ALNSB_MAXFLOW_SOLVER_CMF	0
+#define ALNSB_MAXFLOW_SOLVER_PDHG	1
+
+
+/**
+ * Multilevel solve: at most ALNSB_SEGMENTATION_MAX_LEVELS levels,
+ * each level being downsampled by 2 in all dimensions, and no
+ * dimension of a coarse level below ALNSB_SEGMENTATION_MIN_LEVEL_SIZE.
+ *
+ */
+#define ALNSB_SEGMENTATION_MAX_LEVELS		8
+#define ALNSB_SEGMENTATION_MIN_LEVEL_SIZE	4
+
+
+/**
+ * Storage format of the flows (and optionally ps/pt) in the fused
+ * engine: fp32, or 16-bit fp16/bfloat16 with fp32 arithmetic (see
+ * segmentation_storage.c).
+ *
+ */
+#define ALNSB_MAXFLOW_STORAGE_FP32	0
+#define ALNSB_MAXFLOW_STORAGE_FP16	1
+#define ALNSB_MAXFLOW_STORAGE_BF16	2
+
+/**
+ * Volumes of the solver state which can be accessed by plane,
+ * whatever their storage format.
+ *
+ */
+#define ALNSB_MAXFLOW_VOL_U		0
+#define ALNSB_MAXFLOW_VOL_PS		1
+#define ALNSB_MAXFLOW_VOL_PT		2
+#define ALNSB_MAXFLOW_VOL_PP1		3
+#define ALNSB_MAXFLOW_VOL_PP2		4
+#define ALNSB_MAXFLOW_VOL_PP3		5
+#define ALNSB_MAXFLOW_NUM_VOLS		6
+
+
+/**
+ * Evaluation of the data terms Cs = |ur - ulab[0]|^beta and
+ * Ct = |ur - ulab[1]|^beta in the fused and wavefront engines:
+ * inline for beta = 1 and beta = 2, cached in Cs/Ct for other values
+ * of beta (recomputed once per outer iteration), or with pow in lean
+ * mode.
+ *
+ */
+#define ALNSB_MAXFLOW_BETA_GENERIC	0
+#define ALNSB_MAXFLOW_BETA_1		1
+#define ALNSB_MAXFLOW_BETA_2		2
+#define ALNSB_MAXFLOW_BETA_CACHED	3
+
+/**
+ * Data term |x|^beta for each kind of beta. Squaring a float is exact
+ * in double, so the beta = 1 and beta = 2 kinds give the same values
+ * as pow.
+ *
+ */
+#define ALNSB_MAXFLOW_DATA_TERM(kind, x, beta, cached)			\
+  ((kind) == ALNSB_MAXFLOW_BETA_1 ? fabs (x) :				\
+   (kind) == ALNSB_MAXFLOW_BETA_2 ? fabs (x) * fabs (x) :		\
+   (kind) == ALNSB_MAXFLOW_BETA_CACHED ? (cached) :			\
+   pow (fabs (x), beta))
+
+
+/**
+ * Row kernels of the fused and wavefront engines, one set per
+ * instruction set (see segmentation_simd.c). On n voxels of a row:
+ *
+ * gk_row computes gk from the flows of the row (pp1, pp2), of the
+ * next row (pp2n) and of the next slice (pp3n).
+ *
+ * update_row updates divp (if not NULL), ps, pt and u from the same
+ * flows, and returns the sum of |erru|. Cs and Ct are only read for
+ * the cached kind of data term.
+ *
+ */
+struct alnsb_maxflow_kernels
+{
+  char*			name;
+  void			(*gk_row) (int n, float alpha,
+				   const ALNSB_IMAGE_TYPE_REAL* pp1,
+				   const ALNSB_IMAGE_TYPE_REAL* pp2,
+				   const ALNSB_IMAGE_TYPE_REAL* pp2n,
+				   const ALNSB_IMAGE_TYPE_REAL* pp3,
+				   const ALNSB_IMAGE_TYPE_REAL* pp3n,
+				   ALNSB_IMAGE_TYPE_REAL* gk);
+  double		(*update_row) (int kind, int n, float cc, float beta,
+				       float ulab0, float ulab1,
+				       const ALNSB_IMAGE_TYPE_REAL* ur,
+				       const ALNSB_IMAGE_TYPE_REAL* Cs,
+				       const ALNSB_IMAGE_TYPE_REAL* Ct,
+				       const ALNSB_IMAGE_TYPE_REAL* pp1,
+				       const ALNSB_IMAGE_TYPE_REAL* pp2,
+				       const ALNSB_IMAGE_TYPE_REAL* pp2n,
+				       const ALNSB_IMAGE_TYPE_REAL* pp3,
+				       const ALNSB_IMAGE_TYPE_REAL* pp3n,
+				       ALNSB_IMAGE_TYPE_REAL* divp,
+				       ALNSB_IMAGE_TYPE_REAL* ps,
+				       ALNSB_IMAGE_TYPE_REAL* pt,
+				       ALNSB_IMAGE_TYPE_REAL* u);
+};
+typedef struct alnsb_maxflow_kernels s_alnsb_maxflow_kernels_t;
+
+
+/**
+ * State of the continuous max-flow solver. All volumes are
+ * slices x rows x cols, except pp1 (one extra column), pp2 (one
+ * extra row) and pp3 (one extra slice).
+ *
+ */
+struct alnsb_maxflow
+{
+  // Problem size.
+  int			slices;
+  int			rows;
+  int			cols;
+  // Solver parameters.
+  float			alpha;
+  float			cc;
+  float			steps;
+  float			beta;
+  float			ulab[2];
+  // Solver and engine used for the inner iterations, and the row
+  // kernels of the engine.
+  int			solver;
+  int			engine;
+  const s_alnsb_maxflow_kernels_t* kernels;
+  // Input image (result of levelscale).
+  image3DReal*		ur;
+  // Primal/dual variables. ps, pt and the flows are NULL when they
+  // are packed.
+  image3DReal*		u;
+  image3DReal*		ps;
+  image3DReal*		pt;
+  image3DReal*		pp1;
+  image3DReal*		pp2;
+  image3DReal*		pp3;
+  // Storage format (ALNSB_MAXFLOW_STORAGE_*), and the packed volumes
+  // indexed by ALNSB_MAXFLOW_VOL_*, NULL for the fp32 ones.
+  int			storage;
+  uint16_t*		packed[ALNSB_MAXFLOW_NUM_VOLS];
+  // Divergence of the flows. NULL in lean mode, where the engines
+  // recompute it from pp1/pp2/pp3.
+  image3DReal*		divp;
+  // PDHG solver: primal and dual step sizes, and the extrapolated u.
+  float			tau;
+  float			sigma;
+  image3DReal*		ubar;
+  // Full-volume temporaries, only used by the reference engine,
+  // except Cs/Ct which also hold the data term cache, and gk which is
+  // also used by the PDHG solver.
+  image3DReal*		Cs;
+  image3DReal*		Ct;
+  image3DReal*		gk;
+  image3DReal*		pts;
+  image3DReal*		erru;
+  // Peak size of the plane buffers allocated by the engine, in bytes.
+  size_t		buffer_bytes;
+  // Narrow band engine: half-width around u = 0.5 of the band of
+  // active voxels, smallest |u' - u| of an active voxel, and period
+  // of the full-volume steps.
+  float			nb_band;
+  float			nb_tol;
+  int			nb_revalidate;
+  // Narrow band telemetry: inner steps executed, and sum over these
+  // steps of the fraction of the volume updated.
+  int			nb_steps;
+  double		nb_updated;
+  // Mean |erru| of the last inner step (mean |u' - u| for the PDHG
+  // solver), set by the engines.
+  float			max_err;
+  // Convergence trace, NULL if disabled, and resolution level of the
+  // solver.
+  FILE*			trace;
+  int			level;
+  // Time budget of the segmentation: the engines stop after the
+  // inner step during which it expires.
+  s_alnsb_budget_t	budget;
+};
+typedef struct alnsb_maxflow s_alnsb_maxflow_t;
+
+
+/**
+ * Progress of the outer loop of the solver, saved along with the
+ * solver state in checkpoints.
+ *
+ */
+struct alnsb_maxflow_progress
+{
+  // Outer iterations and inner steps executed.
+  int			iter;
+  int			steps;
+  // Last change of the class means, and current stopping threshold
+  // of the inner steps.
+  float			err_c;
+  float			errb;
+};
+typedef struct alnsb_maxflow_progress s_alnsb_maxflow_progress_t;
+
+
+/**
+ * Result of loading a checkpoint (see alnsb_maxflow_checkpoint_load).
+ *
+ */
+#define ALNSB_MAXFLOW_CHECKPOINT_NONE	0
+#define ALNSB_MAXFLOW_CHECKPOINT_RESUME	1
+#define ALNSB_MAXFLOW_CHECKPOINT_WARM	2
+
+
+extern
+int alnsb_maxflow_engine_from_name (char* name);
+
+extern
+char* alnsb_maxflow_engine_name (int engine);
+
+extern
+int alnsb_maxflow_solver_from_name (char* name);
+
+extern
+char* alnsb_maxflow_solver_name (int solver);
+
+extern
+const s_alnsb_maxflow_kernels_t* alnsb_maxflow_kernels (char* isa);
+
+extern
+int alnsb_maxflow_storage_from_name (char* name);
+
+extern
+char* alnsb_maxflow_storage_name (int storage);
+
+extern
+image3DReal** alnsb_maxflow_volume (s_alnsb_maxflow_t* mf, int vol);
+
+extern
+size_t alnsb_maxflow_plane_size (s_alnsb_maxflow_t* mf, int vol);
+
+extern
+void alnsb_maxflow_volume_alloc (s_alnsb_maxflow_t* mf, int vol, int packed);
+
+extern
+ALNSB_IMAGE_TYPE_REAL* alnsb_maxflow_plane_load (s_alnsb_maxflow_t* mf,
+						 int vol, int z,
+						 ALNSB_IMAGE_TYPE_REAL* buf);
+
+extern
+void alnsb_maxflow_plane_store (s_alnsb_maxflow_t* mf, int vol, int z,
+				ALNSB_IMAGE_TYPE_REAL* data);
+
+extern
+void alnsb_maxflow_volume_clear (s_alnsb_maxflow_t* mf, int vol);
+
+extern
+void alnsb_maxflow_unpack (s_alnsb_maxflow_t* mf);
+
+extern
+s_alnsb_maxflow_t* alnsb_maxflow_alloc (s_alnsb_environment_t* env,
+					image3DReal* input, int engine);
+
+extern
+void alnsb_maxflow_free (s_alnsb_maxflow_t* mf);
+
+extern
+void alnsb_maxflow_init (s_alnsb_maxflow_t* mf);
+
+extern
+int alnsb_maxflow_data_term (s_alnsb_maxflow_t* mf);
+
+extern
+size_t alnsb_maxflow_footprint (s_alnsb_maxflow_t* mf);
+
+extern
+float alnsb_maxflow_update_labels (s_alnsb_maxflow_t* mf,
+				   image3DReal* output);
+
+extern
+void alnsb_maxflow_trace (s_alnsb_maxflow_t* mf,
+			  s_alnsb_maxflow_progress_t* progress,
+			  int nsteps, double seconds);
+
+extern
+int alnsb_maxflow_auto_ulab (image3DReal* input, float ulab[2],
+			     float* threshold);
+
+extern
+image3DReal* alnsb_maxflow_restrict_input (image3DReal* img);
+
+extern
+void alnsb_maxflow_divergence (s_alnsb_maxflow_t* mf);
+
+extern
+void alnsb_maxflow_prolongate (s_alnsb_maxflow_t* coarse,
+			       s_alnsb_maxflow_t* fine);
+
+extern
+void alnsb_maxflow_checkpoint_save (s_alnsb_environment_t* env,
+				    s_alnsb_maxflow_t* mf,
+				    s_alnsb_maxflow_progress_t* progress,
+				    char* filename);
+
+extern
+int alnsb_maxflow_checkpoint_load (s_alnsb_environment_t* env,
+				   s_alnsb_maxflow_t* mf,
+				   s_alnsb_maxflow_progress_t* progress,
+				   char* filename);
+
+extern
+int alnsb_maxflow_slab_solve (s_alnsb_environment_t* env,
+			      s_alnsb_maxflow_t* mf, image3DReal* output,
+			      s_alnsb_maxflow_progress_t* progress);
+
+extern
+int alnsb_maxflow_reference_solve (s_alnsb_maxflow_t* mf, float errb,
+				   int max_steps);
+
+extern
+int alnsb_maxflow_fused_solve (s_alnsb_maxflow_t* mf, float errb,
+			       int max_steps);
+
+extern
+int alnsb_maxflow_fused_run (s_alnsb_maxflow_t* mf, int kind, float errb,
+			     int max_steps);
+
+extern
+int alnsb_maxflow_wavefront_solve (s_alnsb_maxflow_t* mf, float errb,
+				   int max_steps, int time_tile);
+
+extern
+int alnsb_maxflow_narrowband_solve (s_alnsb_maxflow_t* mf, float errb,
+				    int max_steps);
+
+extern
+int alnsb_maxflow_redblack_solve (s_alnsb_maxflow_t* mf, float errb,
+				  int max_steps);
+
+extern
+void alnsb_maxflow_redblack_batch_step (s_alnsb_maxflow_t** mfs, int n,
+					double* err);
+
+extern
+int alnsb_maxflow_pdhg_solve (s_alnsb_maxflow_t* mf, float errb,
+			      int max_steps);
+
+extern
+int alnsb_maxflow_slice2d_solve (s_alnsb_maxflow_t* mf, float errb,
+				 int max_steps);
+
+
+#endif //!ALNSB_SEGMENTATION_SOLVER_H
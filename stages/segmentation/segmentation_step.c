@@ -16,212 +16,845 @@
  * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
  *
  */
+#include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <stages/segmentation/segmentation_step.h>
+#include <stages/segmentation/segmentation_solver.h>
+#include <utilities/memfuncs.h>
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #define max(a,b) ((a) > (b) ? (a) : (b))
 
 
-void segmentation_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
-		       image3DReal* __ALNSB_RESTRICT_PTR input,
-		       image3DReal** __ALNSB_RESTRICT_PTR output)
+/**
+ * Cost of a segmentation: outer iterations and inner steps over all
+ * the levels, and wall time of the solve. storage is the storage
+ * format actually used.
+ *
+ */
+struct segmentation_stats
 {
-  // Allocate output data.
-  *output = image3DReal_alloc (input->slices, input->rows, input->cols);
-
-  // Set up algorithm parameters set by the user.
-  float lp = env->segmentation_lp;
-  float errb[] = {env->segmentation_errb[0], env->segmentation_errb[1]};
-  float ulab[] = {env->segmentation_ulab[0], env->segmentation_ulab[1]};
-  float cc = env->segmentation_cc;
-  float c_convergence = env->segmentation_c_convergence;
-  float steps = env->segmentation_steps;
-  float beta = env->segmentation_beta;
-  float err_c = env->segmentation_err_c;
-  float max_err = env->segmentation_max_err;
+  int			storage;
+  int			iter;
+  int			steps;
+  double		seconds;
+};
+typedef struct segmentation_stats s_segmentation_stats_t;
 
 
-  // Locals.
-  int slices = input->slices;
-  int rows = input->rows;
-  int cols = input->cols;
-  int t, i, j, k, iter = 0;
-  float ulab_p[2];
-  float alpha = lp;
-  // Set to 1 for printing some debug info while executing.
-  int debug = 0;
-
-  // 3D view of input/output arrays.
-  ALNSB_IMRealTo3D(input,ur);
-  ALNSB_IMRealTo3D(*output,ut);
-
-  // Allocate local 3D arrays.
-  ALNSB_REAL3D_alloc(Cs, slices, rows, cols);
-  ALNSB_REAL3D_alloc(Ct, slices, rows, cols);
-  ALNSB_REAL3D_alloc(pp1, slices, rows, cols+1);
-  ALNSB_REAL3D_alloc(pp2, slices, rows+1, cols);
-  ALNSB_REAL3D_alloc(pp3, slices+1, rows, cols);
-  ALNSB_REAL3D_alloc(u, slices, rows, cols);
-  ALNSB_REAL3D_alloc(divp, slices, rows, cols);
-  ALNSB_REAL3D_alloc(ps, slices, rows, cols);
-  ALNSB_REAL3D_alloc(pt, slices, rows, cols);
-  ALNSB_REAL3D_alloc(gk, slices, rows, cols);
-  ALNSB_REAL3D_alloc(pts, slices, rows, cols);
-  ALNSB_REAL3D_alloc(erru, slices, rows, cols);
-
-#pragma omp parallel for private(j,k)
-  for (i = 0; i < slices; i++) {
-     for (j = 0; j < rows; j++) {
-        for (k = 0; k < cols; k++) {
-          Cs[i][j][k] = pow (fabs (ur[i][j][k] - ulab[0]), beta);
-          Ct[i][j][k] = pow (fabs (ur[i][j][k] - ulab[1]), beta);
-          u[i][j][k] = (Cs[i][j][k] - Ct[i][j][k]) >= 0;
-          ps[i][j][k] = pt[i][j][k] = min (Cs[i][j][k], Ct[i][j][k]);
-        }
-     }
-  }
-
-  while (err_c > errb[1]) {
-      if (err_c < c_convergence)
-         errb[0] = errb[1];
+/**
+ * Reference engine: one full-volume sweep per array update. Runs at
+ * most max_steps inner steps, stops early when the mean absolute
+ * update of u is below errb. Returns the number of steps executed.
+ *
+ */
+int alnsb_maxflow_reference_solve (s_alnsb_maxflow_t* mf, float errb,
+				   int max_steps)
+{
+  int slices = mf->slices;
+  int rows = mf->rows;
+  int cols = mf->cols;
+  float alpha = mf->alpha;
+  float cc = mf->cc;
+  float steps = mf->steps;
+  float beta = mf->beta;
+  float* ulab = mf->ulab;
+  float max_err;
+  int t, i, j, k;
 
-      iter++;
-      if (debug)
-	printf ("outer loop iteration no: %d\n", iter);
+  ALNSB_IMRealTo3D(mf->ur, ur);
+  ALNSB_IMRealTo3D(mf->Cs, Cs);
+  ALNSB_IMRealTo3D(mf->Ct, Ct);
+  ALNSB_IMRealTo3D(mf->pp1, pp1);
+  ALNSB_IMRealTo3D(mf->pp2, pp2);
+  ALNSB_IMRealTo3D(mf->pp3, pp3);
+  ALNSB_IMRealTo3D(mf->u, u);
+  ALNSB_IMRealTo3D(mf->divp, divp);
+  ALNSB_IMRealTo3D(mf->ps, ps);
+  ALNSB_IMRealTo3D(mf->pt, pt);
+  ALNSB_IMRealTo3D(mf->gk, gk);
+  ALNSB_IMRealTo3D(mf->pts, pts);
+  ALNSB_IMRealTo3D(mf->erru, erru);
 
-      for (t = 0; t < env->segmentation_max_steps; t++) {
-	if (debug)
-	    printf ("inner loop iteration no: %d\n", t+1);
+  for (t = 0; t < max_steps; t++) {
 #pragma omp parallel for private(j,k)
-          for (i = 0; i < slices; i++)
-            for (j = 0; j < rows; j++)
-              for (k = 0; k < cols; k++)
-                pts[i][j][k] = divp[i][j][k] - (ps[i][j][k] - pt[i][j][k] + (u[i][j][k] / cc));
+      for (i = 0; i < slices; i++)
+        for (j = 0; j < rows; j++)
+          for (k = 0; k < cols; k++)
+            pts[i][j][k] = divp[i][j][k] - (ps[i][j][k] - pt[i][j][k] + (u[i][j][k] / cc));
 
 #pragma omp parallel for private(j,k)
-          for (i = 0; i < slices; i++)
-            for (j = 0; j < rows; j++)
-              for (k = 1; k < cols; k++)
-                pp1[i][j][k] = pp1[i][j][k] + (steps * (pts[i][j][k] - pts[i][j][k-1]));
+      for (i = 0; i < slices; i++)
+        for (j = 0; j < rows; j++)
+          for (k = 1; k < cols; k++)
+            pp1[i][j][k] = pp1[i][j][k] + (steps * (pts[i][j][k] - pts[i][j][k-1]));
 
 #pragma omp parallel for private(j,k)
-          for (i = 0; i < slices; i++)
-            for (j = 1; j < rows; j++)
-              for (k = 0; k < cols; k++)
-                pp2[i][j][k] = pp2[i][j][k] + (steps * (pts[i][j][k] - pts[i][j-1][k]));
+      for (i = 0; i < slices; i++)
+        for (j = 1; j < rows; j++)
+          for (k = 0; k < cols; k++)
+            pp2[i][j][k] = pp2[i][j][k] + (steps * (pts[i][j][k] - pts[i][j-1][k]));
 
 #pragma omp parallel for private(j,k)
-          for (i = 1; i < slices; i++)
-            for (j = 0; j < rows; j++)
-              for (k = 0; k < cols; k++)
-                pp3[i][j][k] = pp3[i][j][k] + (steps * (pts[i][j][k] - pts[i-1][j][k]));
+      for (i = 1; i < slices; i++)
+        for (j = 0; j < rows; j++)
+          for (k = 0; k < cols; k++)
+            pp3[i][j][k] = pp3[i][j][k] + (steps * (pts[i][j][k] - pts[i-1][j][k]));
 
 #define alnsb_power2(a) ((a)*(a))
 
 #pragma omp parallel for private(j,k)
-          for (i = 0; i < slices-1; i++) {
-            for (j = 0; j < rows-1; j++) {
-              for (k = 0; k < cols-1; k++) {
+      for (i = 0; i < slices-1; i++) {
+        for (j = 0; j < rows-1; j++) {
+          for (k = 0; k < cols-1; k++) {
 		// power of 2 was hardwired, beta was not used here.
-                gk[i][j][k] = sqrt ((alnsb_power2(pp1[i][j][k]) + alnsb_power2(pp1[i][j][k+1]) + alnsb_power2(pp2[i][j][k]) + alnsb_power2(pp2[i][j+1][k]) + alnsb_power2(pp3[i][j][k]) + alnsb_power2(pp3[i+1][j][k])) * 0.5);
-                gk[i][j][k] = (gk[i][j][k] <= alpha) + (gk[i][j][k] > alpha) * (gk[i][j][k] / alpha);
-                gk[i][j][k] = 1 / gk[i][j][k];
-              }
-            }
+            gk[i][j][k] = sqrt ((alnsb_power2(pp1[i][j][k]) + alnsb_power2(pp1[i][j][k+1]) + alnsb_power2(pp2[i][j][k]) + alnsb_power2(pp2[i][j+1][k]) + alnsb_power2(pp3[i][j][k]) + alnsb_power2(pp3[i+1][j][k])) * 0.5);
+            gk[i][j][k] = (gk[i][j][k] <= alpha) + (gk[i][j][k] > alpha) * (gk[i][j][k] / alpha);
+            gk[i][j][k] = 1 / gk[i][j][k];
           }
+        }
+      }
 
 #pragma omp parallel for private(j,k)
-          for (i = 0; i < slices; i++)
-            for (j = 0; j < rows; j++)
-              for (k = 1; k < cols; k++)
-                pp1[i][j][k] = (0.5 * (gk[i][j][k] + gk[i][j][k-1])) * pp1[i][j][k];
+      for (i = 0; i < slices; i++)
+        for (j = 0; j < rows; j++)
+          for (k = 1; k < cols; k++)
+            pp1[i][j][k] = (0.5 * (gk[i][j][k] + gk[i][j][k-1])) * pp1[i][j][k];
 
 #pragma omp parallel for private(j,k)
-          for (i = 0; i < slices; i++)
-            for (j = 1; j < rows; j++)
-              for (k = 0; k < cols; k++)
-                pp2[i][j][k] = (0.5 * (gk[i][j][k] + gk[i][j-1][k])) * pp2[i][j][k];
+      for (i = 0; i < slices; i++)
+        for (j = 1; j < rows; j++)
+          for (k = 0; k < cols; k++)
+            pp2[i][j][k] = (0.5 * (gk[i][j][k] + gk[i][j-1][k])) * pp2[i][j][k];
 
 #pragma omp parallel for private(j,k)
-          for (i = 1; i < slices; i++)
-            for (j = 0; j < rows; j++)
-              for (k = 0; k < cols; k++)
-                pp3[i][j][k] = (0.5 * (gk[i][j][k] + gk[i-1][j][k])) * pp3[i][j][k];
+      for (i = 1; i < slices; i++)
+        for (j = 0; j < rows; j++)
+          for (k = 0; k < cols; k++)
+            pp3[i][j][k] = (0.5 * (gk[i][j][k] + gk[i-1][j][k])) * pp3[i][j][k];
 
-	  max_err = 0.0;
+      max_err = 0.0;
 #pragma omp parallel for private(j,k)
-          for (i = 0; i < slices-1; i++) {
-            for (j = 0; j < rows-1; j++) {
-              for (k = 0; k < cols-1; k++) {
-                divp[i][j][k] = pp2[i][j+1][k] - pp2[i][j][k] + pp1[i][j][k+1] - pp1[i][j][k] + pp3[i+1][j][k] - pp3[i][j][k];
-                pts[i][j][k] = divp[i][j][k] - (u[i][j][k] / cc) + pt[i][j][k] + (1/cc);
-                Cs[i][j][k] = pow (fabs (ur[i][j][k] - ulab[0]), beta);
-                ps[i][j][k] = min (pts[i][j][k], Cs[i][j][k]);
-                pts[i][j][k] = ps[i][j][k] + (u[i][j][k] / cc) - divp[i][j][k];
-                Ct[i][j][k] = pow (fabs (ur[i][j][k] - ulab[1]), beta);
-                pt[i][j][k] = min (pts[i][j][k], Ct[i][j][k]);
-                erru[i][j][k] = cc * (divp[i][j][k] + pt[i][j][k] - ps[i][j][k]);
-                u[i][j][k] = u[i][j][k] - erru[i][j][k];
-              }
-            }
+      for (i = 0; i < slices-1; i++) {
+        for (j = 0; j < rows-1; j++) {
+          for (k = 0; k < cols-1; k++) {
+            divp[i][j][k] = pp2[i][j+1][k] - pp2[i][j][k] + pp1[i][j][k+1] - pp1[i][j][k] + pp3[i+1][j][k] - pp3[i][j][k];
+            pts[i][j][k] = divp[i][j][k] - (u[i][j][k] / cc) + pt[i][j][k] + (1/cc);
+            Cs[i][j][k] = pow (fabs (ur[i][j][k] - ulab[0]), beta);
+            ps[i][j][k] = min (pts[i][j][k], Cs[i][j][k]);
+            pts[i][j][k] = ps[i][j][k] + (u[i][j][k] / cc) - divp[i][j][k];
+            Ct[i][j][k] = pow (fabs (ur[i][j][k] - ulab[1]), beta);
+            pt[i][j][k] = min (pts[i][j][k], Ct[i][j][k]);
+            erru[i][j][k] = cc * (divp[i][j][k] + pt[i][j][k] - ps[i][j][k]);
+            u[i][j][k] = u[i][j][k] - erru[i][j][k];
           }
+        }
+      }
 
 #pragma omp parallel for private(j,k) reduction(+:max_err)
-          for (i = 0; i < slices; i++)
-            for (j = 0; j < rows; j++)
-              for (k = 0; k < cols; k++)
-                 max_err += fabs (erru[i][j][k]);
-	  if (debug)
-	    printf ("max_err = %.16f\n", max_err);
-          if ((max_err / (rows*cols*slices)) < errb[0]) break;
-      }
-#pragma omp parallel for private(j,k)
       for (i = 0; i < slices; i++)
-         for (j = 0; j < rows; j++)
-            for (k = 0; k < cols; k++)
-		ut[i][j][k] = u[i][j][k] > 0.5;
+        for (j = 0; j < rows; j++)
+          for (k = 0; k < cols; k++)
+             max_err += fabs (erru[i][j][k]);
+      mf->max_err = max_err / (rows*cols*slices);
+      if ((max_err / (rows*cols*slices)) < errb) break;
+      if (alnsb_budget_expired (&mf->budget)) break;
+  }
+
+  return t < max_steps ? t + 1 : max_steps;
+}
 
-      ulab_p[0] = ulab[0];
-      ulab_p[1] = ulab[1];
+
+/**
+ * Outer loop of the solver on one level: alternate inner solves and
+ * class means updates until the means are stable, starting from (and
+ * updating) progress. The thresholded u is written to output. The
+ * state is saved to checkpoint after each outer iteration not cut
+ * short by the deadline, if not NULL.
+ *
+ */
+static
+void segmentation_solve_level (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+			       s_alnsb_maxflow_t* mf, int engine,
+			       image3DReal* output,
+			       s_alnsb_maxflow_progress_t* progress,
+			       char* checkpoint)
+{
+  // Set up algorithm parameters set by the user.
+  float errb1 = env->segmentation_errb[1];
+  float c_convergence = env->segmentation_c_convergence;
+
+  // Locals.
+  int labeled = 0;
+  // Set to 1 for printing some debug info while executing.
+  int debug = 0;
+
+  // Slab-decomposed solve over several processes. The state is only
+  // checkpointed once the level is solved.
+  int workers = alnsb_maxflow_slab_solve (env, mf, output, progress);
+  if (workers)
+    {
+      if (env->verbose_level)
+	printf ("[INFO] Segmentation of %d x %d x %d distributed over %d workers\n",
+		mf->slices, mf->rows, mf->cols, workers);
+      if (checkpoint && ! alnsb_budget_expired (&mf->budget))
+	alnsb_maxflow_checkpoint_save (env, mf, progress, checkpoint);
+      return;
+    }
+
+  while (progress->err_c > errb1 && ! alnsb_budget_expired (&mf->budget)) {
+      if (progress->err_c < c_convergence)
+         progress->errb = errb1;
+
+      progress->iter++;
       if (debug)
-	printf ("ulab_p[0]=%f, ulab_p[1]=%f\n", ulab_p[0], ulab_p[1]);
-      ulab[0] = ulab[1] = 0.0;
-      for (i = 0; i < slices; i++) {
-	 float f = 0.0, g = 0.0, m = 0.0, n = 0.0;
-#pragma omp parallel for private(k) reduction(+:f,m,g,n)
-         for (j = 0; j < rows; j++) {
-	   for (k = 0; k < cols; k++) {
-               f += ur[i][j][k] * (1 - ut[i][j][k]);
-	       m += ur[i][j][k] * ut[i][j][k];
-	       g += 1 - ut[i][j][k];
-               n += ut[i][j][k];
-            }
-         }
-	 if (g > 0)
-	   ulab[0] += (f/g);
-	 if (n > 0)
-	   ulab[1] +=  (m/n);
-      }
-      ulab[0] = ulab[0] / slices;
-      ulab[1] = ulab[1] / slices;
-      err_c = fabs (ulab_p[0] - ulab[0]) + fabs (ulab_p[1] - ulab[1]);
+	printf ("outer loop iteration no: %d\n", progress->iter);
+
+      double start = mf->trace ? alnsb_timer_wtime () : 0;
+      int nsteps = 0;
+      if (mf->solver == ALNSB_MAXFLOW_SOLVER_PDHG)
+	nsteps = alnsb_maxflow_pdhg_solve (mf, progress->errb,
+					   env->segmentation_max_steps);
+      else
+	switch (engine)
+	  {
+	  case ALNSB_SEGMENTATION_ENGINE_REFERENCE:
+	    nsteps = alnsb_maxflow_reference_solve (mf, progress->errb,
+						    env->segmentation_max_steps);
+	    break;
+	  case ALNSB_SEGMENTATION_ENGINE_FUSED:
+	    nsteps = alnsb_maxflow_fused_solve (mf, progress->errb,
+						env->segmentation_max_steps);
+	    break;
+	  case ALNSB_SEGMENTATION_ENGINE_WAVEFRONT:
+	    nsteps = alnsb_maxflow_wavefront_solve (mf, progress->errb,
+						    env->segmentation_max_steps,
+						    env->segmentation_time_tile);
+	    break;
+	  case ALNSB_SEGMENTATION_ENGINE_NARROWBAND:
+	    nsteps = alnsb_maxflow_narrowband_solve (mf, progress->errb,
+						     env->segmentation_max_steps);
+	    break;
+	  case ALNSB_SEGMENTATION_ENGINE_SLICE2D:
+	    nsteps = alnsb_maxflow_slice2d_solve (mf, progress->errb,
+						  env->segmentation_max_steps);
+	    break;
+	  case ALNSB_SEGMENTATION_ENGINE_REDBLACK:
+	    nsteps = alnsb_maxflow_redblack_solve (mf, progress->errb,
+						   env->segmentation_max_steps);
+	    break;
+	  }
+      progress->steps += nsteps;
+      double seconds = mf->trace ? alnsb_timer_wtime () - start : 0;
       if (debug)
-	printf ("err_c = %f\n", err_c);
+	printf ("inner loop iterations: %d\n", nsteps);
+
+      // The deadline may have cut the inner solve short: the mask is
+      // output, but the outer iteration is not counted (its inner
+      // steps are) nor saved, so that a resume runs it again in full.
+      int interrupted = alnsb_budget_expired (&mf->budget);
+      float err_c = alnsb_maxflow_update_labels (mf, output);
+      labeled = 1;
+      if (debug)
+	printf ("ulab[0]=%f, ulab[1]=%f, err_c = %f\n",
+		mf->ulab[0], mf->ulab[1], err_c);
+      if (interrupted)
+	{
+	  progress->iter--;
+	  break;
+	}
+      progress->err_c = err_c;
+      alnsb_maxflow_trace (mf, progress, nsteps, seconds);
+
+      if (checkpoint)
+	alnsb_maxflow_checkpoint_save (env, mf, progress, checkpoint);
   }
 
+  // Resumed from a converged state, or past the deadline: only
+  // threshold u.
+  if (! labeled)
+    alnsb_maxflow_update_labels (mf, output);
+}
+
+
+/**
+ * Solve the segmentation of input into *output (allocated here), and
+ * return its cost in stats.
+ *
+ */
+static
+void segmentation_run (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+		       image3DReal* __ALNSB_RESTRICT_PTR input,
+		       image3DReal** __ALNSB_RESTRICT_PTR output,
+		       s_segmentation_stats_t* stats)
+{
+  // Allocate output data.
+  *output = image3DReal_alloc (input->slices, input->rows, input->cols);
+
+  // Locals.
+  int iter = 0;
+  int total_steps = 0;
+  int solver = alnsb_maxflow_solver_from_name (env->segmentation_solver);
+  int engine = alnsb_maxflow_engine_from_name (env->segmentation_engine);
+  int storage = alnsb_maxflow_storage_from_name (env->segmentation_storage);
+  double start = alnsb_timer_wtime ();
+  s_alnsb_budget_t budget;
+  float max_err = 0;
+  size_t footprint = 0;
+  int nb_steps = 0;
+  double nb_updated = 0;
+  int l;
+  s_alnsb_maxflow_progress_t initial_progress =
+    { 0, 0, env->segmentation_err_c, env->segmentation_errb[0] };
+  s_alnsb_maxflow_progress_t progress;
+
+  alnsb_budget_start (&budget, env->segmentation_deadline);
+  if (storage != ALNSB_MAXFLOW_STORAGE_FP32 &&
+      (solver != ALNSB_MAXFLOW_SOLVER_CMF ||
+       engine != ALNSB_SEGMENTATION_ENGINE_FUSED ||
+       env->segmentation_workers > 1))
+    {
+      fprintf (stderr, "[WARNING][segmentation] %s storage needs the cmf solver with the fused engine in a single process, using fp32\n",
+	       alnsb_maxflow_storage_name (storage));
+      storage = ALNSB_MAXFLOW_STORAGE_FP32;
+    }
+  if (solver == ALNSB_MAXFLOW_SOLVER_PDHG)
+    {
+      if (env->segmentation_workers > 1)
+	fprintf (stderr, "[WARNING][segmentation] The pdhg solver runs in a single process\n");
+      if (env->segmentation_pd_tau * env->segmentation_pd_sigma > 1.0 / 12)
+	fprintf (stderr, "[WARNING][segmentation] tau * sigma = %g is above 1/12, the pdhg solver may diverge\n",
+		 env->segmentation_pd_tau * env->segmentation_pd_sigma);
+    }
+
+  // Class means from the histogram of the input, in place of the
+  // parameter values.
+  s_alnsb_environment_t auto_env;
+  if (env->segmentation_auto_ulab)
+    {
+      float ulab[2];
+      float threshold;
+      if (alnsb_maxflow_auto_ulab (input, ulab, &threshold))
+	{
+	  auto_env = *env;
+	  auto_env.segmentation_ulab[0] = ulab[0];
+	  auto_env.segmentation_ulab[1] = ulab[1];
+	  env = &auto_env;
+	  if (env->verbose_level)
+	    printf ("[INFO] Segmentation ulab from the input histogram: ulab[0]=%f, ulab[1]=%f (threshold %f)\n",
+		    ulab[0], ulab[1], threshold);
+	}
+      else
+	fprintf (stderr, "[WARNING][segmentation] Constant input, using the ulab parameter values\n");
+    }
+
+  // Convergence trace: one CSV row per outer iteration.
+  FILE* trace = NULL;
+  if (env->segmentation_trace)
+    {
+      trace = fopen (env->segmentation_trace, "w");
+      if (trace == NULL)
+	fprintf (stderr, "[WARNING][segmentation] Cannot write trace %s\n",
+		 env->segmentation_trace);
+      else
+	fprintf (trace, "level,iteration,inner_steps,total_steps,errb,max_err,err_c,ulab0,ulab1,seconds,seconds_per_step\n");
+    }
+
+  // Resume from, or warm start with, the checkpointed state if any.
+  s_alnsb_maxflow_t* resumed = NULL;
+  progress = initial_progress;
+  if (env->segmentation_checkpoint)
+    {
+      resumed = alnsb_maxflow_alloc (env, input, engine);
+      alnsb_maxflow_init (resumed);
+      switch (alnsb_maxflow_checkpoint_load (env, resumed, &progress,
+					     env->segmentation_checkpoint))
+	{
+	case ALNSB_MAXFLOW_CHECKPOINT_RESUME:
+	  if (env->verbose_level)
+	    printf ("[INFO] Segmentation resumed from %s after %d outer iterations\n",
+		    env->segmentation_checkpoint, progress.iter);
+	  break;
+	case ALNSB_MAXFLOW_CHECKPOINT_WARM:
+	  if (env->verbose_level)
+	    printf ("[INFO] Segmentation warm-started from %s\n",
+		    env->segmentation_checkpoint);
+	  break;
+	default:
+	  alnsb_maxflow_free (resumed);
+	  resumed = NULL;
+	}
+    }
+
+  // Input of each level, from the finest (level 0, the input image)
+  // to the coarsest. Coarsening stops before a dimension drops below
+  // ALNSB_SEGMENTATION_MIN_LEVEL_SIZE. A checkpointed state is a
+  // better start than the coarse levels.
+  image3DReal* level_input[ALNSB_SEGMENTATION_MAX_LEVELS];
+  int num_levels = 1;
+  level_input[0] = input;
+  while (! resumed && num_levels < min(env->segmentation_levels,
+				       ALNSB_SEGMENTATION_MAX_LEVELS))
+    {
+      image3DReal* prev = level_input[num_levels - 1];
+      if (min(prev->slices, min(prev->rows, prev->cols)) <
+	  2 * ALNSB_SEGMENTATION_MIN_LEVEL_SIZE)
+	break;
+      level_input[num_levels++] = alnsb_maxflow_restrict_input (prev);
+    }
+  if (! resumed && num_levels < env->segmentation_levels)
+    fprintf (stderr, "[WARNING][segmentation] Using %d resolution levels only\n",
+	     num_levels);
+
+  // Solve from the coarsest level to the finest, each level starting
+  // from the solution of the previous one.
+  s_alnsb_maxflow_t* coarse = NULL;
+  for (l = num_levels - 1; l >= 0; --l)
+    {
+      image3DReal* ut = l ? image3DReal_alloc (level_input[l]->slices,
+					       level_input[l]->rows,
+					       level_input[l]->cols) : *output;
+      s_alnsb_maxflow_t* mf = resumed;
+      if (! mf)
+	mf = alnsb_maxflow_alloc (env, level_input[l], engine);
+      mf->trace = trace;
+      mf->level = l;
+      mf->budget = budget;
+      if (coarse)
+	{
+	  alnsb_maxflow_prolongate (coarse, mf);
+	  footprint = max(footprint, alnsb_maxflow_footprint (coarse) +
+			  alnsb_maxflow_footprint (mf));
+	  alnsb_maxflow_free (coarse);
+	}
+      else if (! resumed)
+	alnsb_maxflow_init (mf);
+
+      // Each level starts its outer loop over, except a resumed
+      // solve. Only the full resolution state is checkpointed.
+      if (! resumed)
+	progress = initial_progress;
+      int start_iter = progress.iter;
+      int start_steps = progress.steps;
+      segmentation_solve_level (env, mf, engine, ut, &progress,
+				l ? NULL : env->segmentation_checkpoint);
+      iter += progress.iter;
+      total_steps += progress.steps;
+      if (progress.steps > start_steps)
+	max_err = mf->max_err;
+      footprint = max(footprint, alnsb_maxflow_footprint (mf));
+      nb_steps += mf->nb_steps;
+      nb_updated += mf->nb_updated;
+      if (env->verbose_level && num_levels > 1)
+	printf ("[INFO] Segmentation level %d (%d x %d x %d): %d outer iterations, %d inner steps\n",
+		l, mf->slices, mf->rows, mf->cols,
+		progress.iter - start_iter, progress.steps - start_steps);
+
+      if (l)
+	{
+	  image3D_free (ut->image3D);
+	  image3D_free (level_input[l]->image3D);
+	}
+      coarse = mf;
+    }
+
+  stats->storage = storage;
+  stats->iter = iter;
+  stats->steps = total_steps;
+  stats->seconds = alnsb_timer_wtime () - start;
+  // Stopped at the deadline. Always logged: the mask is not the
+  // converged one.
+  if (progress.err_c > env->segmentation_errb[1])
+    printf ("[INFO] Segmentation ended early at its %g s deadline: %d outer iterations, %d inner steps, %.3f s, last max_err %g, err_c %g\n",
+	    env->segmentation_deadline, iter, total_steps, stats->seconds,
+	    max_err, progress.err_c);
+
+  if (env->verbose_level)
+    {
+      if (solver == ALNSB_MAXFLOW_SOLVER_PDHG)
+	printf ("[INFO] Segmentation (pdhg solver): %d outer iterations, %d inner steps, %.3f s\n",
+		iter, total_steps, stats->seconds);
+      else
+	printf ("[INFO] Segmentation (cmf solver, %s engine): %d outer iterations, %d inner steps, %.3f s\n",
+		alnsb_maxflow_engine_name (engine), iter, total_steps,
+		stats->seconds);
+      printf ("[INFO] Segmentation solver peak footprint: %.1f MB%s\n",
+	      footprint / (1024.0 * 1024.0),
+	      env->segmentation_lean && ! coarse->divp ? " (lean)" : "");
+      if (engine == ALNSB_SEGMENTATION_ENGINE_NARROWBAND && nb_steps)
+	printf ("[INFO] Segmentation narrow band: %.1f%% of the volume updated per inner step on average\n",
+		100.0 * nb_updated / nb_steps);
+      if (solver == ALNSB_MAXFLOW_SOLVER_PDHG ||
+	  engine == ALNSB_SEGMENTATION_ENGINE_FUSED ||
+	  engine == ALNSB_SEGMENTATION_ENGINE_WAVEFRONT ||
+	  engine == ALNSB_SEGMENTATION_ENGINE_SLICE2D ||
+	  engine == ALNSB_SEGMENTATION_ENGINE_REDBLACK)
+	printf ("[INFO] Segmentation row kernels: %s\n", coarse->kernels->name);
+      if (storage != ALNSB_MAXFLOW_STORAGE_FP32)
+	printf ("[INFO] Segmentation storage: %s flows%s\n",
+		alnsb_maxflow_storage_name (storage),
+		env->segmentation_storage_sources ? ", ps and pt" : "");
+    }
 
   // Free temporaries.
-  ALNSB_REAL3D_free(Cs);
-  ALNSB_REAL3D_free(Ct);
-  ALNSB_REAL3D_free(pp1);
-  ALNSB_REAL3D_free(pp2);
-  ALNSB_REAL3D_free(pp3);
-  ALNSB_REAL3D_free(u);
-  ALNSB_REAL3D_free(divp);
-  ALNSB_REAL3D_free(ps);
-  ALNSB_REAL3D_free(pt);
-  ALNSB_REAL3D_free(gk);
-  ALNSB_REAL3D_free(pts);
-  ALNSB_REAL3D_free(erru);
+  alnsb_maxflow_free (coarse);
+  if (trace)
+    fclose (trace);
+}
+
+
+/**
+ * Agreement of two masks: number of differing voxels, and Dice.
+ *
+ */
+static
+double segmentation_dice (image3DReal* output, image3DReal* ref, size_t* diff)
+{
+  size_t fg = 0, ref_fg = 0, both = 0;
+  size_t i;
+
+  *diff = 0;
+  for (i = 0; i < output->num_pixels; ++i)
+    {
+      int a = output->data[i] > 0.5;
+      int b = ref->data[i] > 0.5;
+      *diff += a != b;
+      fg += a;
+      ref_fg += b;
+      both += a && b;
+    }
+
+  return fg + ref_fg ? 2.0 * both / (fg + ref_fg) : 1.0;
+}
+
+
+/**
+ * Accuracy of the reduced precision storage: solve again with fp32
+ * storage, and compare the masks.
+ *
+ */
+static
+void segmentation_storage_check (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+				 image3DReal* input, image3DReal* output,
+				 int storage)
+{
+  s_alnsb_environment_t ref_env = *env;
+  s_segmentation_stats_t stats;
+  image3DReal* ref;
+  size_t diff;
+
+  ref_env.segmentation_storage = "fp32";
+  ref_env.segmentation_checkpoint = NULL;
+  ref_env.segmentation_trace = NULL;
+  ref_env.segmentation_deadline = 0;
+  ref_env.verbose_level = 0;
+  segmentation_run (&ref_env, input, &ref, &stats);
+
+  double dice = segmentation_dice (output, ref, &diff);
+  printf ("[INFO] Segmentation %s storage: %zu of %zu voxels (%.4f%%) differ from fp32 storage, Dice %.6f\n",
+	  alnsb_maxflow_storage_name (storage), diff, output->num_pixels,
+	  100.0 * diff / output->num_pixels, dice);
+  image3D_free (ref->image3D);
+}
+
+
+/**
+ * Cost and accuracy of the solver: solve again with the cmf solver,
+ * and report its cost and the differences of the masks.
+ *
+ */
+static
+void segmentation_solver_check (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+				image3DReal* input, image3DReal* output,
+				s_segmentation_stats_t* stats)
+{
+  s_alnsb_environment_t ref_env = *env;
+  s_segmentation_stats_t ref_stats;
+  image3DReal* ref;
+  size_t diff;
+
+  ref_env.segmentation_solver = "cmf";
+  ref_env.segmentation_checkpoint = NULL;
+  ref_env.segmentation_trace = NULL;
+  ref_env.segmentation_deadline = 0;
+  ref_env.verbose_level = 0;
+  segmentation_run (&ref_env, input, &ref, &ref_stats);
+
+  double dice = segmentation_dice (output, ref, &diff);
+  printf ("[INFO] Segmentation %s solver: %d outer iterations, %d inner steps, %.3f s\n",
+	  env->segmentation_solver, stats->iter, stats->steps, stats->seconds);
+  printf ("[INFO] Segmentation cmf solver: %d outer iterations, %d inner steps, %.3f s\n",
+	  ref_stats.iter, ref_stats.steps, ref_stats.seconds);
+  printf ("[INFO] Segmentation %s solver: %zu of %zu voxels (%.4f%%) differ from cmf solver, Dice %.6f\n",
+	  env->segmentation_solver, diff, output->num_pixels,
+	  100.0 * diff / output->num_pixels, dice);
+  image3D_free (ref->image3D);
+}
+
+
+/**
+ * Outer iterations saved by the automatic ulab: solve again from the
+ * ulab parameter values, and report both costs and the differences
+ * of the masks.
+ *
+ */
+static
+void segmentation_auto_ulab_check (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+				   image3DReal* input, image3DReal* output,
+				   s_segmentation_stats_t* stats)
+{
+  s_alnsb_environment_t ref_env = *env;
+  s_segmentation_stats_t ref_stats;
+  image3DReal* ref;
+  size_t diff;
+
+  ref_env.segmentation_auto_ulab = 0;
+  ref_env.segmentation_checkpoint = NULL;
+  ref_env.segmentation_trace = NULL;
+  ref_env.segmentation_deadline = 0;
+  ref_env.verbose_level = 0;
+  segmentation_run (&ref_env, input, &ref, &ref_stats);
+
+  double dice = segmentation_dice (output, ref, &diff);
+  printf ("[INFO] Segmentation from the histogram ulab: %d outer iterations, %d inner steps, %.3f s\n",
+	  stats->iter, stats->steps, stats->seconds);
+  printf ("[INFO] Segmentation from ulab[0]=%f, ulab[1]=%f: %d outer iterations, %d inner steps, %.3f s\n",
+	  env->segmentation_ulab[0], env->segmentation_ulab[1],
+	  ref_stats.iter, ref_stats.steps, ref_stats.seconds);
+  printf ("[INFO] Segmentation histogram ulab: %d outer iterations saved, %zu of %zu voxels (%.4f%%) differ, Dice %.6f\n",
+	  ref_stats.iter - stats->iter, diff, output->num_pixels,
+	  100.0 * diff / output->num_pixels, dice);
+  image3D_free (ref->image3D);
+}
+
+
+/**
+ * Fast lung extraction: threshold the input halfway between the class
+ * means, which is the initial u of the solver, without solving. With
+ * --segmentation-auto-ulab the threshold is the Otsu split of the
+ * input histogram instead.
+ *
+ */
+static
+void segmentation_threshold (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+			     image3DReal* __ALNSB_RESTRICT_PTR input,
+			     image3DReal** __ALNSB_RESTRICT_PTR output)
+{
+  float ulab[2] = { env->segmentation_ulab[0], env->segmentation_ulab[1] };
+  float threshold;
+  int otsu = 0;
+  size_t i;
+
+  *output = image3DReal_alloc (input->slices, input->rows, input->cols);
+  if (env->segmentation_auto_ulab)
+    {
+      otsu = alnsb_maxflow_auto_ulab (input, ulab, &threshold);
+      if (! otsu)
+	fprintf (stderr, "[WARNING][segmentation] Constant input, using the ulab parameter values\n");
+    }
+  if (! otsu)
+    threshold = 0.5 * (ulab[0] + ulab[1]);
+  ALNSB_IMAGE_TYPE_REAL* ur = input->data;
+  ALNSB_IMAGE_TYPE_REAL* ut = (*output)->data;
+
+  // The upper class of the Otsu split is above the threshold.
+#pragma omp parallel for
+  for (i = 0; i < input->num_pixels; ++i)
+    if (otsu)
+      ut[i] = ur[i] > threshold;
+    else
+      ut[i] = ulab[0] < ulab[1] ? ur[i] >= threshold : ur[i] <= threshold;
+
+  if (env->verbose_level)
+    printf ("[INFO] Segmentation by threshold at %f%s (fast lung extraction)\n",
+	    threshold, otsu ? ", the Otsu split" : "");
+}
+
+
+/**
+ * Segmentation by the fast lung extraction if fast is set, by the
+ * solver otherwise, whatever --segmentation-fast says.
+ *
+ */
+void segmentation_mode_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+			    image3DReal* __ALNSB_RESTRICT_PTR input,
+			    image3DReal** __ALNSB_RESTRICT_PTR output,
+			    int fast)
+{
+  s_segmentation_stats_t stats;
+
+  if (fast)
+    {
+      segmentation_threshold (env, input, output);
+      return;
+    }
+
+  segmentation_run (env, input, output, &stats);
+
+  if (env->segmentation_storage_check &&
+      stats.storage != ALNSB_MAXFLOW_STORAGE_FP32)
+    segmentation_storage_check (env, input, *output, stats.storage);
+  if (env->segmentation_solver_check)
+    segmentation_solver_check (env, input, *output, &stats);
+  if (env->segmentation_auto_ulab && env->segmentation_auto_ulab_check)
+    segmentation_auto_ulab_check (env, input, *output, &stats);
+}
+
+
+void segmentation_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+		       image3DReal* __ALNSB_RESTRICT_PTR input,
+		       image3DReal** __ALNSB_RESTRICT_PTR output)
+{
+  segmentation_mode_cpu (env, input, output, env->segmentation_fast);
+}
+
+
+/**
+ * State of a volume of a batch: its solver, and the progress of its
+ * outer loop. nsteps counts the inner steps of the current outer
+ * iteration; mf is NULL once the volume has left the batch.
+ *
+ */
+struct segmentation_batch_item
+{
+  s_alnsb_maxflow_t*		mf;
+  s_alnsb_maxflow_progress_t	progress;
+  int				nsteps;
+};
+typedef struct segmentation_batch_item s_segmentation_batch_item_t;
+
+
+/**
+ * Start the next outer iteration of a volume of a batch, or take it
+ * out of the batch if it converged or the deadline is past.
+ *
+ */
+static
+void segmentation_batch_next (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+			      s_segmentation_batch_item_t* item,
+			      image3DReal* output, int i)
+{
+  s_alnsb_maxflow_t* mf = item->mf;
+  s_alnsb_maxflow_progress_t* progress = &item->progress;
+
+  if (progress->err_c > env->segmentation_errb[1] &&
+      ! alnsb_budget_expired (&mf->budget))
+    {
+      if (progress->err_c < env->segmentation_c_convergence)
+	progress->errb = env->segmentation_errb[1];
+      progress->iter++;
+      item->nsteps = 0;
+      return;
+    }
+
+  if (progress->iter == 0)
+    alnsb_maxflow_update_labels (mf, output);
+  if (env->verbose_level)
+    printf ("[INFO] Segmentation batch volume %d (%d x %d x %d): %d outer iterations, %d inner steps%s\n",
+	    i, mf->slices, mf->rows, mf->cols, progress->iter,
+	    progress->steps,
+	    progress->err_c > env->segmentation_errb[1] ? ", stopped at the deadline" : "");
+  alnsb_maxflow_free (mf);
+  item->mf = NULL;
+}
+
+
+/**
+ * Segmentation of n volumes, of any sizes, into outputs[i] (allocated
+ * here). The inner steps of all the volumes run in the same parallel
+ * sweeps of the red-black engine, which keeps the threads busy when
+ * the volumes are small. Each volume has its own class means and
+ * outer loop, as in segmentation_cpu, and leaves the batch once
+ * converged. Each mask is the one segmentation_cpu computes with the
+ * redblack engine; the batch is solved at full resolution only, in a
+ * single process.
+ *
+ */
+void segmentation_batch_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+			     image3DReal** inputs, int n,
+			     image3DReal** outputs)
+{
+  s_segmentation_batch_item_t* items =
+    alnsb_calloc (sizeof(s_segmentation_batch_item_t), n);
+  s_alnsb_maxflow_t** active = alnsb_calloc (sizeof(s_alnsb_maxflow_t*), n);
+  int* active_item = alnsb_calloc (sizeof(int), n);
+  double* err = alnsb_calloc (sizeof(double), n);
+  s_alnsb_maxflow_progress_t initial_progress =
+    { 0, 0, env->segmentation_err_c, env->segmentation_errb[0] };
+  s_alnsb_environment_t item_env = *env;
+  s_alnsb_budget_t budget;
+  double start = alnsb_timer_wtime ();
+  int sweeps = 0;
+  int i, a;
+
+  if (alnsb_maxflow_solver_from_name (env->segmentation_solver) !=
+      ALNSB_MAXFLOW_SOLVER_CMF || env->segmentation_levels > 1 ||
+      env->segmentation_workers > 1 || env->segmentation_checkpoint)
+    fprintf (stderr, "[WARNING][segmentation] Batched segmentation: cmf solver, single level, single process, no checkpoint\n");
+
+  alnsb_budget_start (&budget, env->segmentation_deadline);
+  for (i = 0; i < n; ++i)
+    {
+      float ulab[2];
+      float threshold;
+      outputs[i] = image3DReal_alloc (inputs[i]->slices, inputs[i]->rows,
+				      inputs[i]->cols);
+      item_env.segmentation_ulab[0] = env->segmentation_ulab[0];
+      item_env.segmentation_ulab[1] = env->segmentation_ulab[1];
+      if (env->segmentation_auto_ulab &&
+	  alnsb_maxflow_auto_ulab (inputs[i], ulab, &threshold))
+	{
+	  item_env.segmentation_ulab[0] = ulab[0];
+	  item_env.segmentation_ulab[1] = ulab[1];
+	}
+      items[i].mf = alnsb_maxflow_alloc (&item_env, inputs[i],
+					 ALNSB_SEGMENTATION_ENGINE_REDBLACK);
+      items[i].mf->budget = budget;
+      alnsb_maxflow_init (items[i].mf);
+      items[i].progress = initial_progress;
+      segmentation_batch_next (env, &items[i], outputs[i], i);
+    }
+
+  for (;;)
+    {
+      int num_active = 0;
+      for (i = 0; i < n; ++i)
+	if (items[i].mf)
+	  {
+	    active[num_active] = items[i].mf;
+	    active_item[num_active++] = i;
+	  }
+      if (! num_active)
+	break;
+
+      alnsb_maxflow_redblack_batch_step (active, num_active, err);
+      sweeps++;
+
+      // Volumes whose inner steps converged finish their outer
+      // iteration.
+      for (a = 0; a < num_active; ++a)
+	{
+	  s_segmentation_batch_item_t* item = &items[active_item[a]];
+	  item->nsteps++;
+	  if (err[a] >= item->progress.errb &&
+	      item->nsteps < env->segmentation_max_steps &&
+	      ! alnsb_budget_expired (&item->mf->budget))
+	    continue;
+	  item->progress.steps += item->nsteps;
+	  item->progress.err_c =
+	    alnsb_maxflow_update_labels (item->mf, outputs[active_item[a]]);
+	  segmentation_batch_next (env, item, outputs[active_item[a]],
+				   active_item[a]);
+	}
+    }
+
+  if (env->verbose_level)
+    printf ("[INFO] Segmentation batch of %d volumes: %d sweeps, %.3f s\n",
+	    n, sweeps, alnsb_timer_wtime () - start);
+
+  free (items);
+  free (active);
+  free (active_item);
+  free (err);
 }
@@ -29,6 +29,17 @@ void segmentation_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
 		       image3DReal* __ALNSB_RESTRICT_PTR input,
 		       image3DReal** __ALNSB_RESTRICT_PTR output);
 
+extern
+void segmentation_mode_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+			    image3DReal* __ALNSB_RESTRICT_PTR input,
+			    image3DReal** __ALNSB_RESTRICT_PTR output,
+			    int fast);
+
+extern
+void segmentation_batch_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+			     image3DReal** inputs, int n,
+			     image3DReal** outputs);
+
 
 
 
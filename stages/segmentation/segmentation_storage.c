@@ -0,0 +1,353 @@
+/**
+ * segmentation_storage.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Reduced precision storage of the solver state.
+ *
+ * The flows pp1, pp2 and pp3 (and ps and pt on request) can be stored
+ * as 16-bit fp16 or bfloat16 values, all arithmetic being done in
+ * fp32 on planes decoded on the fly. Values are rounded to nearest
+ * even when stored. A packed volume replaces its image3DReal in the
+ * solver state, which is then NULL: code that is not aware of the
+ * storage accesses the volumes plane by plane, through
+ * alnsb_maxflow_plane_load and alnsb_maxflow_plane_store.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stages/segmentation/segmentation_solver.h>
+#include <utilities/memfuncs.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define ALNSB_STORAGE_F16C
+# include <immintrin.h>
+#endif
+
+
+static const char* storage_names[] = { "fp32", "fp16", "bf16", NULL };
+
+
+int alnsb_maxflow_storage_from_name (char* name)
+{
+  int i;
+  if (name == NULL)
+    return ALNSB_MAXFLOW_STORAGE_FP32;
+  for (i = 0; storage_names[i] != NULL; ++i)
+    if (! strcmp (name, storage_names[i]))
+      return i;
+  fprintf (stderr, "[ERROR][segmentation] Unknown storage format '%s'\n",
+	   name);
+  exit (1);
+}
+
+
+char* alnsb_maxflow_storage_name (int storage)
+{
+  return (char*) storage_names[storage];
+}
+
+
+static inline
+uint32_t float_bits (float f)
+{
+  uint32_t x;
+  memcpy (&x, &f, sizeof(x));
+  return x;
+}
+
+static inline
+float bits_float (uint32_t x)
+{
+  float f;
+  memcpy (&f, &x, sizeof(f));
+  return f;
+}
+
+
+/**
+ * fp32 <-> fp16, with round to nearest even, subnormals, infinities
+ * and NaNs (F. Giesen's branch-light conversions).
+ *
+ */
+static inline
+uint16_t fp16_pack (float f)
+{
+  uint32_t x = float_bits (f);
+  uint32_t sign = x & 0x80000000u;
+  uint32_t o;
+
+  x ^= sign;
+  if (x >= (127u + 16) << 23)
+    // Overflow to infinity, or NaN.
+    o = x > 0x7f800000u ? 0x7e00 : 0x7c00;
+  else if (x < 113u << 23)
+    // Subnormal or 0: let the FPU round the mantissa.
+    o = float_bits (bits_float (x) + bits_float (126u << 23)) - (126u << 23);
+  else
+    {
+      uint32_t odd = (x >> 13) & 1;
+      x += ((uint32_t) (15 - 127) << 23) + 0xfff + odd;
+      o = x >> 13;
+    }
+
+  return o | (sign >> 16);
+}
+
+static inline
+float fp16_unpack (uint16_t h)
+{
+  uint32_t o = (uint32_t) (h & 0x7fff) << 13;
+  uint32_t exp = o & (0x7c00u << 13);
+
+  o += (uint32_t) (127 - 15) << 23;
+  if (exp == 0x7c00u << 13)
+    o += (uint32_t) (128 - 16) << 23;
+  else if (exp == 0)
+    o = float_bits (bits_float (o + (1u << 23)) - bits_float (113u << 23));
+
+  return bits_float (o | (uint32_t) (h & 0x8000) << 16);
+}
+
+
+/**
+ * fp32 <-> bfloat16: the upper half of the float, rounded to nearest
+ * even. The solver values are finite, NaNs are not preserved.
+ *
+ */
+static inline
+uint16_t bf16_pack (float f)
+{
+  uint32_t x = float_bits (f);
+  return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static inline
+float bf16_unpack (uint16_t h)
+{
+  return bits_float ((uint32_t) h << 16);
+}
+
+
+#ifdef ALNSB_STORAGE_F16C
+/**
+ * Same as fp16_pack/fp16_unpack, with the F16C conversions. n must
+ * be a multiple of 8.
+ *
+ */
+static __attribute__((target("avx,f16c")))
+void f16c_pack (size_t n, const ALNSB_IMAGE_TYPE_REAL* in, uint16_t* out)
+{
+  size_t i;
+  for (i = 0; i < n; i += 8)
+    _mm_storeu_si128 ((__m128i*) (out + i),
+		      _mm256_cvtps_ph (_mm256_loadu_ps (in + i),
+				       _MM_FROUND_TO_NEAREST_INT));
+}
+
+static __attribute__((target("avx,f16c")))
+void f16c_unpack (size_t n, const uint16_t* in, ALNSB_IMAGE_TYPE_REAL* out)
+{
+  size_t i;
+  for (i = 0; i < n; i += 8)
+    _mm256_storeu_ps (out + i,
+		      _mm256_cvtph_ps (_mm_loadu_si128 ((__m128i*) (in + i))));
+}
+#endif
+
+
+static
+void storage_pack (int storage, size_t n, const ALNSB_IMAGE_TYPE_REAL* in,
+		   uint16_t* out)
+{
+  size_t i = 0;
+
+  if (storage == ALNSB_MAXFLOW_STORAGE_BF16)
+    {
+      for (i = 0; i < n; ++i)
+	out[i] = bf16_pack (in[i]);
+      return;
+    }
+#ifdef ALNSB_STORAGE_F16C
+  if (__builtin_cpu_supports ("f16c"))
+    {
+      i = n & ~(size_t) 7;
+      f16c_pack (i, in, out);
+    }
+#endif
+  for (; i < n; ++i)
+    out[i] = fp16_pack (in[i]);
+}
+
+
+static
+void storage_unpack (int storage, size_t n, const uint16_t* in,
+		     ALNSB_IMAGE_TYPE_REAL* out)
+{
+  size_t i = 0;
+
+  if (storage == ALNSB_MAXFLOW_STORAGE_BF16)
+    {
+      for (i = 0; i < n; ++i)
+	out[i] = bf16_unpack (in[i]);
+      return;
+    }
+#ifdef ALNSB_STORAGE_F16C
+  if (__builtin_cpu_supports ("f16c"))
+    {
+      i = n & ~(size_t) 7;
+      f16c_unpack (i, in, out);
+    }
+#endif
+  for (; i < n; ++i)
+    out[i] = fp16_unpack (in[i]);
+}
+
+
+image3DReal** alnsb_maxflow_volume (s_alnsb_maxflow_t* mf, int vol)
+{
+  image3DReal** vols[] = { &mf->u, &mf->ps, &mf->pt, &mf->pp1, &mf->pp2,
+			   &mf->pp3 };
+  return vols[vol];
+}
+
+
+/**
+ * Planes of the volume vol: rows x cols, and their number.
+ *
+ */
+static
+void volume_shape (s_alnsb_maxflow_t* mf, int vol, int* planes, int* rows,
+		   int* cols)
+{
+  *planes = mf->slices + (vol == ALNSB_MAXFLOW_VOL_PP3);
+  *rows = mf->rows + (vol == ALNSB_MAXFLOW_VOL_PP2);
+  *cols = mf->cols + (vol == ALNSB_MAXFLOW_VOL_PP1);
+}
+
+
+size_t alnsb_maxflow_plane_size (s_alnsb_maxflow_t* mf, int vol)
+{
+  int planes, rows, cols;
+  volume_shape (mf, vol, &planes, &rows, &cols);
+  return (size_t) rows * cols;
+}
+
+
+/**
+ * Allocate the volume vol of the solver state, zero-initialized. It
+ * is packed if packed is set and the storage of mf is not fp32.
+ *
+ */
+void alnsb_maxflow_volume_alloc (s_alnsb_maxflow_t* mf, int vol, int packed)
+{
+  int planes, rows, cols;
+  volume_shape (mf, vol, &planes, &rows, &cols);
+
+  if (packed && mf->storage != ALNSB_MAXFLOW_STORAGE_FP32)
+    mf->packed[vol] = alnsb_calloc (sizeof(uint16_t),
+				    (size_t) planes * rows * cols);
+  else
+    *alnsb_maxflow_volume (mf, vol) = image3DReal_alloc (planes, rows, cols);
+}
+
+
+/**
+ * Plane z of the volume vol, in fp32: a pointer into the volume if it
+ * is not packed, else buf (of alnsb_maxflow_plane_size elements),
+ * where the plane is decoded.
+ *
+ */
+ALNSB_IMAGE_TYPE_REAL* alnsb_maxflow_plane_load (s_alnsb_maxflow_t* mf,
+						 int vol, int z,
+						 ALNSB_IMAGE_TYPE_REAL* buf)
+{
+  size_t plane = alnsb_maxflow_plane_size (mf, vol);
+
+  if (! mf->packed[vol])
+    return (*alnsb_maxflow_volume (mf, vol))->data + z * plane;
+  storage_unpack (mf->storage, plane, mf->packed[vol] + z * plane, buf);
+
+  return buf;
+}
+
+
+/**
+ * Write back plane z of the volume vol from data, which is either
+ * the pointer returned by alnsb_maxflow_plane_load or any buffer.
+ *
+ */
+void alnsb_maxflow_plane_store (s_alnsb_maxflow_t* mf, int vol, int z,
+				ALNSB_IMAGE_TYPE_REAL* data)
+{
+  size_t plane = alnsb_maxflow_plane_size (mf, vol);
+
+  if (mf->packed[vol])
+    storage_pack (mf->storage, plane, data, mf->packed[vol] + z * plane);
+  else
+    {
+      ALNSB_IMAGE_TYPE_REAL* dst =
+	(*alnsb_maxflow_volume (mf, vol))->data + z * plane;
+      if (dst != data)
+	memcpy (dst, data, plane * sizeof(ALNSB_IMAGE_TYPE_REAL));
+    }
+}
+
+
+/**
+ * Set the volume vol to 0.
+ *
+ */
+void alnsb_maxflow_volume_clear (s_alnsb_maxflow_t* mf, int vol)
+{
+  int planes, rows, cols;
+  volume_shape (mf, vol, &planes, &rows, &cols);
+  size_t sz = (size_t) planes * rows * cols;
+
+  // 0 is all zero bits in all the formats.
+  if (mf->packed[vol])
+    memset (mf->packed[vol], 0, sz * sizeof(uint16_t));
+  else
+    memset ((*alnsb_maxflow_volume (mf, vol))->data, 0,
+	    sz * sizeof(ALNSB_IMAGE_TYPE_REAL));
+}
+
+
+/**
+ * Convert the packed volumes of mf to fp32 volumes.
+ *
+ */
+void alnsb_maxflow_unpack (s_alnsb_maxflow_t* mf)
+{
+  int vol;
+
+  for (vol = 0; vol < ALNSB_MAXFLOW_NUM_VOLS; ++vol)
+    if (mf->packed[vol])
+      {
+	int planes, rows, cols;
+	volume_shape (mf, vol, &planes, &rows, &cols);
+	image3DReal* img = image3DReal_alloc (planes, rows, cols);
+	storage_unpack (mf->storage, img->num_pixels, mf->packed[vol],
+			img->data);
+	free (mf->packed[vol]);
+	mf->packed[vol] = NULL;
+	*alnsb_maxflow_volume (mf, vol) = img;
+      }
+  mf->storage = ALNSB_MAXFLOW_STORAGE_FP32;
+}
@@ -25,45 +25,19 @@
 #include <toolbox/floodfill.h>
 #include <toolbox/dilate.h>
 #include <toolbox/erode.h>
+#include <toolbox/morphology.h>
 #include <toolbox/structuring_elements.h>
 #include <toolbox/bwconncomp.h>
 
-static
-void get_two_largest_comp (int* comp_sz, int nb_comp, int* idx1, int* idx2)
-{
-  int m1 = 0;
-  int id1 = -1;
-  int id2 = -1;
-  int i;
-  // Get the largest.
-  for (i = 0; i < nb_comp; ++i)
-    {
-      if (m1 < comp_sz[i])
-	{
-	  m1 = comp_sz[i];
-	  id1 = i;
-	}
-    }
-  // Get the 2nd largest.
-  m1 = 0;
-  for (i = 0; i < nb_comp; ++i)
-    {
-      if (i == id1)
-	continue;
-      if (m1 < comp_sz[i])
-	{
-	  m1 = comp_sz[i];
-	  id2 = i;
-	}
-    }
-  *idx1 = id1;
-  *idx2 = id2;
-}
-
-
-void segmentationMask_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
-			   image3DReal* __ALNSB_RESTRICT_PTR input,
-			   image3DBin** __ALNSB_RESTRICT_PTR output)
+/**
+ * Segmentation mask of input into *output (allocated here). The two
+ * largest air components, the lungs, are described in *lungs.
+ *
+ */
+void segmentationMask_lungs_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+				 image3DReal* __ALNSB_RESTRICT_PTR input,
+				 image3DBin** __ALNSB_RESTRICT_PTR output,
+				 s_segmentationMask_lungs_t* lungs)
 {
   // Allocate output data.
   *output = image3DBin_alloc (input->slices, input->rows, input->cols);
@@ -88,42 +62,42 @@ void segmentationMask_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
   for (i = 0; i < sz; ++i)
     output_mask1d[i] = (seg_image1d[i] != 0);
 
-  // floodfill2d(output_mask) on all 2D slices
-  ALNSB_IMAGE_TYPE_BIN* ptr1 = output_mask1d;
-  for (i = 0; i < heights; ++i)
+  // floodfill2d(output_mask) on all 2D slices, or floodfill3d if
+  // asked.
+  int seeds = env->segmentationMask_imfill_border ?
+    ALNSB_IMFILL_SEED_BORDER : ALNSB_IMFILL_SEED_CORNERS;
+  if (env->segmentationMask_imfill_3d)
     {
-      ALNSB_2Dslice_from_Bin1D(slice2d, ptr1, rows, cols);
-      alnsb_inplace_imfill_bin2d (rows, cols, slice2d);
-      ptr1 += rows * cols;
+      s_alnsb_imfill_ws_t* ws = alnsb_imfill_ws_alloc (sz);
+      alnsb_imfill_bin3d (heights, rows, cols, output_mask1d, seeds, ws);
+      alnsb_imfill_ws_free (ws);
+    }
+  else
+    {
+#pragma omp parallel
+      {
+	s_alnsb_imfill_ws_t* ws = alnsb_imfill_ws_alloc (rows * cols);
+	int z;
+#pragma omp for schedule(dynamic)
+	for (z = 0; z < heights; ++z)
+	  alnsb_imfill_bin2d (rows, cols,
+			      output_mask1d + (size_t) z * rows * cols,
+			      seeds, ws);
+	alnsb_imfill_ws_free (ws);
+      }
     }
 
   // output_mask1d = seg_image1d && output_mask1d
   for (i = 0; i < sz; ++i)
     output_mask1d[i] = output_mask1d[i] == 0 ? 0 : seg_image1d[i] == 0;
 
-  // Collect all 3D objects.
-  int** comp_coordinates = NULL;
-  int* comp_sz = NULL;
-  int nbcomp = 0;
-  int* mask = NULL;
-  alnsb_bwconncomp_bin (output_mask1d, heights, rows, cols,
-		       &comp_coordinates, &comp_sz, &nbcomp, &mask, 1);
-  
   // Keep only the two largest 3D objects in the mask.
-  int idx1, idx2;
-  get_two_largest_comp (comp_sz, nbcomp, &idx1, &idx2);
-  for (i = 0; i < sz; ++i)
-    output_mask1d[i] = 0;
-  if (idx1 >= 0)
-    for (i = 0; i < comp_sz[idx1]; ++i)
-      output_mask1d[comp_coordinates[idx1][i]] = 1;
-  if (idx2 >= 0)
-    for (i = 0; i < comp_sz[idx2]; ++i)
-      output_mask1d[comp_coordinates[idx2][i]] = 1;
-  for (i = 0; i < nbcomp; ++i)
-    free (comp_coordinates[i]);
-  free (comp_coordinates);
-  free (comp_sz);
+  int lung_sz[2];
+  alnsb_bwconncomp_bin_topk (output_mask1d, heights, rows, cols, 2, lung_sz,
+			     NULL, output_mask1d, 1);
+  lungs->size[0] = lung_sz[0];
+  lungs->size[1] = lung_sz[1];
+  lungs->voxels = sz;
 
 
   // Proceed each 2D slice of the mask independently, and perform:
@@ -131,47 +105,52 @@ void segmentationMask_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
   //   - closing
   //   - erode
   //   - take 2 largest objects, keep 1st, and 2nd if sz(2nd) > .3 * sz(1st)
-
-  /* #pragma omp parallel for */
-  for (i = 0; i < heights; ++i)
-    {
-      ALNSB_IMAGE_TYPE_BIN* ptrval = output_mask1d;
-      ptrval += (i * rows * cols);
-      int** comp_coordinatesL = NULL;
-      int* comp_szL = NULL;
-      int nbcompL = 0;
-      int* maskL = NULL;
-      ALNSB_2Dslice_from_Bin1D(im2d, ptrval, rows, cols);
-      alnsb_inplace_imfill_bin2d (rows, cols, im2d);
-      alnsb_inplace_dilate_bin2d (ptrval, rows, cols, SE_2D_diamond_5);
-      alnsb_inplace_erode_bin2d (ptrval, rows, cols, SE_2D_diamond_5);
-      alnsb_inplace_erode_bin2d (ptrval, rows, cols, SE_2D_diamond_2);
-
-      alnsb_bwconncomp_bin (ptrval, 1, rows, cols,
-			    &comp_coordinatesL, &comp_szL, &nbcompL, NULL, 1);
-      if (nbcomp > 0)
-      	{
-      	  int idx1, idx2;
-      	  get_two_largest_comp (comp_szL, nbcompL, &idx1, &idx2);
-      	  float total1 = (float)comp_szL[idx1] / ((float)rows*cols);
-      	  for (j = 0; j < rows * cols; ++j)
-      	    output_mask1d[i*rows*cols + j] = 0;
-      	  if (idx1 >= 0)
-      	    for (j = 0; j < comp_szL[idx1]; ++j)
-      	      output_mask1d[i*rows*cols + comp_coordinatesL[idx1][j]] = 1;
-      	  if (idx2 >= 0)
-      	    {
-      	      float total2 = (float)comp_szL[idx2] / ((float)rows*cols);
-      	      if ((total1 / total2) < 3)
-      		for (j = 0; j < comp_szL[idx2]; ++j)
-      		  output_mask1d[i*rows*cols + comp_coordinatesL[idx2][j]] = 1;
-      	    }
-      	}
-      for (j = 0; j < nbcompL; ++j)
-      	free (comp_coordinatesL[j]);
-      free (comp_coordinatesL);
-      free (comp_szL);
-    }
+  // The slices are processed in parallel. The closing and erosion run
+  // as one sequence on the bit-packed slice, each thread ping-ponging
+  // between its own two packed slices.
+  s_alnsb_morpho_op_t cleanup[] = {
+    { ALNSB_MORPHO_DILATE, SE_2D_diamond_5 },
+    { ALNSB_MORPHO_ERODE, SE_2D_diamond_5 },
+    { ALNSB_MORPHO_ERODE, SE_2D_diamond_2 } };
+  int nb_cleanup = sizeof(cleanup) / sizeof(cleanup[0]);
+  size_t packed_sz = (size_t) rows * alnsb_morpho_packed_words (cols);
+#pragma omp parallel
+  {
+    ALNSB_IMAGE_TYPE_BIN* work = (ALNSB_IMAGE_TYPE_BIN*)
+      malloc (sizeof(ALNSB_IMAGE_TYPE_BIN) * rows * cols);
+    uint64_t* packed = (uint64_t*) malloc (2 * sizeof(uint64_t) * packed_sz);
+    uint64_t* packed2 = packed + packed_sz;
+    int* rank = (int*) malloc (sizeof(int) * rows * cols);
+    s_alnsb_imfill_ws_t* ws = alnsb_imfill_ws_alloc (rows * cols);
+    int z;
+#pragma omp for schedule(dynamic)
+    for (z = 0; z < heights; ++z)
+      {
+	ALNSB_IMAGE_TYPE_BIN* ptrval = output_mask1d;
+	ptrval += ((size_t) z * rows * cols);
+	unsigned int l;
+	alnsb_imfill_bin2d (rows, cols, ptrval, seeds, ws);
+	alnsb_morpho_pack_bin2d (ptrval, packed, rows, cols);
+	uint64_t* closed = alnsb_morpho_packed_sequence (packed, packed2,
+							 rows, cols,
+							 cleanup, nb_cleanup);
+	alnsb_morpho_unpack_bin2d (closed, work, rows, cols);
+
+	// Keep the largest object, and the second one if it is more
+	// than a third of the first.
+	int szL[2];
+	alnsb_bwconncomp_bin_topk (work, 1, rows, cols, 2, szL, rank, NULL, 1);
+	float total1 = (float)szL[0] / ((float)rows*cols);
+	float total2 = (float)szL[1] / ((float)rows*cols);
+	int keep2 = szL[1] > 0 && (total1 / total2) < 3;
+	for (l = 0; l < rows * cols; ++l)
+	  ptrval[l] = rank[l] == 1 || (rank[l] == 2 && keep2);
+      }
+    free (work);
+    free (packed);
+    free (rank);
+    alnsb_imfill_ws_free (ws);
+  }
 
   // Apply mask to input to form output binary image.
   for (i = 0; i < sz; ++i)
@@ -182,13 +161,46 @@ void segmentationMask_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
   // Free temporary mask.
   ALNSB_BIN1D_free(output_mask1d);
 
-  // Remove first and last 4 slices, if asked.
+  // Remove first and last 4 slices of the full volume, if asked (the
+  // input may be cropped).
   if (env->segmentationMask_skip_4_slices)
     {
-      unsigned int slice4 = rows * cols * 4;
-      for (i = 0; i < slice4; ++i)
-  	output_image1d[i] = 0;
-      for (i = sz - slice4; i < sz; ++i)
-  	output_image1d[i] = 0;
+      size_t z0 = env->crop_lo[0];
+      size_t nz = env->crop_full[0] ? env->crop_full[0] : heights;
+      for (i = 0; i < heights; ++i)
+	if (z0 + i < 4 || z0 + i + 4 >= nz)
+	  for (j = 0; j < rows * cols; ++j)
+	    output_image1d[i * rows * cols + j] = 0;
     }
 }
+
+
+void segmentationMask_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+			   image3DReal* __ALNSB_RESTRICT_PTR input,
+			   image3DBin** __ALNSB_RESTRICT_PTR output)
+{
+  s_segmentationMask_lungs_t lungs;
+
+  segmentationMask_lungs_cpu (env, input, output, &lungs);
+}
+
+
+/**
+ * Sanity check of the lungs, for the fast lung extraction: together
+ * they must fill a plausible fraction of the volume, and the smaller
+ * one must not be negligible (both lungs found, not merged with the
+ * outside air or split). Returns 1 if the lungs pass the check.
+ *
+ */
+int segmentationMask_lungs_check (s_alnsb_environment_t* env,
+				  s_segmentationMask_lungs_t* lungs)
+{
+  double fraction = (double) (lungs->size[0] + lungs->size[1]) /
+    lungs->voxels;
+  double balance = lungs->size[0] ?
+    (double) lungs->size[1] / lungs->size[0] : 0;
+
+  return fraction >= env->segmentation_fast_lungs[0] &&
+    fraction <= env->segmentation_fast_lungs[1] &&
+    balance >= env->segmentation_fast_balance;
+}
@@ -24,11 +24,35 @@
 # include <utilities/environment.h>
 
 
+/**
+ * Lungs found by the segmentation mask: the two largest 3D air
+ * components inside the body, in voxels (0 if absent), and the
+ * number of voxels of the volume.
+ *
+ */
+struct segmentationMask_lungs
+{
+  size_t		size[2];
+  size_t		voxels;
+};
+typedef struct segmentationMask_lungs s_segmentationMask_lungs_t;
+
+
 extern
 void segmentationMask_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
 			   image3DReal* __ALNSB_RESTRICT_PTR input,
 			   image3DBin** __ALNSB_RESTRICT_PTR output);
 
+extern
+void segmentationMask_lungs_cpu (s_alnsb_environment_t* __ALNSB_RESTRICT_PTR env,
+				 image3DReal* __ALNSB_RESTRICT_PTR input,
+				 image3DBin** __ALNSB_RESTRICT_PTR output,
+				 s_segmentationMask_lungs_t* lungs);
+
+extern
+int segmentationMask_lungs_check (s_alnsb_environment_t* env,
+				  s_segmentationMask_lungs_t* lungs);
+
 
 
 
@@ -47,53 +47,29 @@ void* protected_malloc(unsigned int sz)
 }
 
 /**
- * Emulates bwconncomp(im, 18) for a 3D image of size dim1 x dim2 x dim3.
- *
- * returns (through pass-by-reference on addresses of NULL pointers,
- * if NULL is passed this output is not generated):
- *
- * - components_coordinates, an array int[num_components+1][...] with,
-      in each row 'i', the position of each pixel belonging to
-      component 'i'
- * - components_size, an array int[num_components+1] with
-      in each row 'i', the number of pixels in the component.
- * - num_components, the number of connected components.
- * - labeled_image, the integer image with the component id for each
- * non-zero pixel in the input image.
- *
+ * Labels of the connected components of in_data into out_data, by
+ * propagation of the smallest label of the neighborhood until nothing
+ * changes. The labels are not consecutive; returns the largest one
+ * plus 1.
  *
  */
-
-
 static
-void alnsb_bwconncomp_bin_safe (ALNSB_IMAGE_TYPE_BIN* in_data,
-			       int dim1, int dim2, int dim3,
-			       int*** components_coordinates,
-			       int** components_size,
-			       int* num_components,
-			      int** labeled_image,
-			       int use_full_neighb)
+int label_safe (ALNSB_IMAGE_TYPE_BIN* in_data,
+		int dim1, int dim2, int dim3,
+		int* out_data,
+		int use_full_neighb)
 {
-  /* printf ("start bwconncomp\n"); */
   int debug = 0;
   unsigned int i, j, k;
   unsigned int sz = dim1 * dim2 * dim3;
 
-  int* out_data =
-    (int*) protected_malloc (sizeof(ALNSB_IMAGE_TYPE_BIN) * sz);
   int (*out3d)[dim2][dim3] =
     (int (*)[dim2][dim3])out_data;
   ALNSB_IMAGE_TYPE_BIN (*im3d)[dim2][dim3] =
     (ALNSB_IMAGE_TYPE_BIN (*)[dim2][dim3])in_data;
 
-  int* parts = (int*) protected_malloc (sizeof(int) * sz);
-  int* relabel = (int*) protected_malloc (sizeof(int) * sz);
-
   for (i = 0; i < sz; ++i)
-    {
-      out_data[i] = 0;
-      parts[i] = 0;
-    }
+    out_data[i] = 0;
   unsigned int label_cnt = 1;
   int not_converged;
   unsigned int ii, jj, kk;
@@ -277,6 +253,49 @@ void alnsb_bwconncomp_bin_safe (ALNSB_IMAGE_TYPE_BIN* in_data,
     }
   while (not_converged);
 
+  return curr_comp;
+}
+
+
+/**
+ * Emulates bwconncomp(im, 18) for a 3D image of size dim1 x dim2 x dim3.
+ *
+ * The outputs are built from the label image out_data (freed here),
+ * the components being numbered in the increasing order of their
+ * labels.
+ *
+ * returns (through pass-by-reference on addresses of NULL pointers,
+ * if NULL is passed this output is not generated):
+ *
+ * - components_coordinates, an array int[num_components+1][...] with,
+      in each row 'i', the position of each pixel belonging to
+      component 'i'
+ * - components_size, an array int[num_components+1] with
+      in each row 'i', the number of pixels in the component.
+ * - num_components, the number of connected components.
+ * - labeled_image, the integer image with the component id for each
+ * non-zero pixel in the input image.
+ *
+ *
+ */
+
+
+static
+void bwconncomp_output (int* out_data, unsigned int sz,
+			int*** components_coordinates,
+			int** components_size,
+			int* num_components,
+			int** labeled_image)
+{
+  int debug = 0;
+  unsigned int i;
+
+  int* parts = (int*) protected_malloc (sizeof(int) * sz);
+  int* relabel = (int*) protected_malloc (sizeof(int) * sz);
+
+  for (i = 0; i < sz; ++i)
+    parts[i] = 0;
+
   int num_labels = 0;
   int num_bg = 0;
   for (i = 0; i < sz; ++i)
@@ -375,22 +394,262 @@ void alnsb_bwconncomp_bin_safe (ALNSB_IMAGE_TYPE_BIN* in_data,
 
 
 
+/**
+ * Root of the label l, with path halving.
+ *
+ */
+static inline
+int uf_find (int* parent, int l)
+{
+  while (parent[l] != l)
+    {
+      parent[l] = parent[parent[l]];
+      l = parent[l];
+    }
+  return l;
+}
+
+
+/**
+ * Union of the sets of the labels a and b (both non-zero), the root
+ * being the smaller label. Returns the root.
+ *
+ */
+static inline
+int uf_union (int* parent, int a, int b)
+{
+  a = uf_find (parent, a);
+  b = uf_find (parent, b);
+  if (a < b)
+    {
+      parent[b] = a;
+      return a;
+    }
+  parent[a] = b;
+  return b;
+}
+
+
+/**
+ * Two-pass union-find labeling of in_data into out_data, with the
+ * given connectivity: 4 or 8 if dim1 is 1 (a 2D image), 6, 18 or 26
+ * otherwise. Returns the number of components, labeled 1 to n.
+ *
+ * The first pass gives each pixel the label of an already scanned
+ * neighbor, uniting the labels of the others, or a new label. The
+ * neighbors are tested by a decision tree. In the slice, the pixel
+ * above is 8-adjacent to the three other scanned neighbors, so when
+ * it is set they are already in its set, and at most one union is
+ * done in the slice. In the previous slice, the pixel below is
+ * adjacent to all the others (for 18 and 26), so when it is set it
+ * is the only one united; otherwise each set neighbor is, that is up
+ * to 4 unions for 18 and 8 for 26.
+ * The second pass numbers the components in the order of their first
+ * pixel in the blocked traversal of label_safe, so that the component
+ * ids, and the outputs of alnsb_bwconncomp_bin, are the same as with
+ * label_safe when it converges.
+ *
+ */
+static
+int label_fast (ALNSB_IMAGE_TYPE_BIN* in_data,
+		int dim1, int dim2, int dim3,
+		int* out_data,
+		int connectivity)
+{
+  unsigned int sz = dim1 * dim2 * dim3;
+  ALNSB_IMAGE_TYPE_BIN (*im3d)[dim2][dim3] =
+    (ALNSB_IMAGE_TYPE_BIN (*)[dim2][dim3])in_data;
+  int (*out3d)[dim2][dim3] = (int (*)[dim2][dim3])out_data;
+  int* parent = (int*) protected_malloc (sizeof(int) * (sz + 1));
+  int plane8 = connectivity == 8 || connectivity == 18 ||
+    connectivity == 26;
+  int nb_labels = 0;
+  int i, j, k, di, dj;
+
+  // First pass.
+  for (i = 0; i < dim1; ++i)
+    for (j = 0; j < dim2; ++j)
+      for (k = 0; k < dim3; ++k)
+	{
+	  if (im3d[i][j][k] == 0)
+	    {
+	      out3d[i][j][k] = 0;
+	      continue;
+	    }
+	  int up = j > 0 ? out3d[i][j-1][k] : 0;
+	  int left = k > 0 ? out3d[i][j][k-1] : 0;
+	  int upl = plane8 && j > 0 && k > 0 ? out3d[i][j-1][k-1] : 0;
+	  int upr = plane8 && j > 0 && k < dim3 - 1 ? out3d[i][j-1][k+1] : 0;
+	  int l = 0;
+
+	  // Neighbors in the slice.
+	  if (up)
+	    {
+	      l = up;
+	      if (! plane8 && left)
+		l = uf_union (parent, l, left);
+	    }
+	  else if (upr)
+	    {
+	      l = upr;
+	      if (upl)
+		l = uf_union (parent, l, upl);
+	      else if (left)
+		l = uf_union (parent, l, left);
+	    }
+	  else if (upl)
+	    l = upl;
+	  else if (left)
+	    l = left;
+
+	  // Neighbors in the previous slice.
+	  if (i > 0 && dim1 > 1)
+	    {
+	      int below = out3d[i-1][j][k];
+	      if (below)
+		l = l ? uf_union (parent, l, below) : below;
+	      else if (connectivity != 6)
+		for (dj = -1; dj <= 1; ++dj)
+		  for (di = -1; di <= 1; ++di)
+		    {
+		      int nj = j + dj, nk = k + di;
+		      if (nj < 0 || nj >= dim2 || nk < 0 || nk >= dim3)
+			continue;
+		      if (connectivity == 18 && dj != 0 && di != 0)
+			continue;
+		      int n = out3d[i-1][nj][nk];
+		      if (n)
+			l = l ? uf_union (parent, l, n) : n;
+		    }
+	    }
+
+	  if (l == 0)
+	    {
+	      l = ++nb_labels;
+	      parent[l] = l;
+	    }
+	  out3d[i][j][k] = l;
+	}
+
+  // Second pass: flatten the sets (the roots being the smallest
+  // labels), number the roots in the blocked order of label_safe,
+  // then relabel.
+  int* number = (int*) protected_malloc (sizeof(int) * (nb_labels + 1));
+  int l, n = 0;
+  unsigned int x;
+  int ii, jj, kk;
+  int BS = 32;
+  for (l = 1; l <= nb_labels; ++l)
+    parent[l] = parent[parent[l]];
+  for (ii = 0; ii < dim1/BS + 1; ++ii)
+    for (jj = 0; jj < dim2/BS + 1; ++jj)
+      for (kk = 0; kk < dim3/BS + 1; ++kk)
+	for (i = ii*BS; i < min((ii+1)*BS,dim1); ++i)
+	  for (j = jj*BS; j < min((jj+1)*BS,dim2); ++j)
+	    for (k = kk*BS; k < min((kk+1)*BS,dim3); ++k)
+	      {
+		int r = parent[out3d[i][j][k]];
+		if (out3d[i][j][k] && number[r] == 0)
+		  number[r] = ++n;
+	      }
+  for (x = 0; x < sz; ++x)
+    if (out_data[x])
+      out_data[x] = number[parent[out_data[x]]];
+
+  free (number);
+  free (parent);
+
+  return n;
+}
+
+
+/**
+ * Connectivity of the use_full_neighb flag of alnsb_bwconncomp_bin: 8
+ * in 2D, 26 or 18 in 3D.
+ *
+ */
 static
+int bwconncomp_connectivity (int dim1, int use_full_neighb)
+{
+  if (dim1 == 1)
+    return 8;
+  return use_full_neighb ? 26 : 18;
+}
+
+
+/**
+ * Reference implementation, by propagation of the labels; kept for
+ * validation.
+ *
+ */
+void alnsb_bwconncomp_bin_safe (ALNSB_IMAGE_TYPE_BIN* in_data,
+				int dim1, int dim2, int dim3,
+				int*** components_coordinates,
+				int** components_size,
+				int* num_components,
+				int** labeled_image,
+				int use_full_neighb)
+{
+  unsigned int sz = dim1 * dim2 * dim3;
+  int* out_data = (int*) protected_malloc (sizeof(int) * sz);
+
+  label_safe (in_data, dim1, dim2, dim3, out_data, use_full_neighb);
+  bwconncomp_output (out_data, sz, components_coordinates, components_size,
+		     num_components, labeled_image);
+}
+
+
+/**
+ * Two-pass union-find implementation.
+ *
+ */
 void alnsb_bwconncomp_bin_fast (ALNSB_IMAGE_TYPE_BIN* in_data,
-			       int dim1, int dim2, int dim3,
-			       int*** components_coordinates,
-			       int** components_size,
-			       int* num_components,
-			       int** labeled_image,
-			       int use_full_neighb)
+				int dim1, int dim2, int dim3,
+				int*** components_coordinates,
+				int** components_size,
+				int* num_components,
+				int** labeled_image,
+				int use_full_neighb)
 {
-  /// FIXME: port from dev branch.
+  unsigned int sz = dim1 * dim2 * dim3;
+  int* out_data = (int*) protected_malloc (sizeof(int) * sz);
+
+  label_fast (in_data, dim1, dim2, dim3, out_data,
+	      bwconncomp_connectivity (dim1, use_full_neighb));
+  bwconncomp_output (out_data, sz, components_coordinates, components_size,
+		     num_components, labeled_image);
+}
 
 
+/**
+ * Labels 1 to n of the connected components of in_data into
+ * labeled_image, an int image of its size, with the given
+ * connectivity (4 or 8 in 2D, that is if dim1 is 1, 6, 18 or 26 in
+ * 3D). Returns n.
+ *
+ */
+int alnsb_bwconncomp_bin_labels (ALNSB_IMAGE_TYPE_BIN* in_data,
+				 int dim1, int dim2, int dim3,
+				 int connectivity,
+				 int* labeled_image)
+{
+  if (dim1 == 1 ? connectivity != 4 && connectivity != 8 :
+      connectivity != 6 && connectivity != 18 && connectivity != 26)
+    {
+      fprintf (stderr, "[ERROR][bwconncomp] Unsupported connectivity %d "
+	       "for a %s image\n", connectivity, dim1 == 1 ? "2D" : "3D");
+      exit (1);
+    }
 
+  return label_fast (in_data, dim1, dim2, dim3, labeled_image, connectivity);
 }
 
 
+/**
+ * The two-pass labeling is the default; build with
+ * -DALNSB_BWCONNCOMP_SAFE to use the propagation instead.
+ *
+ */
 void alnsb_bwconncomp_bin (ALNSB_IMAGE_TYPE_BIN* in_data,
 			  int dim1, int dim2, int dim3,
 			  int*** components_coordinates,
@@ -399,10 +658,101 @@ void alnsb_bwconncomp_bin (ALNSB_IMAGE_TYPE_BIN* in_data,
 			  int** labeled_image,
 			  int use_full_neighb)
 {
-  /* alnsb_bwconncomp_bin_fast (in_data, dim1, dim2, dim3, components_coordinates, */
-  /* 			    components_size, num_components, labeled_image, */
-  /* 			    use_full_neighb); */
+#ifdef ALNSB_BWCONNCOMP_SAFE
   alnsb_bwconncomp_bin_safe (in_data, dim1, dim2, dim3, components_coordinates,
-  			    components_size, num_components, labeled_image,
-  			    use_full_neighb);
+			     components_size, num_components, labeled_image,
+			     use_full_neighb);
+#else
+  alnsb_bwconncomp_bin_fast (in_data, dim1, dim2, dim3, components_coordinates,
+			     components_size, num_components, labeled_image,
+			     use_full_neighb);
+#endif
+}
+
+
+/**
+ * Connected components of in_data, keeping only the k largest: no
+ * coordinate list is built. Returns the number of components.
+ *
+ * - sizes, an array int[k], receives the sizes of the k largest
+ *   components, largest first (0 if there are fewer components). Ties
+ *   are ranked as by the component ids of alnsb_bwconncomp_bin.
+ * - labeled_image, if not NULL, an int image of the size of in_data,
+ *   receives the rank (1 to k) of the component of each pixel among
+ *   the k largest, 0 elsewhere.
+ * - mask, if not NULL, a binary image of the size of in_data (which it
+ *   may be), receives 1 on the k largest components, 0 elsewhere.
+ *
+ */
+int alnsb_bwconncomp_bin_topk (ALNSB_IMAGE_TYPE_BIN* in_data,
+			       int dim1, int dim2, int dim3,
+			       int k,
+			       int* sizes,
+			       int* labeled_image,
+			       ALNSB_IMAGE_TYPE_BIN* mask,
+			       int use_full_neighb)
+{
+  unsigned int sz = dim1 * dim2 * dim3;
+  int* out_data = (int*) protected_malloc (sizeof(int) * sz);
+  int* top = (int*) protected_malloc (sizeof(int) * k);
+#ifdef ALNSB_BWCONNCOMP_SAFE
+  int nb_labels = label_safe (in_data, dim1, dim2, dim3, out_data,
+			      use_full_neighb);
+#else
+  int nb_labels = label_fast (in_data, dim1, dim2, dim3, out_data,
+			      bwconncomp_connectivity (dim1, use_full_neighb))
+    + 1;
+#endif
+  int* count = (int*) protected_malloc (sizeof(int) * nb_labels);
+  int num_components = 0;
+  unsigned int i;
+  int l, r, s;
+
+  // Sizes of the components, then the k largest, in label order.
+  for (i = 0; i < sz; ++i)
+    if (out_data[i])
+      ++count[out_data[i]];
+  for (r = 0; r < k; ++r)
+    {
+      sizes[r] = 0;
+      top[r] = 0;
+    }
+  for (l = 1; l < nb_labels; ++l)
+    {
+      if (count[l] == 0)
+	continue;
+      ++num_components;
+      for (r = 0; r < k && count[l] <= sizes[r]; ++r)
+	;
+      if (r == k)
+	continue;
+      for (s = k - 1; s > r; --s)
+	{
+	  sizes[s] = sizes[s - 1];
+	  top[s] = top[s - 1];
+	}
+      sizes[r] = count[l];
+      top[r] = l;
+    }
+
+  // count now maps the labels to their rank.
+  for (l = 0; l < nb_labels; ++l)
+    count[l] = 0;
+  for (r = 0; r < k; ++r)
+    if (top[r])
+      count[top[r]] = r + 1;
+  for (i = 0; i < sz; ++i)
+    {
+      int rank = out_data[i] ? count[out_data[i]] : 0;
+      if (labeled_image)
+	labeled_image[i] = rank;
+      if (mask)
+	mask[i] = rank != 0;
+    }
+
+  free (count);
+  free (top);
+  free (out_data);
+
+  return num_components;
 }
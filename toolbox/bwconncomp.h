@@ -31,4 +31,37 @@ void alnsb_bwconncomp_bin(ALNSB_IMAGE_TYPE_BIN* in_data,
 			  int** labeled_image,
 			  int use_full_neighb);
 
+extern
+void alnsb_bwconncomp_bin_safe(ALNSB_IMAGE_TYPE_BIN* in_data,
+			       int dim1, int dim2, int dim3,
+			       int*** components_coordinates,
+			       int** components_size,
+			       int* num_components,
+			       int** labeled_image,
+			       int use_full_neighb);
+
+extern
+void alnsb_bwconncomp_bin_fast(ALNSB_IMAGE_TYPE_BIN* in_data,
+			       int dim1, int dim2, int dim3,
+			       int*** components_coordinates,
+			       int** components_size,
+			       int* num_components,
+			       int** labeled_image,
+			       int use_full_neighb);
+
+extern
+int alnsb_bwconncomp_bin_labels(ALNSB_IMAGE_TYPE_BIN* in_data,
+				int dim1, int dim2, int dim3,
+				int connectivity,
+				int* labeled_image);
+
+extern
+int alnsb_bwconncomp_bin_topk(ALNSB_IMAGE_TYPE_BIN* in_data,
+			      int dim1, int dim2, int dim3,
+			      int k,
+			      int* sizes,
+			      int* labeled_image,
+			      ALNSB_IMAGE_TYPE_BIN* mask,
+			      int use_full_neighb);
+
 #endif // !ALNSB_TOOLBOX_BWCONNCOMP_H
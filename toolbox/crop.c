@@ -0,0 +1,129 @@
+/**
+ * crop.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+#include <string.h>
+#include <toolbox/crop.h>
+#include <utilities/memfuncs.h>
+
+
+/**
+ * Bounding box of the occupied part of a FP image: [lo, hi) in
+ * (slices, rows, cols), enlarged by margin voxels in each direction
+ * and clipped to the image.
+ *
+ * Returns 0 (and the whole image as box) if no voxel is above
+ * threshold.
+ *
+ */
+int alnsb_bounding_box_real_img (image3DReal* __ALNSB_RESTRICT_PTR img,
+				 ALNSB_IMAGE_TYPE_REAL threshold,
+				 int margin, size_t lo[3], size_t hi[3])
+{
+  size_t dims[3] = { img->slices, img->rows, img->cols };
+  size_t m = margin > 0 ? margin : 0;
+  size_t* count[3];
+  size_t i, j, k, d;
+
+  ALNSB_IMRealTo3D(img, im3D);
+
+  // Number of voxels above threshold per slice, row and col.
+  for (d = 0; d < 3; ++d)
+    count[d] = alnsb_calloc (sizeof(size_t), dims[d]);
+  for (i = 0; i < dims[0]; ++i)
+    for (j = 0; j < dims[1]; ++j)
+      for (k = 0; k < dims[2]; ++k)
+	if (im3D[i][j][k] > threshold)
+	  {
+	    count[0][i]++;
+	    count[1][j]++;
+	    count[2][k]++;
+	  }
+
+  int found = 1;
+  for (d = 0; d < 3; ++d)
+    {
+      size_t min_count =
+	ALNSB_CROP_MIN_OCCUPANCY * (img->num_pixels / dims[d]);
+      if (min_count == 0)
+	min_count = 1;
+      for (lo[d] = 0; lo[d] < dims[d] && count[d][lo[d]] < min_count; ++lo[d])
+	;
+      for (hi[d] = dims[d]; hi[d] > lo[d] && count[d][hi[d] - 1] < min_count; --hi[d])
+	;
+      if (lo[d] == hi[d])
+	found = 0;
+      lo[d] = lo[d] > m ? lo[d] - m : 0;
+      hi[d] = hi[d] + m < dims[d] ? hi[d] + m : dims[d];
+      free (count[d]);
+    }
+
+  if (! found)
+    for (d = 0; d < 3; ++d)
+      {
+	lo[d] = 0;
+	hi[d] = dims[d];
+      }
+
+  return found;
+}
+
+
+/**
+ * Extract the sub-volume [lo, hi) of an image, of any type.
+ *
+ */
+image3D* alnsb_crop_img (image3D* img, size_t lo[3], size_t hi[3])
+{
+  image3D* ret = image3D_alloc (hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2],
+				img->image_type);
+  char* src = img->data;
+  char* dst = ret->data;
+  size_t line = ret->cols * img->pixel_sz;
+  size_t i, j;
+
+  for (i = 0; i < ret->slices; ++i)
+    for (j = 0; j < ret->rows; ++j)
+      memcpy (dst + ((i * ret->rows + j) * ret->cols) * img->pixel_sz,
+	      src + (((lo[0] + i) * img->rows + lo[1] + j) * img->cols + lo[2])
+	      * img->pixel_sz, line);
+
+  return ret;
+}
+
+
+/**
+ * Place a cropped image back at position lo in a zero image of size
+ * full (slices, rows, cols).
+ *
+ */
+image3D* alnsb_uncrop_img (image3D* img, size_t lo[3], size_t full[3])
+{
+  image3D* ret = image3D_alloc (full[0], full[1], full[2], img->image_type);
+  char* src = img->data;
+  char* dst = ret->data;
+  size_t line = img->cols * img->pixel_sz;
+  size_t i, j;
+
+  for (i = 0; i < img->slices; ++i)
+    for (j = 0; j < img->rows; ++j)
+      memcpy (dst + (((lo[0] + i) * ret->rows + lo[1] + j) * ret->cols + lo[2])
+	      * img->pixel_sz,
+	      src + ((i * img->rows + j) * img->cols) * img->pixel_sz, line);
+
+  return ret;
+}
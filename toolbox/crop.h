@@ -0,0 +1,45 @@
+/**
+ * crop.h: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+
+#ifndef ALNSB_TOOLBOX_CROP_H
+# define ALNSB_TOOLBOX_CROP_H
+
+# include <utilities/images.h>
+
+/**
+ * A slice/row/col of the volume is considered occupied if at least
+ * this fraction of its voxels are above the threshold.
+ *
+ */
+#define ALNSB_CROP_MIN_OCCUPANCY 0.001
+
+extern
+int alnsb_bounding_box_real_img (image3DReal* __ALNSB_RESTRICT_PTR img,
+				 ALNSB_IMAGE_TYPE_REAL threshold,
+				 int margin, size_t lo[3], size_t hi[3]);
+
+extern
+image3D* alnsb_crop_img (image3D* img, size_t lo[3], size_t hi[3]);
+
+extern
+image3D* alnsb_uncrop_img (image3D* img, size_t lo[3], size_t full[3]);
+
+
+
+#endif // !ALNSB_TOOLBOX_CROP_H
@@ -17,7 +17,10 @@
  *
  */
 
+#include <string.h>
+
 #include <toolbox/dilate.h>
+#include <toolbox/morphology.h>
 #include <toolbox/structuring_elements.h>
 
 
@@ -61,13 +64,41 @@ void dilate_im (ALNSB_IMAGE_TYPE_BIN* im, ALNSB_IMAGE_TYPE_BIN* out_im, int dim1
 
 
 
+/**
+ * Dilation of im2d by structelt into out2d, through the decomposition
+ * of the SE when it has one (see morphology.c), by a scan of the SE
+ * otherwise. scratch is an image of the same size, or NULL if the
+ * SE has no decomposition. Nothing is allocated, so the slices of a
+ * volume can be processed in parallel.
+ *
+ */
+void alnsb_dilate_bin2d(ALNSB_IMAGE_TYPE_BIN* im2d,
+			ALNSB_IMAGE_TYPE_BIN* out2d,
+			ALNSB_IMAGE_TYPE_BIN* scratch,
+			int rows, int cols,
+			int structelt)
+{
+  int square, diamond;
+
+  if (scratch && alnsb_morpho_decompose (structelt, &square, &diamond))
+    alnsb_morpho_decomposed_bin2d (im2d, out2d, scratch, rows, cols,
+				   square, diamond, ALNSB_MORPHO_DILATE);
+  else
+    {
+      memset (out2d, 0, sizeof(ALNSB_IMAGE_TYPE_BIN) * rows * cols);
+      dilate_im (im2d, out2d, rows, cols, structelt);
+    }
+}
+
+
 void alnsb_inplace_dilate_bin2d(ALNSB_IMAGE_TYPE_BIN* im2d,
 				int rows, int cols,
 				int structelt)
 {
   ALNSB_IMAGE_TYPE_BIN* out =
-    (ALNSB_IMAGE_TYPE_BIN*) malloc (sizeof(ALNSB_IMAGE_TYPE_BIN) * rows * cols);
-  dilate_im (im2d, out, rows, cols, structelt);
+    (ALNSB_IMAGE_TYPE_BIN*) calloc (2 * rows * cols,
+				    sizeof(ALNSB_IMAGE_TYPE_BIN));
+  alnsb_dilate_bin2d (im2d, out, out + rows * cols, rows, cols, structelt);
   int i;
   for (i = 0; i < rows * cols; ++i)
     im2d[i] = out[i];
@@ -22,6 +22,13 @@
 
 # include <utilities/images.h>
 
+extern
+void alnsb_erode_bin2d(ALNSB_IMAGE_TYPE_BIN* im2d,
+		       ALNSB_IMAGE_TYPE_BIN* out2d,
+		       ALNSB_IMAGE_TYPE_BIN* scratch,
+		       int rows, int cols,
+		       int structelt);
+
 extern
 void alnsb_inplace_erode_bin2d(ALNSB_IMAGE_TYPE_BIN* im2d,
 			       int rows, int cols,
@@ -17,83 +17,216 @@
  *
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <toolbox/floodfill.h>
 
-struct s_pair {
-  int i;
-  int j;
-};
-typedef struct s_pair s_pair_t;
+/**
+ * Scanline imfill: the background (0) pixels 4-connected (6-connected
+ * in 3D) to the seeds are the outside; every other pixel is set to 1,
+ * which fills the holes. The seeds are the whole border, as for the
+ * imfill of holes, or the two top corners of each slice, as the
+ * pipeline has always done (the outside cut off by the scanner table
+ * then counts as a hole). In the latter mode the fill also reaches the
+ * pixels above and below the wall ending a run on its right, as the
+ * queue fill this replaces did, so that the masks are unchanged.
+ *
+ * Each run of background pixels of a row is marked at once, then
+ * pushed, and its neighbor rows are scanned over its extent for the
+ * runs not reached yet: a pixel is marked once, and a run pushed
+ * once. Nothing is allocated but the growth of the run stack of the
+ * workspace, so the slices of a volume can be filled in parallel, one
+ * workspace per thread.
+ *
+ */
+s_alnsb_imfill_ws_t* alnsb_imfill_ws_alloc(size_t pixels)
+{
+  s_alnsb_imfill_ws_t* ws =
+    (s_alnsb_imfill_ws_t*) malloc (sizeof(s_alnsb_imfill_ws_t));
+  ws->pixels = pixels;
+  ws->reached = (unsigned char*) malloc (pixels);
+  ws->nb_runs = 1024;
+  ws->runs = (int*) malloc (3 * sizeof(int) * ws->nb_runs);
+  if (ws->reached == NULL || ws->runs == NULL)
+    {
+      fprintf (stderr, "[ERROR][imfill] Memory exhausted\n");
+      exit (1);
+    }
 
-static
-void myfloodfill(int startRow, int startCol, int rows, int cols,
-		 ALNSB_IMAGE_TYPE_BIN im[rows][cols],
-		 ALNSB_IMAGE_TYPE_BIN newColor,
-		 ALNSB_IMAGE_TYPE_BIN oldColor)
+  return ws;
+}
+
+
+void alnsb_imfill_ws_free(s_alnsb_imfill_ws_t* ws)
 {
-  if (im[startRow][startCol] != oldColor)
+  if (ws == NULL)
     return;
-  s_pair_t* queue = (s_pair_t*) malloc (sizeof(s_pair_t) * rows*cols);
-  queue[0].i = startRow;
-  queue[0].j = startCol;
-  unsigned int q_get_pos = 0;
-  unsigned int q_push_pos = 1;
-  int qs = rows * cols;
-  while (q_get_pos != q_push_pos)
+  free (ws->reached);
+  free (ws->runs);
+  free (ws);
+}
+
+
+/**
+ * Mark the run of unreached background pixels of row line (the row
+ * index in the volume) containing column k, and push it.
+ *
+ */
+static
+void push_run (ALNSB_IMAGE_TYPE_BIN* im, s_alnsb_imfill_ws_t* ws,
+	       size_t* top, int cols, int line, int k)
+{
+  ALNSB_IMAGE_TYPE_BIN* row = im + (size_t) line * cols;
+  unsigned char* reached = ws->reached + (size_t) line * cols;
+  int l = k, r = k;
+  int j;
+
+  while (l > 0 && row[l - 1] == 0 && ! reached[l - 1])
+    --l;
+  while (r < cols - 1 && row[r + 1] == 0 && ! reached[r + 1])
+    ++r;
+  for (j = l; j <= r; ++j)
+    reached[j] = 1;
+  if (*top == ws->nb_runs)
     {
-      s_pair_t pRC;
-      pRC.i = queue[q_get_pos % qs].i;
-      pRC.j = queue[q_get_pos % qs].j;
-      ++q_get_pos;
-      if (im[pRC.i][pRC.j] == oldColor)
+      ws->nb_runs *= 2;
+      ws->runs = (int*) realloc (ws->runs, 3 * sizeof(int) * ws->nb_runs);
+      if (ws->runs == NULL)
 	{
-	  int leftR = pRC.j;
-	  int rightR = pRC.j;
-	  while (leftR-1 >= 0 && im[pRC.i][leftR-1] == oldColor)
-	    leftR--;
-	  while (rightR+1 < cols && im[pRC.i][rightR] == oldColor)
-	    rightR++;
-	  int j;
-	  for (j = leftR; j <= rightR; ++j)
-	    {
-	      im[pRC.i][j] = newColor;
-	      if (pRC.i-1 >= 0 && im[pRC.i-1][j] == oldColor)
-		{
-		  queue[q_push_pos % qs].i = pRC.i-1;
-		  queue[q_push_pos % qs].j = j;
-		  ++q_push_pos;
-		}
-	      if (pRC.i+1 < cols && im[pRC.i+1][j] == oldColor)
-		{
-		  queue[q_push_pos % qs].i = pRC.i+1;
-		  queue[q_push_pos % qs].j = j;
-		  ++q_push_pos;
-		}
-	    }
+	  fprintf (stderr, "[ERROR][imfill] Memory exhausted\n");
+	  exit (1);
 	}
     }
-  free (queue);
+  ws->runs[3 * *top] = line;
+  ws->runs[3 * *top + 1] = l;
+  ws->runs[3 * *top + 2] = r;
+  ++*top;
+}
+
+
+/**
+ * Push the runs of row line over columns l..r not reached yet.
+ *
+ */
+static
+void scan_row (ALNSB_IMAGE_TYPE_BIN* im, s_alnsb_imfill_ws_t* ws,
+	       size_t* top, int cols, int line, int l, int r)
+{
+  ALNSB_IMAGE_TYPE_BIN* row = im + (size_t) line * cols;
+  unsigned char* reached = ws->reached + (size_t) line * cols;
+  int j;
+
+  for (j = l; j <= r; ++j)
+    if (row[j] == 0 && ! reached[j])
+      push_run (im, ws, top, cols, line, j);
+}
+
+
+static
+void scanline_fill (int slices, int rows, int cols,
+		    ALNSB_IMAGE_TYPE_BIN* im, int seeds,
+		    s_alnsb_imfill_ws_t* ws)
+{
+  size_t sz = (size_t) slices * rows * cols;
+  size_t top = 0;
+  size_t x;
+  int z, i;
+
+  if (ws->pixels < sz)
+    {
+      fprintf (stderr, "[ERROR][imfill] Workspace of %zu pixels, "
+	       "%zu needed\n", ws->pixels, sz);
+      exit (1);
+    }
+  memset (ws->reached, 0, sz);
+
+  // Seeds: the whole border, or the two top corners of each slice.
+  for (z = 0; z < slices; ++z)
+    for (i = 0; i < rows; ++i)
+      {
+	int line = z * rows + i;
+	if (seeds == ALNSB_IMFILL_SEED_CORNERS)
+	  {
+	    if (i == 0)
+	      {
+		scan_row (im, ws, &top, cols, line, 0, 0);
+		scan_row (im, ws, &top, cols, line, cols - 1, cols - 1);
+	      }
+	  }
+	else if (z == 0 || z == slices - 1 || i == 0 || i == rows - 1)
+	  scan_row (im, ws, &top, cols, line, 0, cols - 1);
+	else
+	  {
+	    scan_row (im, ws, &top, cols, line, 0, 0);
+	    scan_row (im, ws, &top, cols, line, cols - 1, cols - 1);
+	  }
+	while (top > 0)
+	  {
+	    --top;
+	    int rl = ws->runs[3 * top];
+	    int l = ws->runs[3 * top + 1];
+	    int r = ws->runs[3 * top + 2];
+	    if (seeds == ALNSB_IMFILL_SEED_CORNERS && r < cols - 1)
+	      ++r;
+	    if (rl % rows > 0)
+	      scan_row (im, ws, &top, cols, rl - 1, l, r);
+	    if (rl % rows < rows - 1)
+	      scan_row (im, ws, &top, cols, rl + 1, l, r);
+	    if (rl / rows > 0)
+	      scan_row (im, ws, &top, cols, rl - rows, l, r);
+	    if (rl / rows < slices - 1)
+	      scan_row (im, ws, &top, cols, rl + rows, l, r);
+	  }
+      }
+
+  for (x = 0; x < sz; ++x)
+    if (! ws->reached[x])
+      im[x] = 1;
+}
+
+
+/**
+ * Fill the holes of the 2D image im in place, the outside being
+ * reached from the seeds ALNSB_IMFILL_SEED_BORDER or
+ * ALNSB_IMFILL_SEED_CORNERS, with the workspace ws of at least rows *
+ * cols pixels.
+ *
+ */
+void alnsb_imfill_bin2d(int rows, int cols, ALNSB_IMAGE_TYPE_BIN* im,
+			int seeds, s_alnsb_imfill_ws_t* ws)
+{
+  scanline_fill (1, rows, cols, im, seeds, ws);
 }
 
 
+/**
+ * Fill the holes of the 3D image im in place, the outside being the
+ * background 6-connected to the seeds (the faces of the volume, or
+ * the two top corners of each slice), with the workspace ws of at
+ * least slices * rows * cols pixels. A region
+ * enclosed in every slice but open through the slices, such as the
+ * lungs through the trachea, is not a hole in 3D.
+ *
+ */
+void alnsb_imfill_bin3d(int slices, int rows, int cols,
+			ALNSB_IMAGE_TYPE_BIN* im, int seeds,
+			s_alnsb_imfill_ws_t* ws)
+{
+  scanline_fill (slices, rows, cols, im, seeds, ws);
+}
+
+
+/**
+ * Fill the holes of the 2D image im in place, the outside being
+ * reached from its two top corners.
+ *
+ */
 void alnsb_inplace_imfill_bin2d(int rows, int cols,
 				ALNSB_IMAGE_TYPE_BIN im[rows][cols])
 {
-  ALNSB_IMAGE_TYPE_BIN newColor = 1;
-  ALNSB_IMAGE_TYPE_BIN oldColor = 0;
-  ALNSB_IMAGE_TYPE_BIN* imcopy =
-    (ALNSB_IMAGE_TYPE_BIN*) malloc (sizeof(ALNSB_IMAGE_TYPE_BIN) * rows * cols);
-  ALNSB_IMAGE_TYPE_BIN (*imcopy2d)[cols] =
-    (ALNSB_IMAGE_TYPE_BIN (*)[cols])imcopy;
-  unsigned int i, j;
-  for (i = 0; i < rows; ++i)
-    for (j = 0; j < cols; ++j)
-      imcopy2d[i][j] = im[i][j];
-  myfloodfill (0, 0, rows, cols, imcopy2d, newColor, oldColor);
-  myfloodfill (0, cols-1, rows, cols, imcopy2d, newColor, oldColor);
-  for (i = 0; i < rows; ++i)
-    for (j = 0; j < cols; ++j)
-      if (imcopy2d[i][j] != 1)
-      	im[i][j] = 1;
-  free (imcopy);
+  s_alnsb_imfill_ws_t* ws = alnsb_imfill_ws_alloc ((size_t) rows * cols);
+  alnsb_imfill_bin2d (rows, cols, &im[0][0], ALNSB_IMFILL_SEED_CORNERS, ws);
+  alnsb_imfill_ws_free (ws);
 }
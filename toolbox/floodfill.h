@@ -27,4 +27,38 @@ extern
 void alnsb_inplace_imfill_bin2d(int rows, int cols,
 				ALNSB_IMAGE_TYPE_BIN im[rows][cols]);
 
+// Seeds of the outside for the scanline imfill.
+# define ALNSB_IMFILL_SEED_BORDER	0
+# define ALNSB_IMFILL_SEED_CORNERS	1
+
+/**
+ * Workspace of the scanline imfill, reusable across calls: the
+ * background reached from the border, and the stack of runs to
+ * process (grown on demand).
+ *
+ */
+struct alnsb_imfill_ws
+{
+  size_t pixels;
+  unsigned char* reached;
+  int* runs;
+  size_t nb_runs;
+};
+typedef struct alnsb_imfill_ws s_alnsb_imfill_ws_t;
+
+extern
+s_alnsb_imfill_ws_t* alnsb_imfill_ws_alloc(size_t pixels);
+
+extern
+void alnsb_imfill_ws_free(s_alnsb_imfill_ws_t* ws);
+
+extern
+void alnsb_imfill_bin2d(int rows, int cols, ALNSB_IMAGE_TYPE_BIN* im,
+			int seeds, s_alnsb_imfill_ws_t* ws);
+
+extern
+void alnsb_imfill_bin3d(int slices, int rows, int cols,
+			ALNSB_IMAGE_TYPE_BIN* im, int seeds,
+			s_alnsb_imfill_ws_t* ws);
+
 #endif // !ALNSB_TOOLBOX_FLOODFILL_H
@@ -0,0 +1,545 @@
+/**
+ * morphology.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+/**
+ * Binary dilation and erosion by decomposed structuring elements.
+ *
+ * The SEs of the table are octagons: the 5x5 one is a diamond, the
+ * 29x29 one a square with cut corners. An octagon of halo h is
+ * {max(|di|,|dj|) <= h, |di| + |dj| <= h + a}, which is the Minkowski
+ * sum of the square of halo a and of the diamond of halo b = h - a.
+ * Dilating (eroding) by it is dilating (eroding) by each of them in
+ * turn. The square is itself a horizontal then a vertical line, whose
+ * passes keep a running count of the set pixels in the window, so
+ * their cost does not depend on a. The diamond of halo b is b
+ * iterations of the 3x3 cross.
+ *
+ * Where the window crosses the image border it is clipped. Only the
+ * pixels whose window fits in the image are kept, the others being
+ * set to 0, as the scan of dilate.c and erode.c does.
+ *
+ * The passes are sequential: the callers process the slices of a
+ * volume in parallel.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <toolbox/morphology.h>
+#include <toolbox/structuring_elements.h>
+
+#undef min
+#undef max
+#define min(x,y) ((x) < (y) ? (x) : (y))
+#define max(x,y) ((x) > (y) ? (x) : (y))
+
+
+/**
+ * Decomposition of structelt as the square of halo *square and the
+ * diamond of halo *diamond. Returns 0 if structelt is not an octagon.
+ *
+ */
+int alnsb_morpho_decompose(int structelt, int* square, int* diamond)
+{
+  int halo = structuringElements[structelt].halo;
+  int width = 2 * halo + 1;
+  const int* se = structuringElements[structelt].se;
+  int a, i, j;
+
+  for (a = 0; a <= halo; ++a)
+    {
+      int match = 1;
+      for (i = 0; i < width && match; ++i)
+	for (j = 0; j < width && match; ++j)
+	  match = (se[i * width + j] != 0) ==
+	    (abs (i - halo) + abs (j - halo) <= halo + a);
+      if (match)
+	{
+	  *square = a;
+	  *diamond = halo - a;
+	  return 1;
+	}
+    }
+
+  return 0;
+}
+
+
+/**
+ * Horizontal line of halo r.
+ *
+ */
+static
+void line_rows (ALNSB_IMAGE_TYPE_BIN* __ALNSB_RESTRICT_PTR im,
+		ALNSB_IMAGE_TYPE_BIN* __ALNSB_RESTRICT_PTR out,
+		int rows, int cols, int r, int op)
+{
+  int i, j;
+
+  for (i = 0; i < rows; ++i)
+    {
+      ALNSB_IMAGE_TYPE_BIN* row = im + (size_t) i * cols;
+      ALNSB_IMAGE_TYPE_BIN* orow = out + (size_t) i * cols;
+      int cnt = 0;
+      for (j = 0; j < r && j < cols; ++j)
+	cnt += row[j] != 0;
+      for (j = 0; j < cols; ++j)
+	{
+	  if (j + r < cols)
+	    cnt += row[j + r] != 0;
+	  int len = min (j + r, cols - 1) - max (j - r, 0) + 1;
+	  orow[j] = op == ALNSB_MORPHO_DILATE ? cnt > 0 : cnt == len;
+	  if (j - r >= 0)
+	    cnt -= row[j - r] != 0;
+	}
+    }
+}
+
+
+/**
+ * Vertical line of halo r, the counts of the columns being updated
+ * row by row.
+ *
+ */
+static
+void line_cols (ALNSB_IMAGE_TYPE_BIN* __ALNSB_RESTRICT_PTR im,
+		ALNSB_IMAGE_TYPE_BIN* __ALNSB_RESTRICT_PTR out,
+		int rows, int cols, int r, int op)
+{
+  ALNSB_IMAGE_TYPE_BIN (*im2d)[cols] = (ALNSB_IMAGE_TYPE_BIN (*)[cols])(im);
+  ALNSB_IMAGE_TYPE_BIN (*out2d)[cols] = (ALNSB_IMAGE_TYPE_BIN (*)[cols])(out);
+  int cnt[cols];
+  int i, j;
+
+  for (j = 0; j < cols; ++j)
+    cnt[j] = 0;
+  for (i = 0; i < r && i < rows; ++i)
+    for (j = 0; j < cols; ++j)
+      cnt[j] += im2d[i][j] != 0;
+  for (i = 0; i < rows; ++i)
+    {
+      if (i + r < rows)
+	for (j = 0; j < cols; ++j)
+	  cnt[j] += im2d[i + r][j] != 0;
+      int len = min (i + r, rows - 1) - max (i - r, 0) + 1;
+      if (op == ALNSB_MORPHO_DILATE)
+	for (j = 0; j < cols; ++j)
+	  out2d[i][j] = cnt[j] > 0;
+      else
+	for (j = 0; j < cols; ++j)
+	  out2d[i][j] = cnt[j] == len;
+      if (i - r >= 0)
+	for (j = 0; j < cols; ++j)
+	  cnt[j] -= im2d[i - r][j] != 0;
+    }
+}
+
+
+/**
+ * 3x3 cross.
+ *
+ */
+static
+void cross (ALNSB_IMAGE_TYPE_BIN* __ALNSB_RESTRICT_PTR im,
+	    ALNSB_IMAGE_TYPE_BIN* __ALNSB_RESTRICT_PTR out,
+	    int rows, int cols, int op)
+{
+  ALNSB_IMAGE_TYPE_BIN (*im2d)[cols] = (ALNSB_IMAGE_TYPE_BIN (*)[cols])(im);
+  ALNSB_IMAGE_TYPE_BIN (*out2d)[cols] = (ALNSB_IMAGE_TYPE_BIN (*)[cols])(out);
+  int i, j;
+
+  for (i = 0; i < rows; ++i)
+    for (j = 0; j < cols; ++j)
+      {
+	int cnt = im2d[i][j] != 0;
+	int len = 1;
+	if (i > 0)
+	  {
+	    cnt += im2d[i - 1][j] != 0;
+	    ++len;
+	  }
+	if (i < rows - 1)
+	  {
+	    cnt += im2d[i + 1][j] != 0;
+	    ++len;
+	  }
+	if (j > 0)
+	  {
+	    cnt += im2d[i][j - 1] != 0;
+	    ++len;
+	  }
+	if (j < cols - 1)
+	  {
+	    cnt += im2d[i][j + 1] != 0;
+	    ++len;
+	  }
+	out2d[i][j] = op == ALNSB_MORPHO_DILATE ? cnt > 0 : cnt == len;
+      }
+}
+
+
+/**
+ * Dilation (op ALNSB_MORPHO_DILATE) or erosion (ALNSB_MORPHO_ERODE)
+ * of im2d by the octagon of the given square and diamond halos, into
+ * out2d. scratch is an image of the same size; the three are
+ * distinct. Nothing is allocated.
+ *
+ */
+void alnsb_morpho_decomposed_bin2d(ALNSB_IMAGE_TYPE_BIN* im2d,
+				   ALNSB_IMAGE_TYPE_BIN* out2d,
+				   ALNSB_IMAGE_TYPE_BIN* scratch,
+				   int rows, int cols,
+				   int square, int diamond, int op)
+{
+  size_t sz = (size_t) rows * cols;
+  int passes = (square > 0 ? 2 : 0) + diamond;
+  int halo = square + diamond;
+  // Ping-pong between out2d and scratch, ending in out2d.
+  ALNSB_IMAGE_TYPE_BIN* src = im2d;
+  ALNSB_IMAGE_TYPE_BIN* dst = passes % 2 ? out2d : scratch;
+  size_t x;
+  int i, k;
+
+  if (passes == 0)
+    for (x = 0; x < sz; ++x)
+      out2d[x] = im2d[x] != 0;
+  if (square > 0)
+    {
+      line_rows (src, dst, rows, cols, square, op);
+      src = dst;
+      dst = dst == out2d ? scratch : out2d;
+      line_cols (src, dst, rows, cols, square, op);
+      src = dst;
+      dst = dst == out2d ? scratch : out2d;
+    }
+  for (k = 0; k < diamond; ++k)
+    {
+      cross (src, dst, rows, cols, op);
+      src = dst;
+      dst = dst == out2d ? scratch : out2d;
+    }
+
+  // Border where the SE does not fit.
+  for (i = 0; i < rows; ++i)
+    {
+      ALNSB_IMAGE_TYPE_BIN* row = out2d + (size_t) i * cols;
+      if (i < halo || i >= rows - halo)
+	memset (row, 0, sizeof(ALNSB_IMAGE_TYPE_BIN) * cols);
+      else
+	for (k = 0; k < halo && k < cols; ++k)
+	  row[k] = row[cols - 1 - k] = 0;
+    }
+}
+
+
+/**
+ * Bit-packed slices: each row is alnsb_morpho_packed_words(cols)
+ * words, pixel j being bit j % 64 of word j / 64. The same passes run
+ * on 64 pixels at a time, as word shifts combined by OR (dilation) or
+ * AND (erosion). The line of halo r is built by doubling: a window of
+ * halo rad combined with its shifts by +/-s has halo rad + s, for any
+ * s <= 2 rad + 1. Bits shifted in from outside the image are 0, which
+ * only affects the border that is zeroed at the end.
+ *
+ */
+int alnsb_morpho_packed_words(int cols)
+{
+  return (cols + ALNSB_MORPHO_WORD_BITS - 1) / ALNSB_MORPHO_WORD_BITS;
+}
+
+
+void alnsb_morpho_pack_bin2d(ALNSB_IMAGE_TYPE_BIN* im2d, uint64_t* packed,
+			     int rows, int cols)
+{
+  int W = alnsb_morpho_packed_words (cols);
+  int i, j;
+
+  memset (packed, 0, sizeof(uint64_t) * rows * W);
+  for (i = 0; i < rows; ++i)
+    {
+      ALNSB_IMAGE_TYPE_BIN* row = im2d + (size_t) i * cols;
+      uint64_t* prow = packed + (size_t) i * W;
+      for (j = 0; j < cols; ++j)
+	prow[j / ALNSB_MORPHO_WORD_BITS] |=
+	  (uint64_t) (row[j] != 0) << (j % ALNSB_MORPHO_WORD_BITS);
+    }
+}
+
+
+void alnsb_morpho_unpack_bin2d(uint64_t* packed, ALNSB_IMAGE_TYPE_BIN* im2d,
+			       int rows, int cols)
+{
+  int W = alnsb_morpho_packed_words (cols);
+  int i, j;
+
+  for (i = 0; i < rows; ++i)
+    {
+      ALNSB_IMAGE_TYPE_BIN* row = im2d + (size_t) i * cols;
+      uint64_t* prow = packed + (size_t) i * W;
+      for (j = 0; j < cols; ++j)
+	row[j] = (prow[j / ALNSB_MORPHO_WORD_BITS] >>
+		  (j % ALNSB_MORPHO_WORD_BITS)) & 1;
+    }
+}
+
+
+/**
+ * Word w of the packed row shifted by s pixels: its pixel j is the
+ * pixel j + s of the row.
+ *
+ */
+static inline
+uint64_t shifted (uint64_t* row, int W, int w, int s)
+{
+  int q, r;
+  uint64_t a, b;
+
+  if (s >= 0)
+    {
+      q = s / ALNSB_MORPHO_WORD_BITS;
+      r = s % ALNSB_MORPHO_WORD_BITS;
+      a = w + q < W ? row[w + q] : 0;
+      if (r == 0)
+	return a;
+      b = w + q + 1 < W ? row[w + q + 1] : 0;
+      return (a >> r) | (b << (ALNSB_MORPHO_WORD_BITS - r));
+    }
+  q = -s / ALNSB_MORPHO_WORD_BITS;
+  r = -s % ALNSB_MORPHO_WORD_BITS;
+  a = w - q >= 0 ? row[w - q] : 0;
+  if (r == 0)
+    return a;
+  b = w - q - 1 >= 0 ? row[w - q - 1] : 0;
+  return (a << r) | (b >> (ALNSB_MORPHO_WORD_BITS - r));
+}
+
+
+#define ALNSB_MORPHO_COMBINE(op, x, y) \
+  ((op) == ALNSB_MORPHO_DILATE ? (x) | (y) : (x) & (y))
+
+
+/**
+ * Packed window {-s, 0, s}, along the rows (dj) or the columns (di).
+ *
+ */
+static
+void packed_pair (uint64_t* __ALNSB_RESTRICT_PTR in,
+		  uint64_t* __ALNSB_RESTRICT_PTR out,
+		  int rows, int W, int di, int dj, int op)
+{
+  int i, w;
+
+  for (i = 0; i < rows; ++i)
+    {
+      uint64_t* row = in + (size_t) i * W;
+      uint64_t* up = i - di >= 0 ? row - (size_t) di * W : NULL;
+      uint64_t* down = i + di < rows ? row + (size_t) di * W : NULL;
+      uint64_t* orow = out + (size_t) i * W;
+      for (w = 0; w < W; ++w)
+	{
+	  uint64_t v = row[w];
+	  if (dj)
+	    {
+	      v = ALNSB_MORPHO_COMBINE(op, v, shifted (row, W, w, dj));
+	      v = ALNSB_MORPHO_COMBINE(op, v, shifted (row, W, w, -dj));
+	    }
+	  if (di && up)
+	    v = ALNSB_MORPHO_COMBINE(op, v, up[w]);
+	  if (di && down)
+	    v = ALNSB_MORPHO_COMBINE(op, v, down[w]);
+	  orow[w] = v;
+	}
+    }
+}
+
+
+/**
+ * Packed scan of an arbitrary SE: each SE entry is a shift of a row,
+ * combined into the output rows where the SE fits.
+ *
+ */
+static
+void packed_scan (uint64_t* __ALNSB_RESTRICT_PTR in,
+		  uint64_t* __ALNSB_RESTRICT_PTR out,
+		  int rows, int W, int structelt, int op)
+{
+  int halo = structuringElements[structelt].halo;
+  int width = 2 * halo + 1;
+  const int* se = structuringElements[structelt].se;
+  int i, ii, jj, w;
+
+  memset (out, 0, sizeof(uint64_t) * rows * W);
+  for (i = halo; i < rows - halo; ++i)
+    {
+      uint64_t* orow = out + (size_t) i * W;
+      for (w = 0; w < W; ++w)
+	orow[w] = op == ALNSB_MORPHO_DILATE ? 0 : ~(uint64_t) 0;
+      for (ii = 0; ii < width; ++ii)
+	{
+	  uint64_t* row = in + (size_t) (i + ii - halo) * W;
+	  for (jj = 0; jj < width; ++jj)
+	    if (se[ii * width + jj])
+	      for (w = 0; w < W; ++w)
+		orow[w] = ALNSB_MORPHO_COMBINE(op, orow[w],
+					       shifted (row, W, w, jj - halo));
+	}
+    }
+}
+
+
+/**
+ * Packed dilation or erosion of src by the octagon of the given square
+ * and diamond halos, or, if structelt >= 0, by a packed scan of that
+ * SE. The passes ping-pong between buf0 and buf1, src being one of
+ * them or a third slice which is not written. Returns the buffer
+ * holding the result.
+ *
+ */
+static
+uint64_t* packed_op (uint64_t* src, uint64_t* buf0, uint64_t* buf1,
+		     int rows, int cols, int structelt,
+		     int square, int diamond, int op)
+{
+  int W = alnsb_morpho_packed_words (cols);
+  int halo = structelt >= 0 ?
+    (int) structuringElements[structelt].halo : square + diamond;
+  uint64_t* dst = src == buf0 ? buf1 : buf0;
+  int i, j, k, rad;
+
+  if (structelt >= 0)
+    {
+      packed_scan (src, dst, rows, W, structelt, op);
+      src = dst;
+    }
+  else if (square == 0 && diamond == 0)
+    {
+      memcpy (dst, src, sizeof(uint64_t) * rows * W);
+      src = dst;
+    }
+  else
+    {
+      for (k = 0; k < 2; ++k)
+	for (rad = 0; rad < square; )
+	  {
+	    int s = min (2 * rad + 1, square - rad);
+	    packed_pair (src, dst, rows, W, k ? s : 0, k ? 0 : s, op);
+	    src = dst;
+	    dst = dst == buf0 ? buf1 : buf0;
+	    rad += s;
+	  }
+      for (k = 0; k < diamond; ++k)
+	{
+	  packed_pair (src, dst, rows, W, 1, 1, op);
+	  src = dst;
+	  dst = dst == buf0 ? buf1 : buf0;
+	}
+    }
+
+  // Border where the SE does not fit, and padding bits.
+  for (i = 0; i < rows; ++i)
+    {
+      uint64_t* row = src + (size_t) i * W;
+      if (i < halo || i >= rows - halo)
+	{
+	  memset (row, 0, sizeof(uint64_t) * W);
+	  continue;
+	}
+      for (j = 0; j < halo && j < cols; ++j)
+	{
+	  row[j / ALNSB_MORPHO_WORD_BITS] &=
+	    ~((uint64_t) 1 << (j % ALNSB_MORPHO_WORD_BITS));
+	  row[(cols - 1 - j) / ALNSB_MORPHO_WORD_BITS] &=
+	    ~((uint64_t) 1 << ((cols - 1 - j) % ALNSB_MORPHO_WORD_BITS));
+	}
+      for (j = cols; j < W * ALNSB_MORPHO_WORD_BITS; ++j)
+	row[j / ALNSB_MORPHO_WORD_BITS] &=
+	  ~((uint64_t) 1 << (j % ALNSB_MORPHO_WORD_BITS));
+    }
+
+  return src;
+}
+
+
+/**
+ * Dilation or erosion of the packed slice in by structelt into out,
+ * through its decomposition when it has one, by a packed scan of the
+ * SE otherwise. scratch is a packed slice; the three are distinct.
+ * Nothing is allocated.
+ *
+ */
+void alnsb_morpho_packed_bin2d(uint64_t* in, uint64_t* out, uint64_t* scratch,
+			       int rows, int cols, int structelt, int op)
+{
+  int square, diamond;
+  uint64_t* res;
+
+  if (alnsb_morpho_decompose (structelt, &square, &diamond))
+    res = packed_op (in, out, scratch, rows, cols, -1, square, diamond, op);
+  else
+    res = packed_op (in, out, scratch, rows, cols, structelt, 0, 0, op);
+  if (res != out)
+    memcpy (out, res,
+	    sizeof(uint64_t) * rows * alnsb_morpho_packed_words (cols));
+}
+
+
+/**
+ * Sequence of nb_ops dilations and erosions of the packed slice in
+ * buf0, ping-ponging between buf0 and buf1 with no copy and no
+ * allocation. Both are overwritten; returns the one holding the
+ * result.
+ *
+ * Adjacent erosions by octagons are fused into one erosion by the sum
+ * of the octagons, that is the square and the diamond of the summed
+ * halos, which saves the border pass and merges the doubling of the
+ * square lines. The border zeroed by the first erosion would have
+ * made the second one zero there too, so the result is the same.
+ * Adjacent dilations are not fused: the second one would spread the
+ * interior into the border zeroed by the first one.
+ *
+ */
+uint64_t* alnsb_morpho_packed_sequence(uint64_t* buf0, uint64_t* buf1,
+				       int rows, int cols,
+				       s_alnsb_morpho_op_t* ops, int nb_ops)
+{
+  uint64_t* cur = buf0;
+  int k;
+
+  for (k = 0; k < nb_ops; ++k)
+    {
+      int op = ops[k].op;
+      int square, diamond, sq, di;
+      if (! alnsb_morpho_decompose (ops[k].structelt, &square, &diamond))
+	{
+	  cur = packed_op (cur, buf0, buf1, rows, cols, ops[k].structelt,
+			   0, 0, op);
+	  continue;
+	}
+      while (op == ALNSB_MORPHO_ERODE && k + 1 < nb_ops &&
+	     ops[k + 1].op == ALNSB_MORPHO_ERODE &&
+	     alnsb_morpho_decompose (ops[k + 1].structelt, &sq, &di))
+	{
+	  square += sq;
+	  diamond += di;
+	  ++k;
+	}
+      cur = packed_op (cur, buf0, buf1, rows, cols, -1, square, diamond, op);
+    }
+
+  return cur;
+}
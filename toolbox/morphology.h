@@ -0,0 +1,75 @@
+/**
+ * morphology.h: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+
+#ifndef ALNSB_TOOLBOX_MORPHOLOGY_H
+# define ALNSB_TOOLBOX_MORPHOLOGY_H
+
+# include <stdint.h>
+
+# include <utilities/images.h>
+
+# define ALNSB_MORPHO_DILATE	0
+# define ALNSB_MORPHO_ERODE	1
+
+// Pixels per word of a bit-packed slice.
+# define ALNSB_MORPHO_WORD_BITS	64
+
+extern
+int alnsb_morpho_decompose(int structelt, int* square, int* diamond);
+
+extern
+void alnsb_morpho_decomposed_bin2d(ALNSB_IMAGE_TYPE_BIN* im2d,
+				   ALNSB_IMAGE_TYPE_BIN* out2d,
+				   ALNSB_IMAGE_TYPE_BIN* scratch,
+				   int rows, int cols,
+				   int square, int diamond, int op);
+
+extern
+int alnsb_morpho_packed_words(int cols);
+
+extern
+void alnsb_morpho_pack_bin2d(ALNSB_IMAGE_TYPE_BIN* im2d, uint64_t* packed,
+			     int rows, int cols);
+
+extern
+void alnsb_morpho_unpack_bin2d(uint64_t* packed, ALNSB_IMAGE_TYPE_BIN* im2d,
+			       int rows, int cols);
+
+extern
+void alnsb_morpho_packed_bin2d(uint64_t* in, uint64_t* out, uint64_t* scratch,
+			       int rows, int cols, int structelt, int op);
+
+/**
+ * One operation of a morphology sequence: ALNSB_MORPHO_DILATE or
+ * ALNSB_MORPHO_ERODE by the SE structelt of the table.
+ *
+ */
+struct alnsb_morpho_op
+{
+  int op;
+  int structelt;
+};
+typedef struct alnsb_morpho_op s_alnsb_morpho_op_t;
+
+extern
+uint64_t* alnsb_morpho_packed_sequence(uint64_t* buf0, uint64_t* buf1,
+				       int rows, int cols,
+				       s_alnsb_morpho_op_t* ops, int nb_ops);
+
+#endif // !ALNSB_TOOLBOX_MORPHOLOGY_H
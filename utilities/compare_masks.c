@@ -0,0 +1,118 @@
+/**
+ * compare_masks.c: this file is part of the ALNSB project.
+ *
+ * ALNSB: the Adaptive Lung Nodule Screening Benchmark
+ *
+ * Copyright (C) 2014,2015 University of California Los Angeles
+ *
+ * This program can be redistributed and/or modified under the terms
+ * of the license specified in the LICENSE.txt file at the root of the
+ * project.
+ *
+ * Contact: Alex Bui <buia@mii.ucla.edu>
+ *
+ */
+/**
+ * Written by: Shiwen Shen, Prashant Rawat, Louis-Noel Pouchet and William Hsu
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static
+float* read_mask (char* filename, size_t nb_pix)
+{
+  FILE* f = fopen (filename, "r");
+  if (f == NULL)
+    {
+      printf ("[ERROR] File %s cannot be opened\n", filename);
+      exit (1);
+    }
+  float* data = (float*) malloc (sizeof(float) * nb_pix);
+  size_t nb_elts_read = fread (data, sizeof(float), nb_pix, f);
+  fclose (f);
+  if (nb_elts_read != nb_pix)
+    {
+      printf ("[ERROR] read %zu pixels from %s, expected %zu\n",
+	      nb_elts_read, filename, nb_pix);
+      exit (1);
+    }
+
+  return data;
+}
+
+
+static
+double dice (size_t both, size_t a, size_t b)
+{
+  return a + b ? 2.0 * both / (a + b) : 1.0;
+}
+
+
+/**
+ * Compare two binary masks (raw/float format, voxels > 0.5 are in the
+ * mask), for instance the segmentation of the per-slice engine
+ * against the one of a 3D engine.
+ *
+ */
+int main(int argc, char** argv)
+{
+  if (argc != 5)
+    {
+      printf ("Usage: %s <mask.dat> <reference.dat> <nb_slices> <nb_pix_per_slice>\n",
+	      argv[0]);
+      printf ("=> Reports the agreement of two binary masks in raw/float format\n");
+      exit (1);
+    }
+
+  size_t slices = atoi (argv[3]);
+  size_t plane = atoi (argv[4]);
+  if (slices == 0 || plane == 0)
+    {
+      printf ("[ERROR] Nb slices and pixels cannot be 0\n");
+      exit (1);
+    }
+  size_t nb_pix = slices * plane;
+  float* mask = read_mask (argv[1], nb_pix);
+  float* ref = read_mask (argv[2], nb_pix);
+
+  size_t diff = 0, fg = 0, ref_fg = 0, both = 0;
+  size_t worst = 0;
+  double worst_dice = 1.0;
+  size_t i, z;
+  for (z = 0; z < slices; ++z)
+    {
+      size_t s_fg = 0, s_ref_fg = 0, s_both = 0;
+      for (i = z * plane; i < (z + 1) * plane; ++i)
+	{
+	  int a = mask[i] > 0.5;
+	  int b = ref[i] > 0.5;
+	  diff += a != b;
+	  s_fg += a;
+	  s_ref_fg += b;
+	  s_both += a && b;
+	}
+      if (dice (s_both, s_fg, s_ref_fg) < worst_dice)
+	{
+	  worst_dice = dice (s_both, s_fg, s_ref_fg);
+	  worst = z;
+	}
+      fg += s_fg;
+      ref_fg += s_ref_fg;
+      both += s_both;
+    }
+
+  printf ("[CompareMasks] %zu of %zu voxels (%.4f%%) differ\n", diff, nb_pix,
+	  100.0 * diff / nb_pix);
+  printf ("[CompareMasks] Mask: %zu voxels, reference: %zu voxels, both: %zu voxels\n",
+	  fg, ref_fg, both);
+  printf ("[CompareMasks] Dice: %.6f, lowest slice Dice: %.6f (slice %zu)\n",
+	  dice (both, fg, ref_fg), worst_dice, worst);
+
+  free (mask);
+  free (ref);
+
+  return 0;
+}
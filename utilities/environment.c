@@ -44,6 +44,9 @@ s_alnsb_environment_t* alnsb_environment_malloc ()
 
   env->thresold_upperBand = 80;
   env->thresold_lowerBand = 0;
+  env->crop_body = 0;
+  env->crop_threshold = 0.25;
+  env->crop_margin = 32;
   env->segmentation_lp = 1e-13;
   env->segmentation_errb[0] = 1e-1;
   env->segmentation_errb[1] = 5e-4;
@@ -57,6 +60,34 @@ s_alnsb_environment_t* alnsb_environment_malloc ()
   env->segmentation_err_c = 1;
   env->segmentation_max_err = 0.0;
   env->segmentation_max_steps = 300;
+  env->segmentation_engine = "fused";
+  env->segmentation_time_tile = 4;
+  env->segmentation_lean = 0;
+  env->segmentation_levels = 1;
+  env->segmentation_checkpoint = NULL;
+  env->segmentation_nb_band = 0.05;
+  env->segmentation_nb_tol = 1e-5;
+  env->segmentation_nb_revalidate = 10;
+  env->segmentation_workers = 1;
+  env->segmentation_isa = "auto";
+  env->segmentation_storage = "fp32";
+  env->segmentation_storage_sources = 0;
+  env->segmentation_storage_check = 0;
+  env->segmentation_solver = "cmf";
+  env->segmentation_pd_tau = 1;
+  env->segmentation_pd_sigma = 0.08;
+  env->segmentation_solver_check = 0;
+  env->segmentation_auto_ulab = 0;
+  env->segmentation_auto_ulab_check = 0;
+  env->segmentation_trace = NULL;
+  env->segmentation_deadline = 0;
+  env->segmentation_fast = 0;
+  env->segmentation_fast_lungs[0] = 0.02;
+  env->segmentation_fast_lungs[1] = 0.6;
+  env->segmentation_fast_balance = 0.25;
+
+  env->segmentationMask_imfill_3d = 0;
+  env->segmentationMask_imfill_border = 0;
 
   env->preselection_diameterMin = 5;
   env->preselection_diameterMax = 30;
@@ -72,6 +72,21 @@ struct alnsb_environment {
   double		thresold_upperBand;
   double		thresold_lowerBand;
 
+  // Cropping to the body bounding box, after levelscale. The margin
+  // must cover twice the halo of the closing in segmentationMask
+  // (14). The segmentation solve still differs from the uncropped
+  // one: the class means and the residual are computed over the
+  // sub-volume.
+  int			crop_body;
+  double		crop_threshold;
+  int			crop_margin;
+  // Internal use only: the passes after levelscale work on the
+  // sub-volume [crop_lo, crop_hi) of a volume of size crop_full
+  // (slices, rows, cols). crop_full is 0 if no cropping is done.
+  size_t		crop_lo[3];
+  size_t		crop_hi[3];
+  size_t		crop_full[3];
+
   // Segmentation info.
   double		segmentation_lp;
   double		segmentation_errb[2];
@@ -83,9 +98,35 @@ struct alnsb_environment {
   double		segmentation_err_c;
   double		segmentation_max_err;
   int			segmentation_max_steps;
+  char*			segmentation_engine;
+  int			segmentation_time_tile;
+  int			segmentation_lean;
+  int			segmentation_levels;
+  char*			segmentation_checkpoint;
+  double		segmentation_nb_band;
+  double		segmentation_nb_tol;
+  int			segmentation_nb_revalidate;
+  int			segmentation_workers;
+  char*			segmentation_isa;
+  char*			segmentation_storage;
+  int			segmentation_storage_sources;
+  int			segmentation_storage_check;
+  char*			segmentation_solver;
+  double		segmentation_pd_tau;
+  double		segmentation_pd_sigma;
+  int			segmentation_solver_check;
+  int			segmentation_auto_ulab;
+  int			segmentation_auto_ulab_check;
+  char*			segmentation_trace;
+  double		segmentation_deadline;
+  int			segmentation_fast;
+  double		segmentation_fast_lungs[2];
+  double		segmentation_fast_balance;
 
   // SegmentationMask options.
   int			segmentationMask_skip_4_slices;
+  int			segmentationMask_imfill_3d;
+  int			segmentationMask_imfill_border;
 
   // Preselection options.
   double       		preselection_diameterMin;
@@ -88,3 +88,35 @@ void alnsb_step_free (s_alnsb_step_t* s)
   free (s->write);
   free (s);
 }
+
+
+/**
+ * Release the inputs and/or the outputs of a step, as selected by
+ * which (ALNSB_STEP_ADD_INPUT_IMG, ALNSB_STEP_ADD_OUTPUT_IMG or both
+ * or'ed), so that it can be run again.
+ *
+ */
+void alnsb_step_reset (s_alnsb_step_t* s, int which)
+{
+  if (! s)
+    return;
+  int i;
+  if (which & ALNSB_STEP_ADD_INPUT_IMG)
+    {
+      for (i = 0; i < s->num_reads; ++i)
+	if (s->read[i])
+	  image3D_free (s->read[i]);
+      free (s->read);
+      s->read = NULL;
+      s->num_reads = 0;
+    }
+  if (which & ALNSB_STEP_ADD_OUTPUT_IMG)
+    {
+      for (i = 0; i < s->num_writes; ++i)
+	if (s->write[i])
+	  image3D_free (s->write[i]);
+      free (s->write);
+      s->write = NULL;
+      s->num_writes = 0;
+    }
+}
@@ -47,6 +47,9 @@ void alnsb_step_push_output (s_alnsb_step_t** s, image3D* img);
 extern
 void alnsb_step_free (s_alnsb_step_t* s);
 
+extern
+void alnsb_step_reset (s_alnsb_step_t* s, int which);
+
 extern
 s_alnsb_step_t* alnsb_step_alloc ();
 
@@ -89,3 +89,35 @@ void alnsb_timer_print (FILE* f, char* message)
   polybench_timer_print (f);
   fprintf (f, "\n");
 }
+
+
+/**
+ * Wall clock time, in seconds.
+ *
+ */
+double alnsb_timer_wtime ()
+{
+  return rtclock ();
+}
+
+
+/**
+ * Start a budget of the given number of seconds from now; 0 or less
+ * is unlimited.
+ *
+ */
+void alnsb_budget_start (s_alnsb_budget_t* b, double seconds)
+{
+  b->deadline = seconds > 0 ? rtclock () + seconds : 0;
+}
+
+
+/**
+ * Returns 1 if the budget is limited and expired. Unlimited budgets
+ * do not read the clock.
+ *
+ */
+int alnsb_budget_expired (s_alnsb_budget_t* b)
+{
+  return b->deadline > 0 && rtclock () >= b->deadline;
+}
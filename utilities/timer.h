@@ -30,5 +30,27 @@ void alnsb_timer_stop ();
 extern
 void alnsb_timer_print (FILE* f, char* message);
 
+extern
+double alnsb_timer_wtime ();
+
+
+/**
+ * Wall clock time budget of a stage. A stage starts its budget, then
+ * polls it at points where it can stop with a usable result.
+ *
+ */
+struct alnsb_budget
+{
+  // Wall clock time at which the budget expires, 0 if unlimited.
+  double		deadline;
+};
+typedef struct alnsb_budget s_alnsb_budget_t;
+
+extern
+void alnsb_budget_start (s_alnsb_budget_t* b, double seconds);
+
+extern
+int alnsb_budget_expired (s_alnsb_budget_t* b);
+
 
 #endif //!ALNSB_TIMER_H